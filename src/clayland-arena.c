@@ -0,0 +1,272 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "clayland-arena.h"
+
+#define ARENA_BLOCK_SIZE 4096
+
+/* Every object is preceded by a header of this size, which also keeps
+ * the objects suitably aligned */
+#define ARENA_CHUNK_ALIGN 16
+
+/* Objects with a header of up to ARENA_N_SIZES * ARENA_CHUNK_ALIGN
+ * bytes come from the blocks. Anything bigger goes to g_malloc. */
+#define ARENA_N_SIZES 16
+
+typedef union
+{
+  struct
+  {
+    ClaylandArena *arena;
+    guint size_index;
+  } header;
+  guint8 padding[ARENA_CHUNK_ALIGN];
+} ClaylandArenaChunk;
+
+typedef union
+{
+  gpointer next;
+  guint8 padding[ARENA_CHUNK_ALIGN];
+} ClaylandArenaBlock;
+
+struct _ClaylandArena
+{
+  struct wl_listener client_destroy_listener;
+  /* Set once the client's destroy signal has been emitted. Its
+   * resources are destroyed after that, and anything they allocate
+   * meanwhile comes from g_malloc so that the blocks stop growing. */
+  gboolean client_destroyed;
+  /* Set once the client has been freed. The arena then goes with its
+   * last object. */
+  gboolean client_freed;
+
+  /* List of blocks linked through their first bytes */
+  ClaylandArenaBlock *blocks;
+  guint8 *next_free;
+  guint8 *block_end;
+
+  /* Freed chunks for each size, linked through their first bytes */
+  gpointer free_lists[ARENA_N_SIZES];
+
+  gsize n_objects;
+};
+
+/* Arenas of the clients that are being destroyed. They can't be found
+ * through the client's destroy listeners any more by then. The table
+ * is emptied from an idle callback, by which time the clients have
+ * been freed. */
+static GHashTable *dying_arenas;
+static struct wl_event_source *dying_arenas_idle;
+
+static struct wl_listener client_created_listener;
+static struct wl_listener display_destroy_listener;
+
+static void
+arena_destroy (ClaylandArena *arena)
+{
+  while (arena->blocks)
+    {
+      ClaylandArenaBlock *block = arena->blocks;
+
+      arena->blocks = block->next;
+      g_free (block);
+    }
+
+  g_slice_free (ClaylandArena, arena);
+}
+
+static void
+arena_forget_dying (void *data)
+{
+  GHashTableIter iter;
+  ClaylandArena *arena;
+
+  dying_arenas_idle = NULL;
+
+  g_hash_table_iter_init (&iter, dying_arenas);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &arena))
+    {
+      arena->client_freed = TRUE;
+      if (arena->n_objects == 0)
+        arena_destroy (arena);
+    }
+
+  g_hash_table_remove_all (dying_arenas);
+}
+
+static void
+arena_client_destroy_cb (struct wl_listener *listener,
+                         void *data)
+{
+  ClaylandArena *arena =
+    wl_container_of (listener, arena, client_destroy_listener);
+  struct wl_client *client = data;
+
+  /* The client's resources are destroyed after this so the arena is
+   * normally freed along with the last of their objects */
+  arena->client_destroyed = TRUE;
+  wl_list_remove (&listener->link);
+  wl_list_init (&listener->link);
+
+  g_hash_table_insert (dying_arenas, client, arena);
+
+  if (!dying_arenas_idle)
+    {
+      struct wl_display *display = wl_client_get_display (client);
+
+      dying_arenas_idle =
+        wl_event_loop_add_idle (wl_display_get_event_loop (display),
+                                arena_forget_dying,
+                                NULL);
+    }
+}
+
+ClaylandArena *
+clayland_arena_get (struct wl_client *client)
+{
+  ClaylandArena *arena;
+  struct wl_listener *listener;
+
+  listener = wl_client_get_destroy_listener (client, arena_client_destroy_cb);
+  if (listener)
+    return wl_container_of (listener, arena, client_destroy_listener);
+
+  arena = g_hash_table_lookup (dying_arenas, client);
+  if (arena)
+    return arena;
+
+  arena = g_slice_new0 (ClaylandArena);
+  arena->client_destroy_listener.notify = arena_client_destroy_cb;
+  wl_client_add_destroy_listener (client, &arena->client_destroy_listener);
+
+  return arena;
+}
+
+static gpointer
+arena_alloc_chunk (ClaylandArena *arena,
+                   gsize chunk_size)
+{
+  gpointer chunk;
+
+  if (arena->next_free + chunk_size > arena->block_end)
+    {
+      ClaylandArenaBlock *block = g_malloc (ARENA_BLOCK_SIZE);
+
+      /* Whatever was left of the previous block is wasted */
+      block->next = arena->blocks;
+      arena->blocks = block;
+      arena->next_free = (guint8 *) (block + 1);
+      arena->block_end = (guint8 *) block + ARENA_BLOCK_SIZE;
+    }
+
+  chunk = arena->next_free;
+  arena->next_free += chunk_size;
+
+  return chunk;
+}
+
+gpointer
+clayland_arena_alloc0 (ClaylandArena *arena,
+                       gsize size)
+{
+  gsize chunk_size = ((size + sizeof (ClaylandArenaChunk) +
+                       ARENA_CHUNK_ALIGN - 1) &
+                      ~(gsize) (ARENA_CHUNK_ALIGN - 1));
+  guint size_index = chunk_size / ARENA_CHUNK_ALIGN - 1;
+  ClaylandArenaChunk *chunk;
+
+  if (size_index >= ARENA_N_SIZES || arena->client_destroyed)
+    {
+      size_index = ARENA_N_SIZES;
+      chunk = g_malloc (chunk_size);
+    }
+  else if (arena->free_lists[size_index])
+    {
+      chunk = arena->free_lists[size_index];
+      arena->free_lists[size_index] = *(gpointer *) chunk;
+    }
+  else
+    chunk = arena_alloc_chunk (arena, chunk_size);
+
+  memset (chunk, 0, chunk_size);
+  chunk->header.arena = arena;
+  chunk->header.size_index = size_index;
+
+  arena->n_objects++;
+
+  return chunk + 1;
+}
+
+void
+clayland_arena_free (gpointer mem)
+{
+  ClaylandArenaChunk *chunk = (ClaylandArenaChunk *) mem - 1;
+  ClaylandArena *arena = chunk->header.arena;
+  guint size_index = chunk->header.size_index;
+
+  if (size_index == ARENA_N_SIZES)
+    g_free (chunk);
+  else
+    {
+      *(gpointer *) chunk = arena->free_lists[size_index];
+      arena->free_lists[size_index] = chunk;
+    }
+
+  if (--arena->n_objects == 0 && arena->client_freed)
+    arena_destroy (arena);
+}
+
+static void
+arena_client_created_cb (struct wl_listener *listener,
+                         void *data)
+{
+  clayland_arena_get (data);
+}
+
+static void
+arena_display_destroy_cb (struct wl_listener *listener,
+                          void *data)
+{
+  if (dying_arenas_idle)
+    {
+      wl_event_source_remove (dying_arenas_idle);
+      arena_forget_dying (NULL);
+    }
+
+  g_hash_table_destroy (dying_arenas);
+  dying_arenas = NULL;
+}
+
+void
+clayland_arena_init (struct wl_display *display)
+{
+  dying_arenas = g_hash_table_new (NULL, NULL);
+
+  client_created_listener.notify = arena_client_created_cb;
+  wl_display_add_client_created_listener (display, &client_created_listener);
+
+  display_destroy_listener.notify = arena_display_destroy_cb;
+  wl_display_add_destroy_listener (display, &display_destroy_listener);
+}
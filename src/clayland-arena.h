@@ -0,0 +1,60 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_ARENA_H__
+#define __CLAYLAND_ARENA_H__
+
+#include <glib.h>
+#include <wayland-server.h>
+
+/* Each client gets an arena for the small objects backing its
+ * protocol resources. Objects are carved out of page sized blocks and
+ * recycled through a free list per size so most allocations don't
+ * reach malloc. The blocks are all released at once when the client
+ * has disconnected and its last object has been freed. */
+
+typedef struct _ClaylandArena ClaylandArena;
+
+/* Gives every client that connects to the display an arena straight
+ * away, so that one exists for as long as the client does, including
+ * while it is being destroyed */
+void
+clayland_arena_init (struct wl_display *display);
+
+/* Returns the arena of the client, creating it on first use */
+ClaylandArena *
+clayland_arena_get (struct wl_client *client);
+
+/* Returns zeroed memory for an object of the given size */
+gpointer
+clayland_arena_alloc0 (ClaylandArena *arena,
+                       gsize size);
+
+/* Frees memory from clayland_arena_alloc0. The arena is found from
+ * the memory itself so this works while the client is being
+ * destroyed. */
+void
+clayland_arena_free (gpointer mem);
+
+#define clayland_arena_new0(client, type) \
+  ((type *) clayland_arena_alloc0 (clayland_arena_get (client), sizeof (type)))
+
+#endif /* __CLAYLAND_ARENA_H__ */
@@ -0,0 +1,598 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The clipboard manager keeps a compositor-owned copy of the current
+ * selection. As soon as a client sets the selection we ask it for
+ * every advertised MIME type and splice the data into memfds. Pastes
+ * are then served from those memfds without waking up the source
+ * client and once the source goes away the clipboard takes over the
+ * selection so that its contents survive the client exiting. */
+
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "clayland-clipboard.h"
+#include "clayland-data-device.h"
+
+/* Limit on the total size of all the cached MIME types of a selection.
+ * Types that would take us over the limit are left to the source
+ * client to serve. */
+#define CLIPBOARD_MAX_SIZE (32 * 1024 * 1024)
+#define CLIPBOARD_CHUNK_SIZE (64 * 1024)
+
+typedef struct
+{
+  ClaylandClipboard *clipboard;
+  const char *mime_type;
+
+  /* memfd holding the contents read so far */
+  int fd;
+  size_t size;
+  gboolean complete;
+
+  /* Read end of the pipe that the source client is writing to while
+   * the transfer is in progress */
+  int pipe_fd;
+  struct wl_event_source *event_source;
+} ClaylandClipboardEntry;
+
+typedef struct
+{
+  struct wl_list link;
+  ClaylandClipboard *clipboard;
+
+  /* Our own reference on the entry's memfd so that the write can
+   * outlive the selection changing */
+  int fd;
+  loff_t offset;
+  size_t size;
+  gboolean use_sendfile;
+
+  int target_fd;
+  struct wl_event_source *event_source;
+} ClaylandClipboardWriter;
+
+struct _ClaylandClipboard
+{
+  ClaylandSeat *seat;
+  struct wl_event_loop *loop;
+  struct wl_listener selection_listener;
+
+  /* The client source whose contents are being cached. This is reset
+   * to NULL when the client destroys it but the complete entries are
+   * kept. */
+  ClaylandDataSource *cached_source;
+  struct wl_listener cached_source_listener;
+
+  GList *entries;
+  size_t total_size;
+  gboolean take_over_pending;
+
+  /* Data source used to offer the cached contents once the client
+   * owning the selection has gone away */
+  ClaylandDataSource source;
+
+  struct wl_list writers;
+};
+
+static void clipboard_take_over (ClaylandClipboard *clipboard);
+
+static int
+clipboard_create_memfd (void)
+{
+#ifdef HAVE_MEMFD_CREATE
+  return memfd_create ("clayland-clipboard", MFD_CLOEXEC);
+#else
+  const char *path;
+  char *name;
+  int fd;
+
+  path = g_getenv ("XDG_RUNTIME_DIR");
+  if (!path)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  name = g_build_filename (path, "clayland-clipboard-XXXXXX", NULL);
+  fd = g_mkstemp_full (name, O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    unlink (name);
+  g_free (name);
+
+  return fd;
+#endif
+}
+
+static void
+clipboard_writer_free (ClaylandClipboardWriter *writer)
+{
+  if (writer->event_source)
+    wl_event_source_remove (writer->event_source);
+
+  close (writer->target_fd);
+  close (writer->fd);
+
+  wl_list_remove (&writer->link);
+  g_slice_free (ClaylandClipboardWriter, writer);
+}
+
+static int
+clipboard_writer_data (int fd, uint32_t mask, void *data)
+{
+  ClaylandClipboardWriter *writer = data;
+  ssize_t len = 0;
+
+  while (writer->offset < writer->size)
+    {
+      if (!writer->use_sendfile)
+        {
+          len = splice (writer->fd, &writer->offset,
+                        writer->target_fd, NULL,
+                        writer->size - writer->offset,
+                        SPLICE_F_NONBLOCK);
+
+          /* splice only works if the target is a pipe */
+          if (len < 0 && errno == EINVAL)
+            {
+              writer->use_sendfile = TRUE;
+              continue;
+            }
+        }
+      else
+        {
+          off_t offset = writer->offset;
+
+          len = sendfile (writer->target_fd, writer->fd, &offset,
+                          writer->size - writer->offset);
+          if (len > 0)
+            writer->offset = offset;
+        }
+
+      if (len < 0 && errno == EINTR)
+        continue;
+
+      if (len < 0 && errno == EAGAIN)
+        {
+          if (!writer->event_source)
+            writer->event_source =
+              wl_event_loop_add_fd (writer->clipboard->loop,
+                                    writer->target_fd,
+                                    WL_EVENT_WRITABLE,
+                                    clipboard_writer_data,
+                                    writer);
+          return 0;
+        }
+
+      if (len <= 0)
+        break;
+    }
+
+  clipboard_writer_free (writer);
+
+  return 0;
+}
+
+static void
+clipboard_write_entry (ClaylandClipboard *clipboard,
+                       ClaylandClipboardEntry *entry,
+                       int fd)
+{
+  ClaylandClipboardWriter *writer;
+  int flags;
+
+  writer = g_slice_new0 (ClaylandClipboardWriter);
+  writer->clipboard = clipboard;
+  writer->fd = fcntl (entry->fd, F_DUPFD_CLOEXEC, 0);
+  if (writer->fd < 0)
+    {
+      g_slice_free (ClaylandClipboardWriter, writer);
+      close (fd);
+      return;
+    }
+  writer->size = entry->size;
+  writer->target_fd = fd;
+
+  /* The receiving client may not read the data straight away so we
+   * don't want to block on it */
+  flags = fcntl (fd, F_GETFL);
+  if (flags != -1)
+    fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+
+  wl_list_insert (&clipboard->writers, &writer->link);
+
+  clipboard_writer_data (fd, WL_EVENT_WRITABLE, writer);
+}
+
+static ClaylandClipboardEntry *
+clipboard_find_entry (ClaylandClipboard *clipboard,
+                      const char *mime_type)
+{
+  GList *l;
+
+  for (l = clipboard->entries; l; l = l->next)
+    {
+      ClaylandClipboardEntry *entry = l->data;
+
+      if (entry->complete && !strcmp (entry->mime_type, mime_type))
+        return entry;
+    }
+
+  return NULL;
+}
+
+static void
+clipboard_entry_stop_transfer (ClaylandClipboardEntry *entry)
+{
+  if (entry->event_source)
+    {
+      wl_event_source_remove (entry->event_source);
+      entry->event_source = NULL;
+    }
+
+  if (entry->pipe_fd >= 0)
+    {
+      close (entry->pipe_fd);
+      entry->pipe_fd = -1;
+    }
+}
+
+static void
+clipboard_entry_free (ClaylandClipboardEntry *entry)
+{
+  clipboard_entry_stop_transfer (entry);
+
+  close (entry->fd);
+  clayland_mime_type_unref (entry->mime_type);
+
+  g_slice_free (ClaylandClipboardEntry, entry);
+}
+
+static void
+clipboard_drop_entry (ClaylandClipboard *clipboard,
+                      ClaylandClipboardEntry *entry)
+{
+  clipboard->entries = g_list_remove (clipboard->entries, entry);
+  clipboard->total_size -= entry->size;
+  clipboard_entry_free (entry);
+}
+
+static int
+clipboard_entry_data (int fd, uint32_t mask, void *data)
+{
+  ClaylandClipboardEntry *entry = data;
+  ClaylandClipboard *clipboard = entry->clipboard;
+  ssize_t len;
+
+  for (;;)
+    {
+      loff_t offset = entry->size;
+
+      len = splice (fd, NULL, entry->fd, &offset,
+                    CLIPBOARD_CHUNK_SIZE,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (len > 0)
+        {
+          entry->size += len;
+          clipboard->total_size += len;
+
+          if (clipboard->total_size > CLIPBOARD_MAX_SIZE)
+            {
+              g_warning ("Not caching clipboard contents for %s: "
+                         "selection exceeds %d bytes",
+                         entry->mime_type, CLIPBOARD_MAX_SIZE);
+              clipboard->total_size -= entry->size;
+              entry->size = 0;
+              clipboard_entry_stop_transfer (entry);
+              if (ftruncate (entry->fd, 0) < 0)
+                clipboard_drop_entry (clipboard, entry);
+              return 0;
+            }
+
+          continue;
+        }
+
+      if (len < 0 && errno == EINTR)
+        continue;
+
+      if (len < 0 && errno == EAGAIN)
+        return 0;
+
+      break;
+    }
+
+  if (len == 0)
+    entry->complete = TRUE;
+  else
+    g_warning ("Failed to read clipboard contents for %s: %s",
+               entry->mime_type, strerror (errno));
+
+  clipboard_entry_stop_transfer (entry);
+
+  if (entry->complete &&
+      clipboard->take_over_pending &&
+      clipboard->seat->selection_data_source == NULL)
+    clipboard_take_over (clipboard);
+
+  return 0;
+}
+
+static ClaylandClipboardEntry *
+clipboard_entry_new (ClaylandClipboard *clipboard,
+                     ClaylandDataSource *source,
+                     const char *mime_type)
+{
+  ClaylandClipboardEntry *entry;
+  int p[2];
+  int flags;
+
+  /* Only our end of the pipe is non-blocking. Clients commonly just
+   * write () the data in a loop. */
+  if (pipe2 (p, O_CLOEXEC) < 0)
+    return NULL;
+
+  flags = fcntl (p[0], F_GETFL);
+  if (flags != -1)
+    fcntl (p[0], F_SETFL, flags | O_NONBLOCK);
+
+  entry = g_slice_new0 (ClaylandClipboardEntry);
+  entry->clipboard = clipboard;
+  entry->fd = clipboard_create_memfd ();
+  if (entry->fd < 0)
+    {
+      g_warning ("Failed to create clipboard buffer: %s", strerror (errno));
+      g_slice_free (ClaylandClipboardEntry, entry);
+      close (p[0]);
+      close (p[1]);
+      return NULL;
+    }
+
+  entry->mime_type = clayland_mime_type_intern (mime_type);
+  entry->pipe_fd = p[0];
+  entry->event_source = wl_event_loop_add_fd (clipboard->loop,
+                                              p[0],
+                                              WL_EVENT_READABLE,
+                                              clipboard_entry_data,
+                                              entry);
+
+  /* This takes ownership of the write end */
+  source->send (source, mime_type, p[1]);
+
+  return entry;
+}
+
+static void
+clipboard_reset (ClaylandClipboard *clipboard)
+{
+  /* Detach any offers that still refer to our own source */
+  wl_signal_emit (&clipboard->source.destroy_signal, &clipboard->source);
+  wl_signal_init (&clipboard->source.destroy_signal);
+  clipboard->source.mime_types.size = 0;
+
+  if (clipboard->cached_source)
+    {
+      wl_list_remove (&clipboard->cached_source_listener.link);
+      clipboard->cached_source = NULL;
+    }
+
+  g_list_free_full (clipboard->entries,
+                    (GDestroyNotify) clipboard_entry_free);
+  clipboard->entries = NULL;
+  clipboard->total_size = 0;
+  clipboard->take_over_pending = FALSE;
+}
+
+static void
+clipboard_cache_source (ClaylandClipboard *clipboard,
+                        ClaylandDataSource *source)
+{
+  char **p;
+
+  clipboard->cached_source = source;
+  wl_signal_add (&source->destroy_signal,
+                 &clipboard->cached_source_listener);
+
+  wl_array_for_each (p, &source->mime_types)
+    {
+      ClaylandClipboardEntry *entry =
+        clipboard_entry_new (clipboard, source, *p);
+
+      if (entry)
+        clipboard->entries = g_list_append (clipboard->entries, entry);
+    }
+}
+
+static void
+clipboard_take_over (ClaylandClipboard *clipboard)
+{
+  ClaylandSeat *seat = clipboard->seat;
+  gboolean transfers_pending = FALSE;
+  GList *l;
+
+  clipboard->source.mime_types.size = 0;
+
+  for (l = clipboard->entries; l; l = l->next)
+    {
+      ClaylandClipboardEntry *entry = l->data;
+
+      if (entry->complete)
+        {
+          const char **p = wl_array_add (&clipboard->source.mime_types,
+                                         sizeof *p);
+          if (p)
+            *p = entry->mime_type;
+        }
+      else if (entry->event_source)
+        transfers_pending = TRUE;
+    }
+
+  /* If nothing has finished reading yet then we'll try again when one
+   * of the transfers completes */
+  if (clipboard->source.mime_types.size == 0)
+    {
+      clipboard->take_over_pending = transfers_pending;
+      return;
+    }
+
+  clipboard->take_over_pending = FALSE;
+  clayland_seat_set_selection (seat,
+                               &clipboard->source,
+                               seat->selection_serial);
+}
+
+static void
+clipboard_selection_changed (struct wl_listener *listener, void *data)
+{
+  ClaylandClipboard *clipboard =
+    wl_container_of (listener, clipboard, selection_listener);
+  ClaylandDataSource *source = clipboard->seat->selection_data_source;
+
+  if (source == &clipboard->source)
+    return;
+
+  /* The selection only gets unset when its source is destroyed */
+  if (source == NULL)
+    {
+      clipboard_take_over (clipboard);
+      return;
+    }
+
+  clipboard_reset (clipboard);
+  clipboard_cache_source (clipboard, source);
+}
+
+static void
+clipboard_cached_source_destroyed (struct wl_listener *listener, void *data)
+{
+  ClaylandClipboard *clipboard =
+    wl_container_of (listener, clipboard, cached_source_listener);
+  GList *l, *next;
+
+  clipboard->cached_source = NULL;
+
+  /* A client going away closes its end of the pipes so anything still
+   * being read would look complete even though it was cut short */
+  for (l = clipboard->entries; l; l = next)
+    {
+      ClaylandClipboardEntry *entry = l->data;
+
+      next = l->next;
+      if (!entry->complete)
+        clipboard_drop_entry (clipboard, entry);
+    }
+
+  clipboard->take_over_pending = FALSE;
+}
+
+static void
+clipboard_source_accept (ClaylandDataSource *source,
+                         uint32_t serial,
+                         const char *mime_type)
+{
+}
+
+static void
+clipboard_source_send (ClaylandDataSource *source,
+                       const char *mime_type,
+                       int32_t fd)
+{
+  ClaylandClipboard *clipboard = wl_container_of (source, clipboard, source);
+  ClaylandClipboardEntry *entry = clipboard_find_entry (clipboard, mime_type);
+
+  if (entry)
+    clipboard_write_entry (clipboard, entry, fd);
+  else
+    close (fd);
+}
+
+static void
+clipboard_source_cancel (ClaylandDataSource *source)
+{
+}
+
+gboolean
+clayland_clipboard_send (ClaylandClipboard *clipboard,
+                         ClaylandDataSource *source,
+                         const char *mime_type,
+                         int32_t fd)
+{
+  ClaylandClipboardEntry *entry;
+
+  if (source != clipboard->cached_source)
+    return FALSE;
+
+  entry = clipboard_find_entry (clipboard, mime_type);
+  if (!entry)
+    return FALSE;
+
+  clipboard_write_entry (clipboard, entry, fd);
+
+  return TRUE;
+}
+
+ClaylandClipboard *
+clayland_clipboard_new (ClaylandSeat *seat)
+{
+  ClaylandClipboard *clipboard = g_slice_new0 (ClaylandClipboard);
+
+  clipboard->seat = seat;
+  clipboard->loop = wl_display_get_event_loop (seat->display);
+  wl_list_init (&clipboard->writers);
+
+  wl_signal_init (&clipboard->source.destroy_signal);
+  wl_array_init (&clipboard->source.mime_types);
+  clipboard->source.accept = clipboard_source_accept;
+  clipboard->source.send = clipboard_source_send;
+  clipboard->source.cancel = clipboard_source_cancel;
+
+  clipboard->cached_source_listener.notify = clipboard_cached_source_destroyed;
+
+  clipboard->selection_listener.notify = clipboard_selection_changed;
+  wl_signal_add (&seat->selection_signal, &clipboard->selection_listener);
+
+  return clipboard;
+}
+
+void
+clayland_clipboard_free (ClaylandClipboard *clipboard)
+{
+  ClaylandClipboardWriter *writer, *next;
+
+  wl_list_remove (&clipboard->selection_listener.link);
+
+  clipboard_reset (clipboard);
+
+  wl_list_for_each_safe (writer, next, &clipboard->writers, link)
+    clipboard_writer_free (writer);
+
+  wl_array_release (&clipboard->source.mime_types);
+
+  g_slice_free (ClaylandClipboard, clipboard);
+}
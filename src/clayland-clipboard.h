@@ -0,0 +1,46 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_CLIPBOARD_H__
+#define __CLAYLAND_CLIPBOARD_H__
+
+#include <wayland-server.h>
+#include <glib.h>
+
+#include "clayland-seat.h"
+
+ClaylandClipboard *
+clayland_clipboard_new (ClaylandSeat *seat);
+
+/* Serves a wl_data_offer.receive for the given source from the
+ * compositor's copy of the selection. Returns FALSE if the contents
+ * aren't cached, in which case the caller should forward the request
+ * to the source. */
+gboolean
+clayland_clipboard_send (ClaylandClipboard *clipboard,
+                         ClaylandDataSource *source,
+                         const char *mime_type,
+                         int32_t fd);
+
+void
+clayland_clipboard_free (ClaylandClipboard *clipboard);
+
+#endif /* __CLAYLAND_CLIPBOARD_H__ */
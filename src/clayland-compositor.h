@@ -28,6 +28,8 @@
 #include <cairo.h>
 
 typedef struct _ClaylandCompositor ClaylandCompositor;
+typedef struct _ClaylandShellSurface ClaylandShellSurface;
+typedef struct _ClaylandClient ClaylandClient;
 
 typedef struct
 {
@@ -51,16 +53,58 @@ typedef struct
   struct wl_listener destroy_listener;
 } ClaylandBufferReference;
 
+/* State set through wp_viewport. The source rectangle is in buffer
+ * coordinates once the buffer transform and scale have been applied
+ * and has a negative width when it isn't set. The
+ * destination size is -1x-1 when it isn't set. */
 typedef struct
+{
+  double src_x;
+  double src_y;
+  double src_width;
+  double src_height;
+  int dst_width;
+  int dst_height;
+} ClaylandViewportState;
+
+typedef struct _ClaylandSurface ClaylandSurface;
+
+struct _ClaylandSurface
 {
   ClaylandCompositor *compositor;
+  ClaylandClient *client;
 
   struct wl_resource *resource;
+  /* Position of the window in stage coordinates. The actor, if there
+   * is one, is kept at the same place. */
   int x;
   int y;
   ClaylandBufferReference buffer_ref;
   ClutterActor *actor;
-  gboolean has_shell_surface;
+  /* Link in ClaylandCompositor::stack while the surface is a window */
+  struct wl_list stack_link;
+  ClaylandShellSurface *shell_surface;
+
+  /* Area of the surface known to be opaque or NULL */
+  cairo_region_t *opaque_region;
+
+  /* wl_surface.set_buffer_scale and set_buffer_transform */
+  int32_t buffer_scale;
+  int32_t buffer_transform;
+
+  /* wp_viewport object of the surface, if it has one */
+  struct wl_resource *viewport_resource;
+  ClaylandViewportState viewport;
+
+  /* Surfaces with a role (such as the cursor or a DnD icon) get this
+   * called at commit time with the attach offset. Their actor isn't
+   * added to the stage as a window. */
+  void (*configure) (ClaylandSurface *surface, int32_t sx, int32_t sy);
+  void *configure_private;
+
+  /* Set by the shells to ping the client of one of their surfaces.
+   * The answer goes to clayland_compositor_client_pong(). */
+  void (*ping) (ClaylandSurface *surface, guint32 serial);
 
   struct wl_signal destroy_signal;
 
@@ -74,12 +118,224 @@ typedef struct
     int32_t sx;
     int32_t sy;
 
-    /* wl_surface.damage */
+    /* wl_surface.damage, in surface coordinates */
     cairo_region_t *damage;
+    /* wl_surface.damage_buffer, in buffer pixels */
+    cairo_region_t *buffer_damage;
+
+    /* wl_surface.set_opaque_region */
+    gboolean opaque_region_set;
+    cairo_region_t *opaque_region;
+
+    /* wl_surface.set_buffer_scale and set_buffer_transform */
+    int32_t buffer_scale;
+    int32_t buffer_transform;
+
+    /* wp_viewport.set_source and set_destination */
+    gboolean viewport_changed;
+    ClaylandViewportState viewport;
 
     /* wl_surface.frame */
     struct wl_list frame_callback_list;
   } pending;
-} ClaylandSurface;
+
+  /* Frame callbacks, damage and buffers committed while the client
+   * was not responding to pings. They are applied once it responds
+   * again. The damage is in buffer pixels. held_attach is set when the
+   * actor hasn't been given the current buffer yet. */
+  struct wl_list held_frame_callback_list;
+  cairo_region_t *held_damage;
+  gboolean held_attach;
+};
+
+/* flags only has WL_OUTPUT_MODE_PREFERRED. Whether the mode is the
+ * current one is sent from ClaylandOutput::current_mode. */
+typedef struct
+{
+  guint32 flags;
+  int width;
+  int height;
+  /* In mHz */
+  int refresh;
+} ClaylandMode;
+
+/* A monitor showing a region of the stage. Each output has its own
+ * frame clock and the frame callbacks of the surfaces on it are paced
+ * to it. */
+typedef struct
+{
+  ClaylandCompositor *compositor;
+  struct wl_global *global;
+  /* wl_output resources bound by the clients */
+  struct wl_list resource_list;
+
+  /* Region of the stage shown on the output. The size and refresh
+   * rate in mHz are those of the current mode. */
+  int x;
+  int y;
+  int width;
+  int height;
+  int width_mm;
+  int height_mm;
+  int refresh;
+
+  /* The modes the output supports, the preferred one first */
+  GList *modes;
+  ClaylandMode *current_mode;
+  /* Fullscreen surface whose driver method chose the current mode, if
+   * any. The preferred mode is restored when it lets go of it. */
+  ClaylandShellSurface *mode_owner;
+
+  /* Frame callbacks of the surfaces on the output, sent no more often
+   * than the refresh rate */
+  struct wl_list frame_callbacks;
+  struct wl_event_source *frame_timer;
+  gboolean frame_timer_armed;
+  gint64 last_frame;
+} ClaylandOutput;
+
+struct _ClaylandCompositor
+{
+  struct wl_display *wayland_display;
+  struct wl_event_loop *wayland_loop;
+  /* NULL when running headless */
+  ClutterActor *stage;
+  struct _ClaylandHeadless *headless;
+  /* The first output is the primary one */
+  GList *outputs;
+  GSource *wayland_event_source;
+  GList *surfaces;
+
+  /* Windows from the bottom to the top of the stacking */
+  struct wl_list stack;
+
+  /* Emitted after each frame has been painted */
+  struct wl_signal frame_signal;
+
+  /* Emitted with the ClaylandOutput when its mode changes, once the
+   * stage and the wl_shell surfaces have been updated */
+  struct wl_signal output_changed_signal;
+
+  /* Shell surfaces with a configure to send after the next frame */
+  struct wl_list shell_configure_list;
+
+  /* Topmost fullscreen surface while it covers its output. In that
+   * case all of the other windows are hidden so only it gets painted
+   * and, if it asked for a framerate, its frame callbacks are paced. */
+  ClaylandShellSurface *fullscreen_surface;
+  struct wl_list fullscreen_frame_callbacks;
+  struct wl_event_source *fullscreen_frame_timer;
+  gint64 fullscreen_last_frame;
+
+  /* Map from wl_client to ClaylandClient */
+  GHashTable *clients;
+  struct wl_event_source *ping_timer;
+  /* Emitted with the wl_client when it stops answering pings and
+   * again once it answers */
+  struct wl_signal client_unresponsive_signal;
+
+  int xwayland_display_index;
+  char *xwayland_lockfile;
+  int xwayland_abstract_fd;
+  int xwayland_unix_fd;
+  /* Watches on the X sockets while no X server is running */
+  struct wl_event_source *xwayland_abstract_source;
+  struct wl_event_source *xwayland_unix_source;
+  pid_t xwayland_pid;
+  gint64 xwayland_start_time;
+  /* Number of times in a row the server died soon after starting */
+  int xwayland_crashes;
+  struct wl_event_source *xwayland_restart_timer;
+  struct wl_client *xwayland_client;
+  struct wl_resource *xserver_resource;
+  struct _ClaylandXwm *xwm;
+
+  struct _ClaylandSeat *seat;
+  struct _ClaylandXdgShell *xdg_shell;
+  struct _ClaylandViewporter *viewporter;
+};
+
+/* This should be called whenever the window stacking changes to
+   update the current position on all of the input devices */
+void
+clayland_compositor_repick (ClaylandCompositor *compositor);
+
+void
+clayland_compositor_queue_redraw (ClaylandCompositor *compositor);
+
+/* Sends whatever was waiting for a frame to be painted. It's called
+   by the renderer once it has painted a frame of the output, or with
+   NULL when it painted all of the outputs at once. */
+void
+clayland_compositor_finish_frame (ClaylandCompositor *compositor,
+                                  ClaylandOutput *output);
+
+/* Switches the output to one of its modes. The stage is resized and
+   the windows on the output are laid out again. */
+void
+clayland_output_set_mode (ClaylandOutput *output,
+                          ClaylandMode *mode);
+
+/* Gets the output showing most of the surface, or the primary output
+   if it isn't on any of them */
+ClaylandOutput *
+clayland_compositor_get_surface_output (ClaylandCompositor *compositor,
+                                        ClaylandSurface *surface);
+
+/* Called by the shells when a client answers a ping. A client that
+   was considered hung starts getting its updates painted again. */
+void
+clayland_compositor_client_pong (ClaylandCompositor *compositor,
+                                 struct wl_client *wayland_client,
+                                 guint32 serial);
+
+/* Whether the client has stopped answering pings. The compositor's
+   client_unresponsive_signal is emitted whenever this changes. */
+gboolean
+clayland_compositor_client_is_unresponsive (ClaylandCompositor *compositor,
+                                            struct wl_client *wayland_client);
+/* Gets the output showing the point in stage coordinates, or the
+   primary output if it isn't on any of them */
+ClaylandOutput *
+clayland_compositor_get_output_at (ClaylandCompositor *compositor,
+                                   int x,
+                                   int y);
+
+/* Repaints the whole area covered by a window, for example when it has
+   been restacked */
+void
+clayland_compositor_damage_window (ClaylandCompositor *compositor,
+                                   ClaylandSurface *surface);
+
+void
+clayland_surface_set_position (ClaylandSurface *surface,
+                               int x,
+                               int y);
+
+/* Gets the size of the surface in surface coordinates, taking the
+   buffer scale, buffer transform and viewport into account. It is 0x0
+   until a buffer has been attached. */
+void
+clayland_surface_get_size (ClaylandSurface *surface,
+                           float *width,
+                           float *height);
+
+/* Gets the size of the attached buffer in pixels */
+void
+clayland_surface_get_buffer_size (ClaylandSurface *surface,
+                                  float *width,
+                                  float *height);
+
+/* Gets the size of the attached buffer once the buffer scale and
+   transform have been applied but not the viewport */
+void
+clayland_surface_get_scaled_buffer_size (ClaylandSurface *surface,
+                                         float *width,
+                                         float *height);
+
+/* Gets the matrix mapping buffer pixels to surface coordinates */
+void
+clayland_surface_get_buffer_matrix (ClaylandSurface *surface,
+                                    cairo_matrix_t *matrix);
 
 #endif /* __CLAYLAND_COMPOSITOR_H__ */
@@ -0,0 +1,136 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "clayland-damage.h"
+
+struct _ClaylandDamage
+{
+  cairo_rectangle_int_t extents;
+
+  /* Damage since the last frame */
+  cairo_region_t *current;
+
+  /* Damage of the past frames, the most recent first */
+  cairo_region_t *history[CLAYLAND_DAMAGE_HISTORY];
+  int history_length;
+};
+
+ClaylandDamage *
+clayland_damage_new (int width,
+                     int height)
+{
+  ClaylandDamage *damage = g_slice_new0 (ClaylandDamage);
+
+  damage->extents.width = width;
+  damage->extents.height = height;
+  damage->current = cairo_region_create ();
+
+  return damage;
+}
+
+void
+clayland_damage_add_rectangle (ClaylandDamage *damage,
+                               const cairo_rectangle_int_t *rectangle)
+{
+  cairo_region_t *region = cairo_region_create_rectangle (rectangle);
+
+  clayland_damage_add_region (damage, region, 0, 0);
+  cairo_region_destroy (region);
+}
+
+void
+clayland_damage_add_region (ClaylandDamage *damage,
+                            const cairo_region_t *region,
+                            int x,
+                            int y)
+{
+  cairo_region_t *copy;
+
+  if (cairo_region_is_empty (region))
+    return;
+
+  copy = cairo_region_copy (region);
+  cairo_region_translate (copy, x, y);
+  cairo_region_intersect_rectangle (copy, &damage->extents);
+  cairo_region_union (damage->current, copy);
+  cairo_region_destroy (copy);
+}
+
+void
+clayland_damage_add_all (ClaylandDamage *damage)
+{
+  cairo_region_union_rectangle (damage->current, &damage->extents);
+}
+
+gboolean
+clayland_damage_is_empty (ClaylandDamage *damage)
+{
+  return cairo_region_is_empty (damage->current);
+}
+
+cairo_region_t *
+clayland_damage_get_for_age (ClaylandDamage *damage,
+                             int age)
+{
+  cairo_region_t *region;
+  int i;
+
+  /* A buffer painted in the last frame only misses the new damage */
+  if (age <= 0 || age - 1 > damage->history_length)
+    return cairo_region_create_rectangle (&damage->extents);
+
+  region = cairo_region_copy (damage->current);
+  for (i = 0; i < age - 1; i++)
+    cairo_region_union (region, damage->history[i]);
+
+  return region;
+}
+
+void
+clayland_damage_end_frame (ClaylandDamage *damage)
+{
+  if (damage->history_length == CLAYLAND_DAMAGE_HISTORY)
+    cairo_region_destroy (damage->history[--damage->history_length]);
+
+  memmove (damage->history + 1,
+           damage->history,
+           damage->history_length * sizeof (cairo_region_t *));
+  damage->history[0] = damage->current;
+  damage->history_length++;
+
+  damage->current = cairo_region_create ();
+}
+
+void
+clayland_damage_free (ClaylandDamage *damage)
+{
+  int i;
+
+  for (i = 0; i < damage->history_length; i++)
+    cairo_region_destroy (damage->history[i]);
+  cairo_region_destroy (damage->current);
+
+  g_slice_free (ClaylandDamage, damage);
+}
@@ -0,0 +1,75 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_DAMAGE_H__
+#define __CLAYLAND_DAMAGE_H__
+
+#include <glib.h>
+#include <cairo.h>
+
+/* Accumulates the damage to an output in stage coordinates. The damage
+ * of the last few frames is kept as well so that a renderer painting
+ * into one of several buffers can tell what is out of date in it from
+ * the age of its contents. */
+
+/* Number of past frames remembered */
+#define CLAYLAND_DAMAGE_HISTORY 4
+
+typedef struct _ClaylandDamage ClaylandDamage;
+
+ClaylandDamage *
+clayland_damage_new (int width,
+                     int height);
+
+void
+clayland_damage_add_rectangle (ClaylandDamage *damage,
+                               const cairo_rectangle_int_t *rectangle);
+
+/* Adds the region, given relative to x,y */
+void
+clayland_damage_add_region (ClaylandDamage *damage,
+                            const cairo_region_t *region,
+                            int x,
+                            int y);
+
+void
+clayland_damage_add_all (ClaylandDamage *damage);
+
+/* Whether anything was damaged since the last frame */
+gboolean
+clayland_damage_is_empty (ClaylandDamage *damage);
+
+/* Returns a new region with the area to repaint in a buffer that was
+ * last painted age frames ago. An age of 0 means the contents are
+ * unknown so all of it has to be repainted. */
+cairo_region_t *
+clayland_damage_get_for_age (ClaylandDamage *damage,
+                             int age);
+
+/* Moves the damage of the frame that has just been painted to the
+ * history */
+void
+clayland_damage_end_frame (ClaylandDamage *damage);
+
+void
+clayland_damage_free (ClaylandDamage *damage);
+
+#endif /* __CLAYLAND_DAMAGE_H__ */
@@ -31,6 +31,62 @@
 #include "clayland-data-device.h"
 #include "clayland-seat.h"
 #include "clayland-pointer.h"
+#include "clayland-clipboard.h"
+#include "clayland-arena.h"
+
+typedef struct
+{
+  char *name;
+  guint ref_count;
+} ClaylandMimeType;
+
+/* Compositor-wide table of MIME type strings. Office applications
+ * advertise dozens of types for every selection so we only want to
+ * keep a single copy of each of them around. */
+static GHashTable *mime_type_table;
+
+static void
+mime_type_free (ClaylandMimeType *mime_type)
+{
+  g_free (mime_type->name);
+  g_slice_free (ClaylandMimeType, mime_type);
+}
+
+const char *
+clayland_mime_type_intern (const char *name)
+{
+  ClaylandMimeType *mime_type;
+
+  if (mime_type_table == NULL)
+    mime_type_table =
+      g_hash_table_new_full (g_str_hash, g_str_equal,
+                             NULL, /* the key is owned by the value */
+                             (GDestroyNotify) mime_type_free);
+
+  mime_type = g_hash_table_lookup (mime_type_table, name);
+  if (mime_type == NULL)
+    {
+      mime_type = g_slice_new (ClaylandMimeType);
+      mime_type->name = g_strdup (name);
+      mime_type->ref_count = 0;
+      g_hash_table_insert (mime_type_table, mime_type->name, mime_type);
+    }
+
+  mime_type->ref_count++;
+
+  return mime_type->name;
+}
+
+void
+clayland_mime_type_unref (const char *name)
+{
+  ClaylandMimeType *mime_type = g_hash_table_lookup (mime_type_table, name);
+
+  g_return_if_fail (mime_type != NULL);
+
+  if (--mime_type->ref_count == 0)
+    g_hash_table_remove (mime_type_table, name);
+}
 
 static void
 data_offer_accept (struct wl_client *client,
@@ -53,9 +109,18 @@ data_offer_receive (struct wl_client *client, struct wl_resource *resource,
                     const char *mime_type, int32_t fd)
 {
   ClaylandDataOffer *offer = wl_resource_get_user_data (resource);
+  ClaylandClipboard *clipboard = offer->seat->clipboard;
 
   if (offer->source)
-    offer->source->send (offer->source, mime_type, fd);
+    {
+      /* Avoid waking up the source client if the compositor already
+       * has a copy of the data */
+      if (clipboard &&
+          clayland_clipboard_send (clipboard, offer->source, mime_type, fd))
+        return;
+
+      offer->source->send (offer->source, mime_type, fd);
+    }
   else
     close (fd);
 }
@@ -79,7 +144,8 @@ destroy_data_offer (struct wl_resource *resource)
 
   if (offer->source)
     wl_list_remove (&offer->source_destroy_listener.link);
-  free (offer);
+  wl_list_remove (&offer->link);
+  clayland_arena_free (offer);
 }
 
 static void
@@ -90,6 +156,10 @@ destroy_offer_data_source (struct wl_listener *listener, void *data)
   offer = wl_container_of (listener, offer, source_destroy_listener);
 
   offer->source = NULL;
+
+  /* A dead source can't be the selection anymore */
+  wl_list_remove (&offer->link);
+  wl_list_init (&offer->link);
 }
 
 static struct wl_resource *
@@ -97,17 +167,18 @@ clayland_data_source_send_offer (ClaylandDataSource *source,
                                  struct wl_resource *target)
 {
   ClaylandDataOffer *offer;
-  char **p;
+  const char **p;
 
-  offer = malloc (sizeof *offer);
-  if (offer == NULL)
-    return NULL;
+  offer = clayland_arena_new0 (wl_resource_get_client (target),
+                               ClaylandDataOffer);
+  wl_list_init (&offer->link);
 
   offer->resource = wl_client_new_object (wl_resource_get_client (target),
                                           &wl_data_offer_interface,
                                           &data_offer_interface, offer);
   wl_resource_set_destructor (offer->resource, destroy_data_offer);
 
+  offer->seat = wl_resource_get_user_data (target);
   offer->source = source;
   offer->source_destroy_listener.notify = destroy_offer_data_source;
   wl_signal_add (&source->destroy_signal,
@@ -121,17 +192,42 @@ clayland_data_source_send_offer (ClaylandDataSource *source,
   return offer->resource;
 }
 
+static void
+reset_offer_list (struct wl_list *offer_list)
+{
+  ClaylandDataOffer *offer, *next;
+
+  wl_list_for_each_safe (offer, next, offer_list, link)
+    {
+      wl_list_remove (&offer->link);
+      wl_list_init (&offer->link);
+    }
+}
+
+static ClaylandDataOffer *
+find_offer_for_client (struct wl_list *offer_list,
+                       struct wl_client *client)
+{
+  ClaylandDataOffer *offer;
+
+  wl_list_for_each (offer, offer_list, link)
+    if (wl_resource_get_client (offer->resource) == client)
+      return offer;
+
+  return NULL;
+}
+
 static void
 data_source_offer (struct wl_client *client,
                    struct wl_resource *resource, const char *type)
 {
   ClaylandDataSource *source = wl_resource_get_user_data (resource);
-  char **p;
+  const char **p;
 
   p = wl_array_add (&source->mime_types, sizeof *p);
   if (p)
-    *p = strdup (type);
-  if (!p || !*p)
+    *p = clayland_mime_type_intern (type);
+  else
     wl_resource_post_no_memory (resource);
 }
 
@@ -154,6 +250,41 @@ destroy_drag_focus (struct wl_listener *listener, void *data)
   seat->drag_focus_resource = NULL;
 }
 
+static void
+drag_cancel_motion (ClaylandSeat *seat)
+{
+  if (seat->drag_motion_pending)
+    {
+      seat->drag_motion_pending = FALSE;
+      wl_event_source_timer_update (seat->drag_motion_timer, 0);
+    }
+}
+
+static void
+drag_flush_motion (ClaylandSeat *seat)
+{
+  if (!seat->drag_motion_pending)
+    return;
+
+  drag_cancel_motion (seat);
+
+  if (seat->drag_focus_resource)
+    wl_data_device_send_motion (seat->drag_focus_resource,
+                                seat->drag_motion_time,
+                                seat->drag_motion_x,
+                                seat->drag_motion_y);
+
+  seat->drag_motion_last_sent = g_get_monotonic_time () / 1000;
+}
+
+static int
+drag_motion_timer_cb (void *data)
+{
+  drag_flush_motion (data);
+
+  return 0;
+}
+
 static void
 drag_grab_focus (ClaylandPointerGrab *grab,
                  ClaylandSurface *surface,
@@ -166,6 +297,9 @@ drag_grab_focus (ClaylandPointerGrab *grab,
   struct wl_display *display;
   guint32 serial;
 
+  /* Any coalesced motion was for the previous target */
+  drag_cancel_motion (seat);
+
   if (seat->drag_focus_resource)
     {
       wl_data_device_send_leave (seat->drag_focus_resource);
@@ -191,7 +325,22 @@ drag_grab_focus (ClaylandPointerGrab *grab,
   serial = wl_display_next_serial (display);
 
   if (seat->drag_data_source)
-    offer = clayland_data_source_send_offer (seat->drag_data_source, resource);
+    {
+      ClaylandDataOffer *drag_offer;
+
+      /* Re-entering a client during the same drag reuses its offer
+       * unless the client has already destroyed it */
+      drag_offer = find_offer_for_client (&seat->drag_offer_list, client);
+      if (drag_offer)
+        offer = drag_offer->resource;
+      else
+        {
+          offer = clayland_data_source_send_offer (seat->drag_data_source,
+                                                   resource);
+          drag_offer = wl_resource_get_user_data (offer);
+          wl_list_insert (&seat->drag_offer_list, &drag_offer->link);
+        }
+    }
 
   wl_data_device_send_enter (resource, serial, surface->resource,
                              x, y, offer);
@@ -203,14 +352,62 @@ drag_grab_focus (ClaylandPointerGrab *grab,
   grab->focus = surface;
 }
 
+/* Milliseconds between two frames of the output under the pointer */
+static guint32
+drag_motion_interval (ClaylandSeat *seat)
+{
+  ClaylandOutput *output =
+    clayland_compositor_get_output_at (seat->compositor,
+                                       wl_fixed_to_int (seat->pointer.x),
+                                       wl_fixed_to_int (seat->pointer.y));
+
+  return 1000000 / output->refresh;
+}
+
 static void
 drag_grab_motion (ClaylandPointerGrab *grab,
                   guint32 time, wl_fixed_t x, wl_fixed_t y)
 {
   ClaylandSeat *seat = wl_container_of (grab, seat, drag_grab);
+  guint32 elapsed, interval;
 
-  if (seat->drag_focus_resource)
-    wl_data_device_send_motion (seat->drag_focus_resource, time, x, y);
+  if (!seat->drag_focus_resource)
+    return;
+
+  /* Motion is coalesced so that the drop target sees at most one
+   * event per frame, always with the latest position */
+  seat->drag_motion_time = time;
+  seat->drag_motion_x = x;
+  seat->drag_motion_y = y;
+
+  if (seat->drag_motion_pending)
+    return;
+
+  seat->drag_motion_pending = TRUE;
+
+  elapsed = g_get_monotonic_time () / 1000 - seat->drag_motion_last_sent;
+  interval = drag_motion_interval (seat);
+  if (elapsed >= interval)
+    drag_flush_motion (seat);
+  else
+    wl_event_source_timer_update (seat->drag_motion_timer,
+                                  interval - elapsed);
+}
+
+static void
+drag_icon_configure (ClaylandSurface *surface, int32_t sx, int32_t sy)
+{
+  ClaylandSeat *seat = surface->configure_private;
+
+  if (surface != seat->drag_surface)
+    return;
+
+  seat->drag_icon_x += sx;
+  seat->drag_icon_y += sy;
+
+  clayland_seat_add_overlay_surface (seat, surface);
+  clutter_actor_set_position (surface->actor,
+                              seat->drag_icon_x, seat->drag_icon_y);
 }
 
 static void
@@ -218,6 +415,10 @@ data_device_end_drag_grab (ClaylandSeat *seat)
 {
   if (seat->drag_surface)
     {
+      if (seat->drag_surface->actor)
+        clutter_actor_hide (seat->drag_surface->actor);
+      seat->drag_surface->configure = NULL;
+      seat->drag_surface->configure_private = NULL;
       seat->drag_surface = NULL;
       wl_signal_emit (&seat->drag_icon_signal, NULL);
       wl_list_remove (&seat->drag_icon_listener.link);
@@ -226,6 +427,8 @@ data_device_end_drag_grab (ClaylandSeat *seat)
   drag_grab_focus (&seat->drag_grab, NULL,
                    wl_fixed_from_int (0), wl_fixed_from_int (0));
 
+  reset_offer_list (&seat->drag_offer_list);
+
   clayland_pointer_end_grab (&seat->pointer);
 
   seat->drag_data_source = NULL;
@@ -242,7 +445,11 @@ drag_grab_button (ClaylandPointerGrab *grab,
   if (seat->drag_focus_resource &&
       seat->pointer.grab_button == button &&
       state == WL_POINTER_BUTTON_STATE_RELEASED)
-    wl_data_device_send_drop (seat->drag_focus_resource);
+    {
+      /* Make sure the target knows where the drop happened */
+      drag_flush_motion (seat);
+      wl_data_device_send_drop (seat->drag_focus_resource);
+    }
 
   if (seat->pointer.button_count == 0 &&
       state == WL_POINTER_BUTTON_STATE_RELEASED)
@@ -291,8 +498,29 @@ data_device_start_drag (struct wl_client *client,
 
   /* FIXME: Check that the data source type array isn't empty. */
 
+  if (icon_resource)
+    {
+      ClaylandSurface *icon = wl_resource_get_user_data (icon_resource);
+
+      if (icon->configure)
+        {
+          wl_resource_post_error (icon_resource,
+                                  WL_DISPLAY_ERROR_INVALID_OBJECT,
+                                  "surface already has a role");
+          return;
+        }
+    }
+
   seat->drag_grab.interface = &drag_grab_interface;
 
+  if (!seat->drag_motion_timer)
+    {
+      struct wl_event_loop *loop = wl_display_get_event_loop (seat->display);
+
+      seat->drag_motion_timer =
+        wl_event_loop_add_timer (loop, drag_motion_timer_cb, seat);
+    }
+
   seat->drag_client = client;
   seat->drag_data_source = NULL;
 
@@ -307,6 +535,13 @@ data_device_start_drag (struct wl_client *client,
   if (icon_resource)
     {
       seat->drag_surface = wl_resource_get_user_data (icon_resource);
+      seat->drag_surface->configure = drag_icon_configure;
+      seat->drag_surface->configure_private = seat;
+      seat->drag_icon_x = 0;
+      seat->drag_icon_y = 0;
+      clayland_seat_add_overlay_surface (seat, seat->drag_surface);
+      if (seat->drag_surface->actor)
+        clutter_actor_set_position (seat->drag_surface->actor, 0, 0);
       seat->drag_icon_listener.notify = destroy_data_device_icon;
       wl_resource_add_destroy_listener (icon_resource,
                                         &seat->drag_icon_listener);
@@ -319,6 +554,21 @@ data_device_start_drag (struct wl_client *client,
   clayland_pointer_start_grab (&seat->pointer, &seat->drag_grab);
 }
 
+static void
+send_selection_offer (ClaylandSeat *seat,
+                      struct wl_resource *data_device)
+{
+  struct wl_resource *resource;
+  ClaylandDataOffer *offer;
+
+  resource = clayland_data_source_send_offer (seat->selection_data_source,
+                                              data_device);
+  offer = wl_resource_get_user_data (resource);
+  wl_list_insert (&seat->selection_offer_list, &offer->link);
+
+  wl_data_device_send_selection (data_device, resource);
+}
+
 static void
 destroy_selection_data_source (struct wl_listener *listener, void *data)
 {
@@ -348,7 +598,7 @@ clayland_seat_set_selection (ClaylandSeat *seat,
                              ClaylandDataSource *source,
                              guint32 serial)
 {
-  struct wl_resource *data_device, *offer;
+  struct wl_resource *data_device;
   struct wl_resource *focus = NULL;
 
   if (seat->selection_data_source &&
@@ -362,6 +612,8 @@ clayland_seat_set_selection (ClaylandSeat *seat,
       seat->selection_data_source = NULL;
     }
 
+  reset_offer_list (&seat->selection_offer_list);
+
   seat->selection_data_source = source;
   seat->selection_serial = serial;
 
@@ -373,11 +625,7 @@ clayland_seat_set_selection (ClaylandSeat *seat,
         wl_resource_find_for_client (&seat->drag_resource_list,
                                      wl_resource_get_client (focus));
       if (data_device && source)
-        {
-          offer = clayland_data_source_send_offer (seat->selection_data_source,
-                                                   data_device);
-          wl_data_device_send_selection (data_device, offer);
-        }
+        send_selection_offer (seat, data_device);
       else if (data_device)
         {
           wl_data_device_send_selection (data_device, NULL);
@@ -418,17 +666,17 @@ static const struct wl_data_device_interface data_device_interface = {
 static void
 destroy_data_source (struct wl_resource *resource)
 {
-  ClaylandDataSource *source = wl_container_of (resource, source, resource);
-  char **p;
+  ClaylandDataSource *source = wl_resource_get_user_data (resource);
+  const char **p;
 
   wl_signal_emit (&source->destroy_signal, source);
 
   wl_array_for_each (p, &source->mime_types)
-    free (*p);
+    clayland_mime_type_unref (*p);
 
   wl_array_release (&source->mime_types);
 
-  free (source);
+  clayland_arena_free (source);
 }
 
 static void
@@ -458,12 +706,7 @@ create_data_source (struct wl_client *client,
 {
   ClaylandDataSource *source;
 
-  source = malloc (sizeof *source);
-  if (source == NULL)
-    {
-      wl_resource_post_no_memory (resource);
-      return;
-    }
+  source = clayland_arena_new0 (client, ClaylandDataSource);
 
   wl_signal_init(&source->destroy_signal);
   source->accept = client_source_accept;
@@ -516,25 +759,33 @@ bind_manager (struct wl_client *client,
 void
 clayland_data_device_set_keyboard_focus (ClaylandSeat *seat)
 {
-  struct wl_resource *data_device, *focus, *offer;
-  ClaylandDataSource *source;
+  struct wl_resource *data_device, *focus;
+  struct wl_client *client;
+  ClaylandDataOffer *offer;
 
   focus = seat->keyboard.focus_resource;
   if (!focus)
     return;
 
-  data_device =
-    wl_resource_find_for_client (&seat->drag_resource_list,
-                                 wl_resource_get_client (focus));
+  client = wl_resource_get_client (focus);
+  data_device = wl_resource_find_for_client (&seat->drag_resource_list,
+                                             client);
   if (!data_device)
     return;
 
-  source = seat->selection_data_source;
-  if (source)
+  if (!seat->selection_data_source)
     {
-      offer = clayland_data_source_send_offer (source, data_device);
-      wl_data_device_send_selection (data_device, offer);
+      wl_data_device_send_selection (data_device, NULL);
+      return;
     }
+
+  /* A client that still holds an offer for the current selection is
+   * told about it again rather than getting a new one */
+  offer = find_offer_for_client (&seat->selection_offer_list, client);
+  if (offer)
+    wl_data_device_send_selection (data_device, offer->resource);
+  else
+    send_selection_offer (seat, data_device);
 }
 
 int
@@ -38,5 +38,11 @@ clayland_seat_set_selection (ClaylandSeat *seat,
                              ClaylandDataSource *source,
                              uint32_t serial);
 
+const char *
+clayland_mime_type_intern (const char *mime_type);
+
+void
+clayland_mime_type_unref (const char *mime_type);
+
 
 #endif /* __CLAYLAND_DATA_DEVICE_H__ */
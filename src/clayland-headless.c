@@ -0,0 +1,1015 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <pixman.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "clayland-headless.h"
+#include "clayland-damage.h"
+#include "clayland-shm-convert.h"
+
+/* The framebuffer is painted in square tiles of this many pixels. Only
+ * the tiles touched by the damage are repainted and the tiles are
+ * shared out between the render threads. */
+#define TILE_SIZE 64
+
+/* A window as it is painted in the current frame */
+typedef struct
+{
+  struct wl_resource *buffer_resource;
+  /* NULL if the pixels come from a shadow */
+  struct wl_shm_buffer *shm_buffer;
+  pixman_format_code_t format;
+  pixman_op_t op;
+  void *data;
+  int stride;
+  int buffer_width;
+  int buffer_height;
+  /* Bytes of the SHM buffer that can fault, 0 for a shadow */
+  gsize size;
+  /* Set by the SIGBUS handler when the client truncated the pool
+   * under one of the render threads */
+  volatile gboolean faulted;
+
+  /* Maps surface coordinates to the buffer when the viewport crops or
+   * scales it */
+  gboolean transformed;
+  pixman_transform_t transform;
+
+  /* Area of the window and the part of it known to be opaque, in the
+   * coordinates of the output being painted */
+  cairo_rectangle_int_t rect;
+  cairo_region_t *opaque;
+} ClaylandHeadlessLayer;
+
+/* Copy of the buffer of a surface in a format that pixman can
+ * composite quickly. Only the damage is converted again on each
+ * commit. */
+typedef struct
+{
+  pixman_image_t *image;
+  uint32_t format;
+} ClaylandHeadlessShadow;
+
+/* Each output has its own framebuffer, damage and frame clock */
+typedef struct
+{
+  ClaylandHeadless *headless;
+  ClaylandOutput *output;
+  int index;
+
+  int width;
+  int height;
+  pixman_image_t *framebuffer;
+  /* Whether the framebuffer holds a complete frame */
+  gboolean framebuffer_painted;
+  int n_tiles_x;
+  int n_tiles_y;
+
+  /* In the coordinates of the output */
+  ClaylandDamage *damage;
+
+  /* Frame interval in microseconds */
+  gint64 interval;
+  gint64 last_frame;
+  struct wl_event_source *frame_timer;
+  gboolean frame_scheduled;
+
+  guint frame_count;
+} ClaylandHeadlessOutput;
+
+struct _ClaylandHeadless
+{
+  ClaylandCompositor *compositor;
+
+  /* List of ClaylandHeadlessOutput */
+  GList *outputs;
+
+  /* Map from ClaylandSurface to ClaylandHeadlessShadow */
+  GHashTable *shadows;
+
+  char *dump_dir;
+
+  /* The frame being painted. Layers are bottom to top. */
+  ClaylandHeadlessOutput *painting;
+  GArray *layers;
+  GArray *tiles;
+  gint next_tile;
+
+  /* Render threads. The main thread paints tiles as well. */
+  GThread **threads;
+  int n_threads;
+  GMutex mutex;
+  GCond work_cond;
+  GCond done_cond;
+  guint generation;
+  int n_busy;
+  gboolean quit;
+};
+
+/* The layer each render thread is reading from, if any */
+static GPrivate current_layer;
+static struct sigaction old_sigbus_action;
+static long page_size;
+
+static void
+sigbus_handler (int signal_number,
+                siginfo_t *info,
+                void *context)
+{
+  ClaylandHeadlessLayer *layer = g_private_get (&current_layer);
+  char *fault = info->si_addr;
+
+  if (layer &&
+      fault >= (char *) layer->data &&
+      fault < (char *) layer->data + layer->size)
+    {
+      char *start =
+        (char *) ((guintptr) layer->data & ~(guintptr) (page_size - 1));
+      gsize size = (char *) layer->data + layer->size - start;
+
+      /* Zeroes take the place of the missing pages so the tile can
+       * be finished. The client is told off once the frame is done,
+       * from the main thread. */
+      if (mmap (start, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) != MAP_FAILED)
+        {
+          layer->faulted = TRUE;
+          return;
+        }
+    }
+
+  if (old_sigbus_action.sa_flags & SA_SIGINFO)
+    old_sigbus_action.sa_sigaction (signal_number, info, context);
+  else if (old_sigbus_action.sa_handler != SIG_DFL &&
+           old_sigbus_action.sa_handler != SIG_IGN)
+    old_sigbus_action.sa_handler (signal_number);
+  else
+    {
+      /* Returning faults again, this time with the default action */
+      signal (SIGBUS, SIG_DFL);
+    }
+}
+
+/* libwayland installs its own SIGBUS handler the first time anything
+ * calls wl_shm_buffer_begin_access. That handler posts the error to
+ * the client from whichever thread faulted so the render threads
+ * can't use it. Ours is put back on top before each frame and passes
+ * on the faults it doesn't know about. */
+static void
+install_sigbus_handler (void)
+{
+  struct sigaction action;
+
+  sigaction (SIGBUS, NULL, &action);
+  if ((action.sa_flags & SA_SIGINFO) && action.sa_sigaction == sigbus_handler)
+    return;
+
+  old_sigbus_action = action;
+  page_size = sysconf (_SC_PAGESIZE);
+
+  action.sa_sigaction = sigbus_handler;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGBUS, &action, NULL);
+}
+
+static gboolean
+intersect_rectangles (cairo_rectangle_int_t *dest,
+                      const cairo_rectangle_int_t *other)
+{
+  int x1 = MAX (dest->x, other->x);
+  int y1 = MAX (dest->y, other->y);
+  int x2 = MIN (dest->x + dest->width, other->x + other->width);
+  int y2 = MIN (dest->y + dest->height, other->y + other->height);
+
+  if (x2 <= x1 || y2 <= y1)
+    return FALSE;
+
+  dest->x = x1;
+  dest->y = y1;
+  dest->width = x2 - x1;
+  dest->height = y2 - y1;
+
+  return TRUE;
+}
+
+static void
+paint_tile (ClaylandHeadless *headless,
+            const cairo_rectangle_int_t *tile,
+            pixman_image_t *framebuffer,
+            pixman_image_t **images)
+{
+  ClaylandHeadlessLayer *layers =
+    (ClaylandHeadlessLayer *) headless->layers->data;
+  int n_layers = headless->layers->len;
+  int first, i;
+
+  /* Nothing below a window that is opaque over the whole tile can be
+   * seen */
+  for (first = n_layers - 1; first >= 0; first--)
+    if (cairo_region_contains_rectangle (layers[first].opaque, tile) ==
+        CAIRO_REGION_OVERLAP_IN)
+      break;
+
+  if (first < 0)
+    {
+      static const pixman_color_t black = { 0, 0, 0, 0xffff };
+      pixman_box32_t box = { tile->x, tile->y,
+                             tile->x + tile->width,
+                             tile->y + tile->height };
+
+      pixman_image_fill_boxes (PIXMAN_OP_SRC, framebuffer, &black, 1, &box);
+      first = 0;
+    }
+
+  for (i = first; i < n_layers; i++)
+    {
+      ClaylandHeadlessLayer *layer = &layers[i];
+      cairo_rectangle_int_t area = layer->rect;
+
+      if (!intersect_rectangles (&area, tile))
+        continue;
+
+      g_private_set (&current_layer, layer);
+
+      pixman_image_composite32 (layer->op,
+                                images[i],
+                                NULL, /* mask */
+                                framebuffer,
+                                area.x - layer->rect.x,
+                                area.y - layer->rect.y,
+                                0, 0, /* mask */
+                                area.x, area.y,
+                                area.width, area.height);
+
+      g_private_set (&current_layer, NULL);
+    }
+}
+
+/* Paints tiles of the current frame until there are none left. Every
+ * thread takes the next tile from the shared counter so a thread that
+ * finishes its tiles early takes on more instead of waiting for the
+ * others. */
+static void
+paint_tiles (ClaylandHeadless *headless)
+{
+  ClaylandHeadlessLayer *layers =
+    (ClaylandHeadlessLayer *) headless->layers->data;
+  ClaylandHeadlessOutput *houtput = headless->painting;
+  int n_layers = headless->layers->len;
+  pixman_image_t **images;
+  pixman_image_t *framebuffer;
+  int i;
+
+  /* pixman validates images lazily the first time they are used so
+   * each thread wraps the buffers in its own images */
+  images = g_newa (pixman_image_t *, MAX (n_layers, 1));
+  for (i = 0; i < n_layers; i++)
+    {
+      images[i] = pixman_image_create_bits (layers[i].format,
+                                            layers[i].buffer_width,
+                                            layers[i].buffer_height,
+                                            layers[i].data,
+                                            layers[i].stride);
+
+      if (layers[i].transformed)
+        {
+          pixman_image_set_transform (images[i], &layers[i].transform);
+          pixman_image_set_filter (images[i], PIXMAN_FILTER_BILINEAR,
+                                   NULL, 0);
+        }
+    }
+
+  framebuffer =
+    pixman_image_create_bits (PIXMAN_x8r8g8b8,
+                              houtput->width, houtput->height,
+                              pixman_image_get_data (houtput->framebuffer),
+                              pixman_image_get_stride (houtput->framebuffer));
+
+  while ((i = g_atomic_int_add (&headless->next_tile, 1)) <
+         (int) headless->tiles->len)
+    paint_tile (headless,
+                &g_array_index (headless->tiles, cairo_rectangle_int_t, i),
+                framebuffer,
+                images);
+
+  pixman_image_unref (framebuffer);
+  for (i = 0; i < n_layers; i++)
+    pixman_image_unref (images[i]);
+}
+
+static gpointer
+render_thread_func (gpointer data)
+{
+  ClaylandHeadless *headless = data;
+  guint generation = 0;
+
+  g_mutex_lock (&headless->mutex);
+
+  while (TRUE)
+    {
+      while (headless->generation == generation && !headless->quit)
+        g_cond_wait (&headless->work_cond, &headless->mutex);
+
+      if (headless->quit)
+        break;
+
+      generation = headless->generation;
+      g_mutex_unlock (&headless->mutex);
+
+      paint_tiles (headless);
+
+      g_mutex_lock (&headless->mutex);
+      if (--headless->n_busy == 0)
+        g_cond_signal (&headless->done_cond);
+    }
+
+  g_mutex_unlock (&headless->mutex);
+
+  return NULL;
+}
+
+static void
+add_layer (ClaylandHeadless *headless,
+           ClaylandHeadlessOutput *houtput,
+           ClaylandSurface *surface)
+{
+  ClaylandHeadlessLayer layer;
+  ClaylandHeadlessShadow *shadow;
+  struct wl_shm_buffer *shm_buffer;
+  cairo_matrix_t matrix;
+  float width, height;
+
+  if (!surface->buffer_ref.buffer)
+    return;
+
+  /* Only SHM buffers can be read without a GPU */
+  shm_buffer = wl_shm_buffer_get (surface->buffer_ref.buffer->resource);
+  if (!shm_buffer)
+    return;
+
+  switch (wl_shm_buffer_get_format (shm_buffer))
+    {
+    case WL_SHM_FORMAT_ARGB8888:
+      layer.format = PIXMAN_a8r8g8b8;
+      layer.op = PIXMAN_OP_OVER;
+      break;
+    case WL_SHM_FORMAT_XRGB8888:
+      layer.format = PIXMAN_x8r8g8b8;
+      layer.op = PIXMAN_OP_SRC;
+      break;
+    default:
+      shadow = g_hash_table_lookup (headless->shadows, surface);
+      if (!shadow)
+        return;
+
+      layer.format = pixman_image_get_format (shadow->image);
+      layer.op = (layer.format == PIXMAN_a8r8g8b8 ?
+                  PIXMAN_OP_OVER :
+                  PIXMAN_OP_SRC);
+      layer.data = pixman_image_get_data (shadow->image);
+      layer.stride = pixman_image_get_stride (shadow->image);
+      shm_buffer = NULL;
+      break;
+    }
+
+  layer.buffer_resource = surface->buffer_ref.buffer->resource;
+  layer.shm_buffer = shm_buffer;
+  layer.faulted = FALSE;
+  if (shm_buffer)
+    {
+      layer.data = wl_shm_buffer_get_data (shm_buffer);
+      layer.stride = wl_shm_buffer_get_stride (shm_buffer);
+      layer.size = layer.stride * wl_shm_buffer_get_height (shm_buffer);
+    }
+  else
+    layer.size = 0;
+  layer.rect.x = surface->x - houtput->output->x;
+  layer.rect.y = surface->y - houtput->output->y;
+  clayland_surface_get_buffer_size (surface, &width, &height);
+  layer.buffer_width = width;
+  layer.buffer_height = height;
+  clayland_surface_get_size (surface, &width, &height);
+  layer.rect.width = width;
+  layer.rect.height = height;
+
+  /* Windows on the other outputs aren't painted */
+  if (layer.rect.x >= houtput->width || layer.rect.y >= houtput->height ||
+      layer.rect.x + layer.rect.width <= 0 ||
+      layer.rect.y + layer.rect.height <= 0)
+    return;
+
+  /* pixman wants the matrix from the destination, which is in surface
+   * coordinates, to the buffer */
+  clayland_surface_get_buffer_matrix (surface, &matrix);
+  layer.transformed = (matrix.xx != 1 || matrix.yx != 0 ||
+                       matrix.xy != 0 || matrix.yy != 1 ||
+                       matrix.x0 != 0 || matrix.y0 != 0);
+  if (layer.transformed)
+    {
+      struct pixman_f_transform ftransform;
+
+      if (cairo_matrix_invert (&matrix) != CAIRO_STATUS_SUCCESS)
+        return;
+
+      pixman_f_transform_init_identity (&ftransform);
+      ftransform.m[0][0] = matrix.xx;
+      ftransform.m[0][1] = matrix.xy;
+      ftransform.m[0][2] = matrix.x0;
+      ftransform.m[1][0] = matrix.yx;
+      ftransform.m[1][1] = matrix.yy;
+      ftransform.m[1][2] = matrix.y0;
+      pixman_transform_from_pixman_f_transform (&layer.transform,
+                                                &ftransform);
+    }
+
+  if (layer.op == PIXMAN_OP_SRC)
+    layer.opaque = cairo_region_create_rectangle (&layer.rect);
+  else if (surface->opaque_region)
+    {
+      layer.opaque = cairo_region_copy (surface->opaque_region);
+      cairo_region_translate (layer.opaque, layer.rect.x, layer.rect.y);
+      cairo_region_intersect_rectangle (layer.opaque, &layer.rect);
+    }
+  else
+    layer.opaque = cairo_region_create ();
+
+  g_array_append_val (headless->layers, layer);
+}
+
+static void
+clear_layers (ClaylandHeadless *headless)
+{
+  int i;
+
+  for (i = 0; i < headless->layers->len; i++)
+    cairo_region_destroy (g_array_index (headless->layers,
+                                         ClaylandHeadlessLayer,
+                                         i).opaque);
+
+  g_array_set_size (headless->layers, 0);
+}
+
+/* Lists the tiles touched by the region */
+static void
+collect_tiles (ClaylandHeadless *headless,
+               ClaylandHeadlessOutput *houtput,
+               const cairo_region_t *region)
+{
+  int n_tiles = houtput->n_tiles_x * houtput->n_tiles_y;
+  guint8 *damaged = g_malloc0 (n_tiles);
+  int i, n_rectangles;
+  int tx, ty;
+
+  n_rectangles = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rectangles; i++)
+    {
+      cairo_rectangle_int_t rect;
+
+      cairo_region_get_rectangle (region, i, &rect);
+
+      for (ty = rect.y / TILE_SIZE;
+           ty <= (rect.y + rect.height - 1) / TILE_SIZE;
+           ty++)
+        for (tx = rect.x / TILE_SIZE;
+             tx <= (rect.x + rect.width - 1) / TILE_SIZE;
+             tx++)
+          damaged[ty * houtput->n_tiles_x + tx] = TRUE;
+    }
+
+  g_array_set_size (headless->tiles, 0);
+
+  for (ty = 0; ty < houtput->n_tiles_y; ty++)
+    for (tx = 0; tx < houtput->n_tiles_x; tx++)
+      if (damaged[ty * houtput->n_tiles_x + tx])
+        {
+          cairo_rectangle_int_t tile;
+
+          tile.x = tx * TILE_SIZE;
+          tile.y = ty * TILE_SIZE;
+          tile.width = MIN (TILE_SIZE, houtput->width - tile.x);
+          tile.height = MIN (TILE_SIZE, houtput->height - tile.y);
+
+          g_array_append_val (headless->tiles, tile);
+        }
+
+  g_free (damaged);
+}
+
+static void
+paint (ClaylandHeadless *headless,
+       ClaylandHeadlessOutput *houtput,
+       const cairo_region_t *region)
+{
+  ClaylandCompositor *compositor = headless->compositor;
+  ClaylandSurface *surface;
+  struct wl_list *link = compositor->stack.next;
+  int i;
+
+  /* Nothing below an opaque fullscreen surface can be seen */
+  if (compositor->fullscreen_surface)
+    link = &compositor->fullscreen_surface->surface->stack_link;
+
+  for (; link != &compositor->stack; link = link->next)
+    {
+      surface = wl_container_of (link, surface, stack_link);
+      add_layer (headless, houtput, surface);
+    }
+
+  collect_tiles (headless, houtput, region);
+  headless->painting = houtput;
+  headless->next_tile = 0;
+
+  install_sigbus_handler ();
+
+  if (headless->n_threads > 0 && headless->tiles->len > 1)
+    {
+      g_mutex_lock (&headless->mutex);
+      headless->n_busy = headless->n_threads;
+      headless->generation++;
+      g_cond_broadcast (&headless->work_cond);
+      g_mutex_unlock (&headless->mutex);
+
+      paint_tiles (headless);
+
+      /* The layers point into the buffers so the frame has to be
+       * finished before returning to the clients */
+      g_mutex_lock (&headless->mutex);
+      while (headless->n_busy > 0)
+        g_cond_wait (&headless->done_cond, &headless->mutex);
+      g_mutex_unlock (&headless->mutex);
+    }
+  else
+    paint_tiles (headless);
+
+  for (i = 0; i < headless->layers->len; i++)
+    {
+      ClaylandHeadlessLayer *layer =
+        &g_array_index (headless->layers, ClaylandHeadlessLayer, i);
+
+      if (layer->faulted)
+        wl_resource_post_error (layer->buffer_resource,
+                                WL_SHM_ERROR_INVALID_FD,
+                                "error accessing SHM buffer");
+    }
+
+  clear_layers (headless);
+  headless->painting = NULL;
+}
+
+static void
+dump_frame (ClaylandHeadlessOutput *houtput)
+{
+  ClaylandHeadless *headless = houtput->headless;
+  guint32 *pixels = pixman_image_get_data (houtput->framebuffer);
+  int stride = pixman_image_get_stride (houtput->framebuffer) / 4;
+  guint8 *row;
+  char *filename;
+  FILE *file;
+  int x, y;
+
+  /* The file names only say which output it is when there are several */
+  if (headless->outputs->next)
+    filename = g_strdup_printf ("%s/output-%d-frame-%06u.ppm",
+                                headless->dump_dir,
+                                houtput->index,
+                                houtput->frame_count);
+  else
+    filename = g_strdup_printf ("%s/frame-%06u.ppm",
+                                headless->dump_dir,
+                                houtput->frame_count);
+  file = fopen (filename, "wb");
+  if (!file)
+    {
+      g_warning ("Failed to open %s: %s", filename, strerror (errno));
+      g_free (filename);
+      return;
+    }
+
+  fprintf (file, "P6\n%d %d\n255\n", houtput->width, houtput->height);
+
+  row = g_malloc (houtput->width * 3);
+  for (y = 0; y < houtput->height; y++)
+    {
+      const guint32 *src = pixels + y * stride;
+
+      for (x = 0; x < houtput->width; x++)
+        {
+          row[x * 3 + 0] = src[x] >> 16;
+          row[x * 3 + 1] = src[x] >> 8;
+          row[x * 3 + 2] = src[x];
+        }
+
+      fwrite (row, 3, houtput->width, file);
+    }
+  g_free (row);
+
+  if (fclose (file) != 0)
+    g_warning ("Failed to write %s: %s", filename, strerror (errno));
+
+  g_free (filename);
+}
+
+static int
+frame_timer_cb (void *data)
+{
+  ClaylandHeadlessOutput *houtput = data;
+  ClaylandHeadless *headless = houtput->headless;
+
+  houtput->frame_scheduled = FALSE;
+  houtput->last_frame = g_get_monotonic_time ();
+
+  if (!clayland_damage_is_empty (houtput->damage))
+    {
+      cairo_region_t *region;
+
+      /* Nothing reads the framebuffer while it is painted so a single
+       * one is enough, and it only misses this frame's damage */
+      region =
+        clayland_damage_get_for_age (houtput->damage,
+                                     houtput->framebuffer_painted ? 1 : 0);
+
+      paint (headless, houtput, region);
+      cairo_region_destroy (region);
+
+      clayland_damage_end_frame (houtput->damage);
+      houtput->framebuffer_painted = TRUE;
+
+      if (headless->dump_dir)
+        dump_frame (houtput);
+
+      houtput->frame_count++;
+    }
+
+  clayland_compositor_finish_frame (headless->compositor, houtput->output);
+
+  return 0;
+}
+
+static void
+schedule_output_frame (ClaylandHeadlessOutput *houtput)
+{
+  gint64 delay;
+
+  if (houtput->frame_scheduled)
+    return;
+
+  houtput->frame_scheduled = TRUE;
+
+  /* Frames are never closer than one refresh interval apart. A
+   * timeout of 0 would disarm the timer so it's at least 1ms. */
+  delay = houtput->last_frame + houtput->interval - g_get_monotonic_time ();
+  wl_event_source_timer_update (houtput->frame_timer,
+                                MAX (1, (delay + 999) / 1000));
+}
+
+/* Adds damage in stage coordinates to each output it touches */
+static void
+add_damage (ClaylandHeadless *headless,
+            const cairo_region_t *region,
+            int x,
+            int y)
+{
+  GList *l;
+
+  for (l = headless->outputs; l; l = l->next)
+    {
+      ClaylandHeadlessOutput *houtput = l->data;
+
+      clayland_damage_add_region (houtput->damage,
+                                  region,
+                                  x - houtput->output->x,
+                                  y - houtput->output->y);
+
+      if (!clayland_damage_is_empty (houtput->damage))
+        schedule_output_frame (houtput);
+    }
+}
+
+void
+clayland_headless_schedule_frame (ClaylandHeadless *headless,
+                                  ClaylandOutput *output)
+{
+  GList *l;
+
+  for (l = headless->outputs; l; l = l->next)
+    {
+      ClaylandHeadlessOutput *houtput = l->data;
+
+      if (houtput->output == output)
+        schedule_output_frame (houtput);
+    }
+}
+
+void
+clayland_headless_queue_redraw (ClaylandHeadless *headless)
+{
+  GList *l;
+
+  for (l = headless->outputs; l; l = l->next)
+    {
+      ClaylandHeadlessOutput *houtput = l->data;
+
+      clayland_damage_add_all (houtput->damage);
+      schedule_output_frame (houtput);
+    }
+}
+
+void
+clayland_headless_damage_rectangle (ClaylandHeadless *headless,
+                                    const cairo_rectangle_int_t *rectangle)
+{
+  cairo_region_t *region = cairo_region_create_rectangle (rectangle);
+
+  add_damage (headless, region, 0, 0);
+  cairo_region_destroy (region);
+}
+
+static void
+free_shadow (ClaylandHeadlessShadow *shadow)
+{
+  pixman_image_unref (shadow->image);
+  g_slice_free (ClaylandHeadlessShadow, shadow);
+}
+
+/* Brings the shadow of the surface up to date with the damaged region
+ * of its buffer, if the buffer has to be converted */
+static void
+update_shadow (ClaylandHeadless *headless,
+               ClaylandSurface *surface,
+               const cairo_region_t *region)
+{
+  ClaylandHeadlessShadow *shadow;
+  struct wl_shm_buffer *shm_buffer;
+  cairo_rectangle_int_t rect;
+  cairo_region_t *damage;
+  uint32_t format;
+  gboolean has_alpha;
+  int width, height;
+  int i, n_rectangles;
+
+  shm_buffer = wl_shm_buffer_get (surface->buffer_ref.buffer->resource);
+  if (!shm_buffer)
+    return;
+
+  format = wl_shm_buffer_get_format (shm_buffer);
+  if (!clayland_shm_convert_needed (format, &has_alpha))
+    {
+      g_hash_table_remove (headless->shadows, surface);
+      return;
+    }
+
+  width = wl_shm_buffer_get_width (shm_buffer);
+  height = wl_shm_buffer_get_height (shm_buffer);
+  rect.x = 0;
+  rect.y = 0;
+  rect.width = width;
+  rect.height = height;
+
+  shadow = g_hash_table_lookup (headless->shadows, surface);
+
+  /* The whole buffer is converted if the shadow is new */
+  if (shadow == NULL ||
+      shadow->format != format ||
+      pixman_image_get_width (shadow->image) != width ||
+      pixman_image_get_height (shadow->image) != height)
+    {
+      shadow = g_slice_new (ClaylandHeadlessShadow);
+      shadow->format = format;
+      shadow->image = pixman_image_create_bits (has_alpha ?
+                                                PIXMAN_a8r8g8b8 :
+                                                PIXMAN_x8r8g8b8,
+                                                width, height,
+                                                NULL, 0);
+      g_hash_table_insert (headless->shadows, surface, shadow);
+
+      damage = cairo_region_create_rectangle (&rect);
+    }
+  else
+    {
+      damage = cairo_region_copy (region);
+      cairo_region_intersect_rectangle (damage, &rect);
+    }
+
+  wl_shm_buffer_begin_access (shm_buffer);
+
+  n_rectangles = cairo_region_num_rectangles (damage);
+  for (i = 0; i < n_rectangles; i++)
+    {
+      cairo_region_get_rectangle (damage, i, &rect);
+      clayland_shm_convert_rectangle (format,
+                                      pixman_image_get_data (shadow->image),
+                                      pixman_image_get_stride (shadow->image),
+                                      wl_shm_buffer_get_data (shm_buffer),
+                                      wl_shm_buffer_get_stride (shm_buffer),
+                                      rect.x, rect.y,
+                                      rect.width, rect.height);
+    }
+
+  wl_shm_buffer_end_access (shm_buffer);
+
+  cairo_region_destroy (damage);
+}
+
+void
+clayland_headless_surface_damaged (ClaylandHeadless *headless,
+                                   ClaylandSurface *surface,
+                                   const cairo_region_t *region,
+                                   const cairo_region_t *buffer_region)
+{
+  update_shadow (headless, surface, buffer_region);
+
+  if (wl_list_empty (&surface->stack_link))
+    return;
+
+  add_damage (headless, region, surface->x, surface->y);
+}
+
+void
+clayland_headless_surface_destroyed (ClaylandHeadless *headless,
+                                     ClaylandSurface *surface)
+{
+  g_hash_table_remove (headless->shadows, surface);
+}
+
+/* Sets up the framebuffer and frame clock for the current mode of
+   the output */
+static void
+allocate_framebuffer (ClaylandHeadlessOutput *houtput)
+{
+  ClaylandOutput *output = houtput->output;
+
+  houtput->width = output->width;
+  houtput->height = output->height;
+  houtput->n_tiles_x = (output->width + TILE_SIZE - 1) / TILE_SIZE;
+  houtput->n_tiles_y = (output->height + TILE_SIZE - 1) / TILE_SIZE;
+  houtput->interval = G_GINT64_CONSTANT (1000000000) / output->refresh;
+  houtput->damage = clayland_damage_new (output->width, output->height);
+
+  /* pixman allocates and clears the pixels itself */
+  houtput->framebuffer = pixman_image_create_bits (PIXMAN_x8r8g8b8,
+                                                   output->width,
+                                                   output->height,
+                                                   NULL, 0);
+  houtput->framebuffer_painted = FALSE;
+}
+
+static void
+free_framebuffer (ClaylandHeadlessOutput *houtput)
+{
+  pixman_image_unref (houtput->framebuffer);
+  clayland_damage_free (houtput->damage);
+}
+
+static ClaylandHeadlessOutput *
+headless_output_new (ClaylandHeadless *headless,
+                     ClaylandOutput *output,
+                     int index)
+{
+  ClaylandHeadlessOutput *houtput = g_slice_new0 (ClaylandHeadlessOutput);
+
+  houtput->headless = headless;
+  houtput->output = output;
+  houtput->index = index;
+  allocate_framebuffer (houtput);
+
+  houtput->frame_timer =
+    wl_event_loop_add_timer (headless->compositor->wayland_loop,
+                             frame_timer_cb,
+                             houtput);
+
+  return houtput;
+}
+
+static void
+headless_output_free (ClaylandHeadlessOutput *houtput)
+{
+  wl_event_source_remove (houtput->frame_timer);
+  free_framebuffer (houtput);
+
+  g_slice_free (ClaylandHeadlessOutput, houtput);
+}
+
+void
+clayland_headless_output_changed (ClaylandHeadless *headless,
+                                  ClaylandOutput *output)
+{
+  GList *l;
+
+  for (l = headless->outputs; l; l = l->next)
+    {
+      ClaylandHeadlessOutput *houtput = l->data;
+
+      if (houtput->output != output)
+        continue;
+
+      /* Frames are only ever painted from the main loop so nothing is
+       * using the framebuffer */
+      if (houtput->width != output->width ||
+          houtput->height != output->height)
+        {
+          free_framebuffer (houtput);
+          allocate_framebuffer (houtput);
+        }
+      else
+        houtput->interval =
+          G_GINT64_CONSTANT (1000000000) / output->refresh;
+
+      clayland_damage_add_all (houtput->damage);
+      schedule_output_frame (houtput);
+    }
+}
+
+ClaylandHeadless *
+clayland_headless_new (ClaylandCompositor *compositor,
+                       int n_threads,
+                       const char *dump_dir)
+{
+  ClaylandHeadless *headless = g_slice_new0 (ClaylandHeadless);
+  GList *l;
+  int i;
+
+  headless->compositor = compositor;
+  headless->dump_dir = g_strdup (dump_dir);
+  headless->shadows =
+    g_hash_table_new_full (NULL, NULL,
+                           NULL, (GDestroyNotify) free_shadow);
+  headless->layers = g_array_new (FALSE, FALSE, sizeof (ClaylandHeadlessLayer));
+  headless->tiles = g_array_new (FALSE, FALSE, sizeof (cairo_rectangle_int_t));
+
+  for (l = compositor->outputs, i = 0; l; l = l->next, i++)
+    headless->outputs = g_list_append (headless->outputs,
+                                       headless_output_new (headless,
+                                                            l->data,
+                                                            i));
+
+  /* The main thread paints tiles too so it only needs n - 1 helpers */
+  g_mutex_init (&headless->mutex);
+  g_cond_init (&headless->work_cond);
+  g_cond_init (&headless->done_cond);
+  headless->n_threads = MAX (n_threads - 1, 0);
+  headless->threads = g_new0 (GThread *, headless->n_threads);
+  for (i = 0; i < headless->n_threads; i++)
+    headless->threads[i] = g_thread_new ("clayland-render",
+                                         render_thread_func,
+                                         headless);
+
+  /* The first frame shows the empty outputs */
+  clayland_headless_queue_redraw (headless);
+
+  return headless;
+}
+
+void
+clayland_headless_free (ClaylandHeadless *headless)
+{
+  int i;
+
+  g_mutex_lock (&headless->mutex);
+  headless->quit = TRUE;
+  g_cond_broadcast (&headless->work_cond);
+  g_mutex_unlock (&headless->mutex);
+
+  for (i = 0; i < headless->n_threads; i++)
+    g_thread_join (headless->threads[i]);
+  g_free (headless->threads);
+
+  g_mutex_clear (&headless->mutex);
+  g_cond_clear (&headless->work_cond);
+  g_cond_clear (&headless->done_cond);
+
+  g_list_free_full (headless->outputs,
+                    (GDestroyNotify) headless_output_free);
+  g_hash_table_destroy (headless->shadows);
+  g_array_free (headless->layers, TRUE);
+  g_array_free (headless->tiles, TRUE);
+  g_free (headless->dump_dir);
+
+  g_slice_free (ClaylandHeadless, headless);
+}
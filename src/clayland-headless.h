@@ -0,0 +1,84 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_HEADLESS_H__
+#define __CLAYLAND_HEADLESS_H__
+
+#include <glib.h>
+
+#include "clayland-compositor.h"
+
+/* The headless backend runs without Clutter or a display. The windows
+ * are composited from their SHM buffers with pixman into a framebuffer
+ * in memory for each output, on a virtual frame clock running at the
+ * refresh rate of the output, and the frames can be written out to
+ * disk. There is no input. */
+
+typedef struct _ClaylandHeadless ClaylandHeadless;
+
+/* The outputs of the compositor have to be created first. The damaged
+ * tiles of each frame are shared out between n_threads threads,
+ * counting the main one. If dump_dir isn't NULL each painted frame is
+ * saved there as a PPM file. */
+ClaylandHeadless *
+clayland_headless_new (ClaylandCompositor *compositor,
+                       int n_threads,
+                       const char *dump_dir);
+
+/* Repaints all of the outputs on the next tick of their frame clocks */
+void
+clayland_headless_queue_redraw (ClaylandHeadless *headless);
+
+/* Called when the output switched to another mode. Only that output
+ * is repainted. */
+void
+clayland_headless_output_changed (ClaylandHeadless *headless,
+                                  ClaylandOutput *output);
+
+/* Makes the frame clock of the output tick even if nothing is
+ * damaged, so that its frame callbacks get sent */
+void
+clayland_headless_schedule_frame (ClaylandHeadless *headless,
+                                  ClaylandOutput *output);
+
+/* Repaints a rectangle in stage coordinates on the next tick of the
+ * frame clock */
+void
+clayland_headless_damage_rectangle (ClaylandHeadless *headless,
+                                    const cairo_rectangle_int_t *rectangle);
+
+/* Called when the surface commits damage, given both in surface and
+ * in buffer coordinates. Buffers in formats that pixman can't
+ * composite quickly are converted here. */
+void
+clayland_headless_surface_damaged (ClaylandHeadless *headless,
+                                   ClaylandSurface *surface,
+                                   const cairo_region_t *region,
+                                   const cairo_region_t *buffer_region);
+
+void
+clayland_headless_surface_destroyed (ClaylandHeadless *headless,
+                                     ClaylandSurface *surface);
+
+void
+clayland_headless_free (ClaylandHeadless *headless);
+
+#endif /* __CLAYLAND_HEADLESS_H__ */
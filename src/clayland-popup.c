@@ -0,0 +1,229 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "clayland-popup.h"
+#include "clayland-pointer.h"
+
+/* A release outside of the popups only dismisses them if the button
+ * that opened them has already been released once or if it was held
+ * down for longer than this many milliseconds. That way both
+ * click-release and press-drag-release menus work. */
+#define POPUP_INITIAL_UP_TIMEOUT 500
+
+struct _ClaylandPopupGrab
+{
+  ClaylandPointerGrab grab;
+  ClaylandSeat *seat;
+  struct wl_client *client;
+
+  /* Popups in the chain, topmost first */
+  struct wl_list popups;
+
+  gboolean initial_up;
+  guint32 start_time;
+};
+
+static void
+popup_grab_end (ClaylandPopupGrab *popup_grab)
+{
+  ClaylandPointer *pointer = &popup_grab->seat->pointer;
+
+  popup_grab->seat->popup_grab = NULL;
+
+  if (pointer->grab == &popup_grab->grab)
+    clayland_pointer_end_grab (pointer);
+
+  g_slice_free (ClaylandPopupGrab, popup_grab);
+}
+
+static void
+popup_grab_dismiss (ClaylandPopupGrab *popup_grab)
+{
+  struct wl_list popups;
+
+  /* Take over the chain first so that the dismiss handlers can't
+   * modify it while it's being walked */
+  wl_list_init (&popups);
+  wl_list_insert_list (&popups, &popup_grab->popups);
+  wl_list_init (&popup_grab->popups);
+
+  popup_grab_end (popup_grab);
+
+  while (!wl_list_empty (&popups))
+    {
+      ClaylandPopup *popup = wl_container_of (popups.next, popup, link);
+
+      wl_list_remove (&popup->link);
+      wl_list_init (&popup->link);
+      popup->grab = NULL;
+
+      popup->dismiss (popup);
+    }
+}
+
+static void
+popup_grab_focus (ClaylandPointerGrab *grab,
+                  ClaylandSurface *surface,
+                  wl_fixed_t x,
+                  wl_fixed_t y)
+{
+  ClaylandPopupGrab *popup_grab = wl_container_of (grab, popup_grab, grab);
+
+  /* Only the surfaces of the client owning the popups get events */
+  if (surface && surface->resource &&
+      wl_resource_get_client (surface->resource) == popup_grab->client)
+    {
+      clayland_pointer_set_focus (grab->pointer, surface, x, y);
+      grab->focus = surface;
+    }
+  else
+    {
+      clayland_pointer_set_focus (grab->pointer, NULL,
+                                  wl_fixed_from_int (0),
+                                  wl_fixed_from_int (0));
+      grab->focus = NULL;
+    }
+}
+
+static void
+popup_grab_motion (ClaylandPointerGrab *grab,
+                   uint32_t time,
+                   wl_fixed_t x,
+                   wl_fixed_t y)
+{
+  struct wl_resource *resource = grab->pointer->focus_resource;
+
+  if (resource)
+    wl_pointer_send_motion (resource, time, x, y);
+}
+
+static void
+popup_grab_button (ClaylandPointerGrab *grab,
+                   uint32_t time,
+                   uint32_t button,
+                   uint32_t state)
+{
+  ClaylandPopupGrab *popup_grab = wl_container_of (grab, popup_grab, grab);
+  struct wl_resource *resource = grab->pointer->focus_resource;
+
+  if (resource)
+    {
+      struct wl_display *display = popup_grab->seat->display;
+
+      wl_pointer_send_button (resource,
+                              wl_display_next_serial (display),
+                              time, button, state);
+    }
+  else if (state == WL_POINTER_BUTTON_STATE_PRESSED ||
+           popup_grab->initial_up ||
+           time - popup_grab->start_time > POPUP_INITIAL_UP_TIMEOUT)
+    {
+      popup_grab_dismiss (popup_grab);
+      return;
+    }
+
+  if (state == WL_POINTER_BUTTON_STATE_RELEASED)
+    popup_grab->initial_up = TRUE;
+}
+
+static const ClaylandPointerGrabInterface popup_grab_interface = {
+  popup_grab_focus,
+  popup_grab_motion,
+  popup_grab_button
+};
+
+void
+clayland_popup_init (ClaylandPopup *popup,
+                     ClaylandSurface *surface,
+                     void (*dismiss) (ClaylandPopup *popup))
+{
+  popup->surface = surface;
+  popup->dismiss = dismiss;
+  popup->grab = NULL;
+  wl_list_init (&popup->link);
+}
+
+gboolean
+clayland_popup_grab (ClaylandPopup *popup,
+                     ClaylandSeat *seat,
+                     guint32 serial)
+{
+  ClaylandPointer *pointer = &seat->pointer;
+  ClaylandPopupGrab *popup_grab = seat->popup_grab;
+  struct wl_client *client;
+
+  if (popup->grab || !popup->surface || !popup->surface->resource)
+    return FALSE;
+
+  client = wl_resource_get_client (popup->surface->resource);
+
+  if (popup_grab)
+    {
+      /* Nested menus are added to the existing chain. A popup from
+       * another client breaks it. */
+      if (popup_grab->client != client)
+        {
+          popup_grab_dismiss (popup_grab);
+          popup_grab = NULL;
+        }
+    }
+
+  if (!popup_grab)
+    {
+      if (pointer->grab != &pointer->default_grab ||
+          pointer->grab_serial != serial)
+        return FALSE;
+
+      popup_grab = g_slice_new0 (ClaylandPopupGrab);
+      popup_grab->grab.interface = &popup_grab_interface;
+      popup_grab->seat = seat;
+      popup_grab->client = client;
+      wl_list_init (&popup_grab->popups);
+      popup_grab->initial_up = pointer->button_count == 0;
+      popup_grab->start_time = pointer->grab_time;
+
+      seat->popup_grab = popup_grab;
+      clayland_pointer_start_grab (pointer, &popup_grab->grab);
+    }
+
+  popup->grab = popup_grab;
+  wl_list_insert (&popup_grab->popups, &popup->link);
+
+  return TRUE;
+}
+
+void
+clayland_popup_ungrab (ClaylandPopup *popup)
+{
+  ClaylandPopupGrab *popup_grab = popup->grab;
+
+  if (!popup_grab)
+    return;
+
+  wl_list_remove (&popup->link);
+  wl_list_init (&popup->link);
+  popup->grab = NULL;
+
+  if (wl_list_empty (&popup_grab->popups))
+    popup_grab_end (popup_grab);
+}
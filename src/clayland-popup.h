@@ -0,0 +1,65 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_POPUP_H__
+#define __CLAYLAND_POPUP_H__
+
+#include <wayland-server.h>
+#include <clutter/clutter.h>
+#include <glib.h>
+
+#include "clayland-seat.h"
+
+typedef struct _ClaylandPopup ClaylandPopup;
+
+struct _ClaylandPopup
+{
+  ClaylandSurface *surface;
+
+  /* Called when the grab is broken by a click outside of the
+   * surfaces of the popup's client */
+  void (*dismiss) (ClaylandPopup *popup);
+
+  ClaylandPopupGrab *grab;
+  /* Link in the grab's list of popups, topmost first */
+  struct wl_list link;
+};
+
+void
+clayland_popup_init (ClaylandPopup *popup,
+                     ClaylandSurface *surface,
+                     void (*dismiss) (ClaylandPopup *popup));
+
+/* Adds the popup to the top of the seat's popup chain, starting a
+ * pointer grab if there isn't one already. Returns FALSE if the serial
+ * doesn't belong to the implicit grab that opened the popup, in which
+ * case the popup should be dismissed straight away. */
+gboolean
+clayland_popup_grab (ClaylandPopup *popup,
+                     ClaylandSeat *seat,
+                     guint32 serial);
+
+/* Removes the popup from the chain without dismissing it. The grab
+ * ends once the last popup is removed. */
+void
+clayland_popup_ungrab (ClaylandPopup *popup);
+
+#endif /* __CLAYLAND_POPUP_H__ */
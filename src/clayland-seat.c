@@ -32,6 +32,7 @@
 #include "clayland-keyboard.h"
 #include "clayland-pointer.h"
 #include "clayland-data-device.h"
+#include "clayland-clipboard.h"
 
 static void
 unbind_resource (struct wl_resource *resource)
@@ -46,15 +47,75 @@ transform_stage_point_fixed (ClaylandSurface *surface,
                              wl_fixed_t *sx,
                              wl_fixed_t *sy)
 {
+  cairo_matrix_t matrix;
   float xf, yf;
+  double dx, dy;
 
   clutter_actor_transform_stage_point (surface->actor,
                                        wl_fixed_to_double (x),
                                        wl_fixed_to_double (y),
                                        &xf, &yf);
 
-  *sx = wl_fixed_from_double (xf);
-  *sy = wl_fixed_from_double (yf);
+  /* That gives buffer pixels which the buffer scale, buffer transform
+   * and viewport map to the surface */
+  clayland_surface_get_buffer_matrix (surface, &matrix);
+  dx = xf;
+  dy = yf;
+  cairo_matrix_transform_point (&matrix, &dx, &dy);
+
+  *sx = wl_fixed_from_double (dx);
+  *sy = wl_fixed_from_double (dy);
+}
+
+void
+clayland_seat_add_overlay_surface (ClaylandSeat *seat,
+                                   ClaylandSurface *surface)
+{
+  ClutterActor *parent;
+
+  if (!seat->overlay || !surface->actor)
+    return;
+
+  parent = clutter_actor_get_parent (surface->actor);
+
+  if (parent != seat->overlay)
+    {
+      g_object_ref (surface->actor);
+      if (parent)
+        clutter_actor_remove_child (parent, surface->actor);
+      clutter_actor_add_child (seat->overlay, surface->actor);
+      g_object_unref (surface->actor);
+    }
+
+  /* The overlay is always under the pointer so it mustn't be picked */
+  clutter_actor_set_reactive (surface->actor, FALSE);
+  clutter_actor_show (surface->actor);
+}
+
+static void
+pointer_update_sprite_position (ClaylandSeat *seat)
+{
+  if (seat->sprite && seat->sprite->actor)
+    clutter_actor_set_position (seat->sprite->actor,
+                                -seat->hotspot_x,
+                                -seat->hotspot_y);
+}
+
+static void
+pointer_cursor_surface_configure (ClaylandSurface *surface,
+                                  int32_t sx,
+                                  int32_t sy)
+{
+  ClaylandSeat *seat = surface->configure_private;
+
+  if (surface != seat->sprite)
+    return;
+
+  seat->hotspot_x -= sx;
+  seat->hotspot_y -= sy;
+
+  clayland_seat_add_overlay_surface (seat, surface);
+  pointer_update_sprite_position (seat);
 }
 
 static void
@@ -64,6 +125,8 @@ pointer_unmap_sprite (ClaylandSeat *seat)
     {
       if (seat->sprite->actor)
         clutter_actor_hide (seat->sprite->actor);
+      seat->sprite->configure = NULL;
+      seat->sprite->configure_private = NULL;
       wl_list_remove (&seat->sprite_destroy_listener.link);
       seat->sprite = NULL;
     }
@@ -90,6 +153,16 @@ pointer_set_cursor (struct wl_client *client,
   if (seat->pointer.focus_serial - serial > G_MAXUINT32 / 2)
     return;
 
+  if (surface &&
+      surface->configure &&
+      surface->configure != pointer_cursor_surface_configure)
+    {
+      wl_resource_post_error (surface->resource,
+                              WL_DISPLAY_ERROR_INVALID_OBJECT,
+                              "surface already has a role");
+      return;
+    }
+
   pointer_unmap_sprite (seat);
 
   if (!surface)
@@ -101,6 +174,12 @@ pointer_set_cursor (struct wl_client *client,
   seat->sprite = surface;
   seat->hotspot_x = x;
   seat->hotspot_y = y;
+
+  surface->configure = pointer_cursor_surface_configure;
+  surface->configure_private = seat;
+
+  clayland_seat_add_overlay_surface (seat, surface);
+  pointer_update_sprite_position (seat);
 }
 
 static const struct wl_pointer_interface
@@ -214,8 +293,9 @@ pointer_handle_sprite_destroy (struct wl_listener *listener, void *data)
 }
 
 ClaylandSeat *
-clayland_seat_new (struct wl_display *display)
+clayland_seat_new (ClaylandCompositor *compositor)
 {
+  struct wl_display *display = compositor->wayland_display;
   ClaylandSeat *seat = g_new0 (ClaylandSeat, 1);
 
   wl_signal_init (&seat->destroy_signal);
@@ -223,13 +303,16 @@ clayland_seat_new (struct wl_display *display)
   seat->selection_data_source = NULL;
   wl_list_init (&seat->base_resource_list);
   wl_signal_init (&seat->selection_signal);
+  wl_list_init (&seat->selection_offer_list);
   wl_list_init (&seat->drag_resource_list);
   wl_signal_init (&seat->drag_icon_signal);
+  wl_list_init (&seat->drag_offer_list);
 
   clayland_pointer_init (&seat->pointer);
 
   clayland_keyboard_init (&seat->keyboard, display);
 
+  seat->compositor = compositor;
   seat->display = display;
 
   seat->current_stage = 0;
@@ -244,6 +327,17 @@ clayland_seat_new (struct wl_display *display)
   return seat;
 }
 
+void
+clayland_seat_init_overlay (ClaylandSeat *seat,
+                            ClutterActor *stage)
+{
+  seat->overlay = clutter_actor_new ();
+  clutter_actor_add_child (stage, seat->overlay);
+  clutter_actor_set_position (seat->overlay,
+                              wl_fixed_to_double (seat->pointer.x),
+                              wl_fixed_to_double (seat->pointer.y));
+}
+
 static void
 notify_motion (ClaylandSeat *seat,
                const ClutterEvent *event)
@@ -255,6 +349,11 @@ notify_motion (ClaylandSeat *seat,
   pointer->x = wl_fixed_from_double (x);
   pointer->y = wl_fixed_from_double (y);
 
+  /* Moving the overlay only queues a clipped redraw of the old and new
+   * cursor areas */
+  if (seat->overlay)
+    clutter_actor_set_position (seat->overlay, x, y);
+
   clayland_seat_repick (seat,
                         clutter_event_get_time (event),
                         clutter_event_get_source (event));
@@ -423,6 +522,12 @@ clayland_seat_free (ClaylandSeat *seat)
 {
   pointer_unmap_sprite (seat);
 
+  if (seat->clipboard)
+    clayland_clipboard_free (seat->clipboard);
+
+  if (seat->drag_motion_timer)
+    wl_event_source_remove (seat->drag_motion_timer);
+
   clayland_pointer_release (&seat->pointer);
   clayland_keyboard_release (&seat->keyboard);
 
@@ -38,6 +38,8 @@ typedef struct _ClaylandKeyboardGrab ClaylandKeyboardGrab;
 typedef struct _ClaylandKeyboardGrabInterface ClaylandKeyboardGrabInterface;
 typedef struct _ClaylandDataOffer ClaylandDataOffer;
 typedef struct _ClaylandDataSource ClaylandDataSource;
+typedef struct _ClaylandClipboard ClaylandClipboard;
+typedef struct _ClaylandPopupGrab ClaylandPopupGrab;
 
 struct _ClaylandPointerGrabInterface
 {
@@ -155,14 +157,21 @@ struct _ClaylandKeyboard
 struct _ClaylandDataOffer
 {
   struct wl_resource *resource;
+  ClaylandSeat *seat;
   ClaylandDataSource *source;
   struct wl_listener source_destroy_listener;
+
+  /* Link in either ClaylandSeat::selection_offer_list or
+   * ClaylandSeat::drag_offer_list while the offer is for the current
+   * selection or drag */
+  struct wl_list link;
 };
 
 struct _ClaylandDataSource
 {
   struct wl_resource *resource;
   struct wl_signal destroy_signal;
+  /* Array of interned MIME type strings */
   struct wl_array mime_types;
 
   void (*accept) (ClaylandDataSource * source,
@@ -181,6 +190,10 @@ struct _ClaylandSeat
   ClaylandDataSource *selection_data_source;
   struct wl_listener selection_data_source_listener;
   struct wl_signal selection_signal;
+  struct wl_list selection_offer_list;
+
+  /* NULL unless the compositor keeps its own copy of the selection */
+  ClaylandClipboard *clipboard;
 
   struct wl_list drag_resource_list;
   struct wl_client *drag_client;
@@ -191,23 +204,41 @@ struct _ClaylandSeat
   struct wl_listener drag_focus_listener;
   ClaylandPointerGrab drag_grab;
   ClaylandSurface *drag_surface;
+  int drag_icon_x, drag_icon_y;
   struct wl_listener drag_icon_listener;
   struct wl_signal drag_icon_signal;
+  struct wl_list drag_offer_list;
+
+  /* Pending coalesced wl_data_device.motion */
+  struct wl_event_source *drag_motion_timer;
+  uint32_t drag_motion_last_sent;
+  gboolean drag_motion_pending;
+  uint32_t drag_motion_time;
+  wl_fixed_t drag_motion_x, drag_motion_y;
 
   ClaylandPointer pointer;
   ClaylandKeyboard keyboard;
 
+  /* Pointer grab for the current chain of popup menus or NULL */
+  ClaylandPopupGrab *popup_grab;
+
+  ClaylandCompositor *compositor;
   struct wl_display *display;
 
   ClaylandSurface *sprite;
   int hotspot_x, hotspot_y;
   struct wl_listener sprite_destroy_listener;
 
+  /* Non-reactive actor kept above all of the windows which holds the
+   * cursor sprite and the DnD icon. Only this actor is moved when the
+   * pointer moves. */
+  ClutterActor *overlay;
+
   ClutterActor *current_stage;
 };
 
 ClaylandSeat *
-clayland_seat_new (struct wl_display *display);
+clayland_seat_new (ClaylandCompositor *compositor);
 
 void
 clayland_seat_handle_event (ClaylandSeat *seat,
@@ -218,6 +249,14 @@ clayland_seat_repick (ClaylandSeat *seat,
                       uint32_t time,
                       ClutterActor *actor);
 
+void
+clayland_seat_init_overlay (ClaylandSeat *seat,
+                            ClutterActor *stage);
+
+void
+clayland_seat_add_overlay_surface (ClaylandSeat *seat,
+                                   ClaylandSurface *surface);
+
 void
 clayland_seat_free (ClaylandSeat *seat);
 
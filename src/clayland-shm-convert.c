@@ -0,0 +1,484 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "clayland-shm-convert.h"
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+/* Converts n pixels to ARGB8888 or XRGB8888 */
+typedef void (* ConvertFunc) (guint32 *dst, const void *src, int n);
+
+typedef struct
+{
+  uint32_t format;
+  int bpp;
+  gboolean has_alpha;
+  ConvertFunc scalar;
+#ifdef HAVE_X86_KERNELS
+  ConvertFunc sse2;
+  ConvertFunc avx2;
+#endif
+#ifdef HAVE_NEON_KERNELS
+  ConvertFunc neon;
+#endif
+} ConvertFormat;
+
+/* The scalar versions also finish off the pixels left over by the
+ * vector ones */
+
+static inline guint32
+convert_xbgr8888_pixel (guint32 p)
+{
+  return 0xff000000 | (p & 0x0000ff00) | (p >> 16 & 0xff) | (p & 0xff) << 16;
+}
+
+static inline guint32
+convert_abgr8888_pixel (guint32 p)
+{
+  return (p & 0xff00ff00) | (p >> 16 & 0xff) | (p & 0xff) << 16;
+}
+
+static inline guint32
+convert_rgb565_pixel (guint16 p)
+{
+  guint32 r = p >> 11 & 0x1f;
+  guint32 g = p >> 5 & 0x3f;
+  guint32 b = p & 0x1f;
+
+  return (0xff000000 |
+          (r << 3 | r >> 2) << 16 |
+          (g << 2 | g >> 4) << 8 |
+          (b << 3 | b >> 2));
+}
+
+/* Only the top 8 bits of each 10 bit channel are kept */
+static inline guint32
+convert_xrgb2101010_pixel (guint32 p)
+{
+  return (0xff000000 |
+          (p >> 6 & 0xff0000) |
+          (p >> 4 & 0xff00) |
+          (p >> 2 & 0xff));
+}
+
+static inline guint32
+convert_argb2101010_pixel (guint32 p)
+{
+  guint32 a = p >> 30;
+
+  return ((a | a << 2 | a << 4 | a << 6) << 24 |
+          (p >> 6 & 0xff0000) |
+          (p >> 4 & 0xff00) |
+          (p >> 2 & 0xff));
+}
+
+#define DEFINE_SCALAR_KERNEL(name, src_type)                            \
+  static void                                                           \
+  convert_##name##_scalar (guint32 *dst, const void *src, int n)        \
+  {                                                                     \
+    const src_type *s = src;                                            \
+    int i;                                                              \
+                                                                        \
+    for (i = 0; i < n; i++)                                             \
+      dst[i] = convert_##name##_pixel (s[i]);                           \
+  }
+
+DEFINE_SCALAR_KERNEL (xbgr8888, guint32)
+DEFINE_SCALAR_KERNEL (abgr8888, guint32)
+DEFINE_SCALAR_KERNEL (rgb565, guint16)
+DEFINE_SCALAR_KERNEL (xrgb2101010, guint32)
+DEFINE_SCALAR_KERNEL (argb2101010, guint32)
+
+#ifdef HAVE_X86_KERNELS
+
+/* The same kernel is built for SSE2 and AVX2 from these macros. V is
+ * the prefix of the intrinsics and W the width of a vector in 32 bit
+ * pixels. */
+
+#define DEFINE_X86_KERNELS(isa, type, V, W, BITS, pack565)              \
+                                                                        \
+  __attribute__ ((target (#isa))) static void                           \
+  convert_swap_##isa (guint32 *dst, const guint32 *src, int n,          \
+                      guint32 alpha)                                    \
+  {                                                                     \
+    const type ga = V##_set1_epi32 (0xff00ff00);                        \
+    const type rb = V##_set1_epi32 (0x000000ff);                        \
+    const type a = V##_set1_epi32 (alpha);                              \
+    int i;                                                              \
+                                                                        \
+    for (i = 0; i + W <= n; i += W)                                     \
+      {                                                                 \
+        type p = V##_loadu_si##BITS ((const type *) (src + i));         \
+        type r = V##_and_si##BITS (V##_srli_epi32 (p, 16), rb);         \
+        type b = V##_slli_epi32 (V##_and_si##BITS (p, rb), 16);         \
+                                                                        \
+        p = V##_or_si##BITS (V##_and_si##BITS (p, ga), a);              \
+        p = V##_or_si##BITS (p, V##_or_si##BITS (r, b));                \
+        V##_storeu_si##BITS ((type *) (dst + i), p);                    \
+      }                                                                 \
+                                                                        \
+    for (; i < n; i++)                                                  \
+      dst[i] = convert_abgr8888_pixel (src[i]) | alpha;                 \
+  }                                                                     \
+                                                                        \
+  __attribute__ ((target (#isa))) static void                           \
+  convert_xbgr8888_##isa (guint32 *dst, const void *src, int n)         \
+  {                                                                     \
+    convert_swap_##isa (dst, src, n, 0xff000000);                       \
+  }                                                                     \
+                                                                        \
+  __attribute__ ((target (#isa))) static void                           \
+  convert_abgr8888_##isa (guint32 *dst, const void *src, int n)         \
+  {                                                                     \
+    convert_swap_##isa (dst, src, n, 0);                                \
+  }                                                                     \
+                                                                        \
+  __attribute__ ((target (#isa))) static void                           \
+  convert_2101010_##isa (guint32 *dst, const guint32 *src, int n,       \
+                         gboolean has_alpha)                            \
+  {                                                                     \
+    const type r_mask = V##_set1_epi32 (0xff0000);                      \
+    const type g_mask = V##_set1_epi32 (0xff00);                        \
+    const type b_mask = V##_set1_epi32 (0xff);                          \
+    const type opaque = V##_set1_epi32 (0xff000000);                    \
+    int i;                                                              \
+                                                                        \
+    for (i = 0; i + W <= n; i += W)                                     \
+      {                                                                 \
+        type p = V##_loadu_si##BITS ((const type *) (src + i));         \
+        type c, a;                                                      \
+                                                                        \
+        c = V##_and_si##BITS (V##_srli_epi32 (p, 6), r_mask);           \
+        c = V##_or_si##BITS                                             \
+          (c, V##_and_si##BITS (V##_srli_epi32 (p, 4), g_mask));        \
+        c = V##_or_si##BITS                                             \
+          (c, V##_and_si##BITS (V##_srli_epi32 (p, 2), b_mask));        \
+                                                                        \
+        if (has_alpha)                                                  \
+          {                                                             \
+            /* Spread the 2 bits of alpha over the top byte */          \
+            a = V##_slli_epi32 (V##_srli_epi32 (p, 30), 24);            \
+            a = V##_or_si##BITS (a, V##_slli_epi32 (a, 2));             \
+            a = V##_or_si##BITS (a, V##_slli_epi32 (a, 4));             \
+          }                                                             \
+        else                                                            \
+          a = opaque;                                                   \
+                                                                        \
+        V##_storeu_si##BITS ((type *) (dst + i),                        \
+                                   V##_or_si##BITS (c, a));             \
+      }                                                                 \
+                                                                        \
+    for (; i < n; i++)                                                  \
+      dst[i] = (has_alpha ?                                             \
+                convert_argb2101010_pixel (src[i]) :                    \
+                convert_xrgb2101010_pixel (src[i]));                    \
+  }                                                                     \
+                                                                        \
+  __attribute__ ((target (#isa))) static void                           \
+  convert_xrgb2101010_##isa (guint32 *dst, const void *src, int n)      \
+  {                                                                     \
+    convert_2101010_##isa (dst, src, n, FALSE);                         \
+  }                                                                     \
+                                                                        \
+  __attribute__ ((target (#isa))) static void                           \
+  convert_argb2101010_##isa (guint32 *dst, const void *src, int n)      \
+  {                                                                     \
+    convert_2101010_##isa (dst, src, n, TRUE);                          \
+  }                                                                     \
+                                                                        \
+  /* Each vector of RGB565 expands to two vectors of pixels */          \
+  __attribute__ ((target (#isa))) static void                           \
+  convert_rgb565_##isa (guint32 *dst, const void *src, int n)           \
+  {                                                                     \
+    const guint16 *s = src;                                             \
+    const type mask5 = V##_set1_epi16 (0x1f);                           \
+    const type mask6 = V##_set1_epi16 (0x3f);                           \
+    const type alpha = V##_set1_epi16 (0xff00);                         \
+    int i;                                                              \
+                                                                        \
+    for (i = 0; i + W * 2 <= n; i += W * 2)                             \
+      {                                                                 \
+        type p = V##_loadu_si##BITS ((const type *) (s + i));           \
+        type r = V##_and_si##BITS (V##_srli_epi16 (p, 11), mask5);      \
+        type g = V##_and_si##BITS (V##_srli_epi16 (p, 5), mask6);       \
+        type b = V##_and_si##BITS (p, mask5);                           \
+        type gb, ar, lo, hi;                                            \
+                                                                        \
+        r = V##_or_si##BITS (V##_slli_epi16 (r, 3),                     \
+                                   V##_srli_epi16 (r, 2));              \
+        g = V##_or_si##BITS (V##_slli_epi16 (g, 2),                     \
+                                   V##_srli_epi16 (g, 4));              \
+        b = V##_or_si##BITS (V##_slli_epi16 (b, 3),                     \
+                                   V##_srli_epi16 (b, 2));              \
+                                                                        \
+        gb = V##_or_si##BITS (b, V##_slli_epi16 (g, 8));                \
+        ar = V##_or_si##BITS (r, alpha);                                \
+        lo = V##_unpacklo_epi16 (gb, ar);                               \
+        hi = V##_unpackhi_epi16 (gb, ar);                               \
+        pack565 (dst + i, lo, hi);                                      \
+      }                                                                 \
+                                                                        \
+    for (; i < n; i++)                                                  \
+      dst[i] = convert_rgb565_pixel (s[i]);                             \
+  }
+
+
+#define STORE_565_SSE2(dst, lo, hi)                                     \
+  G_STMT_START {                                                        \
+    _mm_storeu_si128 ((__m128i *) (dst), lo);                           \
+    _mm_storeu_si128 ((__m128i *) (dst) + 1, hi);                       \
+  } G_STMT_END
+
+/* The AVX2 unpacks work within each 128 bit lane so the halves have
+ * to be put back in order */
+#define STORE_565_AVX2(dst, lo, hi)                                     \
+  G_STMT_START {                                                        \
+    _mm256_storeu_si256 ((__m256i *) (dst),                             \
+                         _mm256_permute2x128_si256 (lo, hi, 0x20));     \
+    _mm256_storeu_si256 ((__m256i *) (dst) + 1,                         \
+                         _mm256_permute2x128_si256 (lo, hi, 0x31));     \
+  } G_STMT_END
+
+DEFINE_X86_KERNELS (sse2, __m128i, _mm, 4, 128, STORE_565_SSE2)
+DEFINE_X86_KERNELS (avx2, __m256i, _mm256, 8, 256, STORE_565_AVX2)
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+
+static void
+convert_swap_neon (guint32 *dst, const guint32 *src, int n, gboolean opaque)
+{
+  int i;
+
+  /* ARGB8888 is stored as B G R A and ABGR8888 as R G B A */
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      uint8x8x4_t p = vld4_u8 ((const uint8_t *) (src + i));
+      uint8x8_t r = p.val[0];
+
+      p.val[0] = p.val[2];
+      p.val[2] = r;
+      if (opaque)
+        p.val[3] = vdup_n_u8 (0xff);
+
+      vst4_u8 ((uint8_t *) (dst + i), p);
+    }
+
+  for (; i < n; i++)
+    dst[i] = (opaque ?
+              convert_xbgr8888_pixel (src[i]) :
+              convert_abgr8888_pixel (src[i]));
+}
+
+static void
+convert_xbgr8888_neon (guint32 *dst, const void *src, int n)
+{
+  convert_swap_neon (dst, src, n, TRUE);
+}
+
+static void
+convert_abgr8888_neon (guint32 *dst, const void *src, int n)
+{
+  convert_swap_neon (dst, src, n, FALSE);
+}
+
+static void
+convert_2101010_neon (guint32 *dst,
+                      const guint32 *src,
+                      int n,
+                      gboolean has_alpha)
+{
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      uint32x4_t p = vld1q_u32 (src + i);
+      uint32x4_t c, a;
+
+      c = vandq_u32 (vshrq_n_u32 (p, 6), vdupq_n_u32 (0xff0000));
+      c = vorrq_u32 (c, vandq_u32 (vshrq_n_u32 (p, 4), vdupq_n_u32 (0xff00)));
+      c = vorrq_u32 (c, vandq_u32 (vshrq_n_u32 (p, 2), vdupq_n_u32 (0xff)));
+
+      if (has_alpha)
+        {
+          a = vshlq_n_u32 (vshrq_n_u32 (p, 30), 24);
+          a = vorrq_u32 (a, vshlq_n_u32 (a, 2));
+          a = vorrq_u32 (a, vshlq_n_u32 (a, 4));
+        }
+      else
+        a = vdupq_n_u32 (0xff000000);
+
+      vst1q_u32 (dst + i, vorrq_u32 (c, a));
+    }
+
+  for (; i < n; i++)
+    dst[i] = (has_alpha ?
+              convert_argb2101010_pixel (src[i]) :
+              convert_xrgb2101010_pixel (src[i]));
+}
+
+static void
+convert_xrgb2101010_neon (guint32 *dst, const void *src, int n)
+{
+  convert_2101010_neon (dst, src, n, FALSE);
+}
+
+static void
+convert_argb2101010_neon (guint32 *dst, const void *src, int n)
+{
+  convert_2101010_neon (dst, src, n, TRUE);
+}
+
+static void
+convert_rgb565_neon (guint32 *dst, const void *src, int n)
+{
+  const guint16 *s = src;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      uint16x8_t p = vld1q_u16 (s + i);
+      uint8x8x4_t out;
+      uint8x8_t r, g, b;
+
+      /* Move each channel to the top of a byte and replicate its high
+       * bits into the low ones */
+      r = vand_u8 (vshrn_n_u16 (p, 8), vdup_n_u8 (0xf8));
+      g = vand_u8 (vshrn_n_u16 (p, 3), vdup_n_u8 (0xfc));
+      b = vmovn_u16 (vshlq_n_u16 (p, 3));
+
+      out.val[0] = vorr_u8 (b, vshr_n_u8 (b, 5));
+      out.val[1] = vorr_u8 (g, vshr_n_u8 (g, 6));
+      out.val[2] = vorr_u8 (r, vshr_n_u8 (r, 5));
+      out.val[3] = vdup_n_u8 (0xff);
+
+      vst4_u8 ((uint8_t *) (dst + i), out);
+    }
+
+  for (; i < n; i++)
+    dst[i] = convert_rgb565_pixel (s[i]);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+#if defined (HAVE_X86_KERNELS)
+#define KERNELS(name)                                                   \
+  convert_##name##_scalar, convert_##name##_sse2, convert_##name##_avx2
+#elif defined (HAVE_NEON_KERNELS)
+#define KERNELS(name) convert_##name##_scalar, convert_##name##_neon
+#else
+#define KERNELS(name) convert_##name##_scalar
+#endif
+
+static const ConvertFormat formats[] =
+  {
+    { WL_SHM_FORMAT_XBGR8888, 4, FALSE, KERNELS (xbgr8888) },
+    { WL_SHM_FORMAT_ABGR8888, 4, TRUE, KERNELS (abgr8888) },
+    { WL_SHM_FORMAT_RGB565, 2, FALSE, KERNELS (rgb565) },
+    { WL_SHM_FORMAT_XRGB2101010, 4, FALSE, KERNELS (xrgb2101010) },
+    { WL_SHM_FORMAT_ARGB2101010, 4, TRUE, KERNELS (argb2101010) }
+  };
+
+static const ConvertFormat *
+find_format (uint32_t format)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++)
+    if (formats[i].format == format)
+      return formats + i;
+
+  return NULL;
+}
+
+static ConvertFunc
+get_convert_func (const ConvertFormat *format)
+{
+#if defined (HAVE_X86_KERNELS)
+  if (__builtin_cpu_supports ("avx2"))
+    return format->avx2;
+  if (__builtin_cpu_supports ("sse2"))
+    return format->sse2;
+#elif defined (HAVE_NEON_KERNELS)
+  return format->neon;
+#endif
+
+  return format->scalar;
+}
+
+void
+clayland_shm_convert_add_formats (struct wl_display *display)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++)
+    wl_display_add_shm_format (display, formats[i].format);
+}
+
+gboolean
+clayland_shm_convert_needed (uint32_t format,
+                             gboolean *has_alpha)
+{
+  const ConvertFormat *convert_format = find_format (format);
+
+  if (convert_format == NULL)
+    return FALSE;
+
+  *has_alpha = convert_format->has_alpha;
+
+  return TRUE;
+}
+
+void
+clayland_shm_convert_rectangle (uint32_t format,
+                                guint32 *dst,
+                                int dst_stride,
+                                const guint8 *src,
+                                int src_stride,
+                                int x,
+                                int y,
+                                int width,
+                                int height)
+{
+  const ConvertFormat *convert_format = find_format (format);
+  ConvertFunc func;
+  int i;
+
+  g_return_if_fail (convert_format != NULL);
+
+  func = get_convert_func (convert_format);
+
+  for (i = y; i < y + height; i++)
+    func ((guint32 *) ((guint8 *) dst + i * dst_stride) + x,
+          src + i * src_stride + x * convert_format->bpp,
+          width);
+}
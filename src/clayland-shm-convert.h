@@ -0,0 +1,55 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_SHM_CONVERT_H__
+#define __CLAYLAND_SHM_CONVERT_H__
+
+#include <glib.h>
+#include <wayland-server.h>
+
+/* Conversion of the wl_shm formats that pixman can't composite quickly
+ * to ARGB8888 or XRGB8888. The kernels are picked at runtime depending
+ * on the instruction sets the CPU supports. */
+
+/* Advertises the formats that can be converted on the display */
+void
+clayland_shm_convert_add_formats (struct wl_display *display);
+
+/* Returns TRUE if buffers in the format have to be converted, in which
+ * case has_alpha tells whether the result is ARGB8888 or XRGB8888 */
+gboolean
+clayland_shm_convert_needed (uint32_t format,
+                             gboolean *has_alpha);
+
+/* Converts a rectangle of src, which is in the given wl_shm format, to
+ * the same place in dst */
+void
+clayland_shm_convert_rectangle (uint32_t format,
+                                guint32 *dst,
+                                int dst_stride,
+                                const guint8 *src,
+                                int src_stride,
+                                int x,
+                                int y,
+                                int width,
+                                int height);
+
+#endif /* __CLAYLAND_SHM_CONVERT_H__ */
@@ -0,0 +1,164 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <clutter/clutter.h>
+
+#include "clayland-stack.h"
+#include "clayland-seat.h"
+
+static gboolean
+window_contains_pointer (ClaylandCompositor *compositor,
+                         ClaylandSurface *surface)
+{
+  ClaylandPointer *pointer = &compositor->seat->pointer;
+  double px = wl_fixed_to_double (pointer->x);
+  double py = wl_fixed_to_double (pointer->y);
+  gdouble scale_x, scale_y;
+  float x = surface->x, y = surface->y, width, height;
+
+  if (!surface->actor || !CLUTTER_ACTOR_IS_VISIBLE (surface->actor))
+    return FALSE;
+
+  clayland_surface_get_size (surface, &width, &height);
+  clutter_actor_get_scale (surface->actor, &scale_x, &scale_y);
+
+  return (px >= x && px < x + width * scale_x &&
+          py >= y && py < y + height * scale_y);
+}
+
+static void
+raise_actor (ClaylandCompositor *compositor,
+             ClutterActor *actor)
+{
+  ClutterActor *stage = compositor->stage;
+
+  clutter_actor_set_child_above_sibling (stage, actor, NULL);
+
+  /* Keep the cursor and DnD icon above all windows */
+  if (compositor->seat->overlay)
+    clutter_actor_set_child_above_sibling (stage,
+                                           compositor->seat->overlay,
+                                           NULL);
+}
+
+void
+clayland_stack_add_window (ClaylandCompositor *compositor,
+                           ClaylandSurface *surface)
+{
+  ClutterActor *actor = surface->actor;
+
+  if (actor)
+    {
+      if (clutter_actor_get_parent (actor))
+        raise_actor (compositor, actor);
+      else
+        {
+          clutter_actor_add_child (compositor->stage, actor);
+          clutter_actor_set_reactive (actor, TRUE);
+
+          if (compositor->seat->overlay)
+            clutter_actor_set_child_above_sibling (compositor->stage,
+                                                   compositor->seat->overlay,
+                                                   NULL);
+        }
+
+      clutter_actor_show (actor);
+    }
+
+  wl_list_remove (&surface->stack_link);
+  wl_list_insert (compositor->stack.prev, &surface->stack_link);
+
+  /* Without Clutter there is only the stacking */
+  if (!actor)
+    clayland_compositor_damage_window (compositor, surface);
+
+  /* A new window only changes what's under the pointer if it
+   * appeared right there */
+  if (window_contains_pointer (compositor, surface))
+    clayland_compositor_repick (compositor);
+}
+
+void
+clayland_stack_remove_window (ClaylandCompositor *compositor,
+                              ClaylandSurface *surface)
+{
+  ClaylandPointer *pointer = &compositor->seat->pointer;
+
+  wl_list_remove (&surface->stack_link);
+  wl_list_init (&surface->stack_link);
+
+  if (surface->actor)
+    {
+      /* Don't let the end of a fullscreen bring it back */
+      g_object_set_data (G_OBJECT (surface->actor), "clayland-covered", NULL);
+      clutter_actor_hide (surface->actor);
+    }
+  else
+    clayland_compositor_damage_window (compositor, surface);
+
+  /* If the pointer wasn't on this surface then it was on something
+   * stacked above it and the surface going away doesn't change
+   * that */
+  if (pointer->current == surface ||
+      pointer->focus == surface ||
+      pointer->grab->focus == surface)
+    clayland_compositor_repick (compositor);
+}
+
+gboolean
+clayland_stack_raise_window (ClaylandCompositor *compositor,
+                             ClaylandSurface *surface)
+{
+  ClaylandPointer *pointer = &compositor->seat->pointer;
+
+  if (wl_list_empty (&surface->stack_link) ||
+      surface->stack_link.next == &compositor->stack)
+    return FALSE;
+
+  wl_list_remove (&surface->stack_link);
+  wl_list_insert (compositor->stack.prev, &surface->stack_link);
+
+  if (surface->actor)
+    raise_actor (compositor, surface->actor);
+  else
+    clayland_compositor_damage_window (compositor, surface);
+
+  /* Raising only makes a difference to the pointer if the window was
+   * partly hidden right where the pointer is */
+  if (pointer->current != surface &&
+      window_contains_pointer (compositor, surface))
+    clayland_compositor_repick (compositor);
+
+  return TRUE;
+}
+
+ClaylandSurface *
+clayland_stack_get_top_window (ClaylandCompositor *compositor)
+{
+  ClaylandSurface *surface;
+
+  if (wl_list_empty (&compositor->stack))
+    return NULL;
+
+  return wl_container_of (compositor->stack.prev, surface, stack_link);
+}
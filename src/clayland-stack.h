@@ -0,0 +1,54 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_STACK_H__
+#define __CLAYLAND_STACK_H__
+
+#include <glib.h>
+
+#include "clayland-compositor.h"
+
+/* The stacking of the windows is tracked in ClaylandCompositor::stack
+ * and mirrored in the order of the stage's children. The input devices
+ * are only repicked when a change can affect the surface under the
+ * pointer. */
+
+/* Shows the actor of the surface as the topmost window, adding it to
+ * the stage if it isn't there yet */
+void
+clayland_stack_add_window (ClaylandCompositor *compositor,
+                           ClaylandSurface *surface);
+
+/* Hides the actor of the surface and takes it out of the stacking.
+ * This should be called before the actor is destroyed. */
+void
+clayland_stack_remove_window (ClaylandCompositor *compositor,
+                              ClaylandSurface *surface);
+
+/* Returns TRUE if the stacking changed */
+gboolean
+clayland_stack_raise_window (ClaylandCompositor *compositor,
+                             ClaylandSurface *surface);
+
+ClaylandSurface *
+clayland_stack_get_top_window (ClaylandCompositor *compositor);
+
+#endif /* __CLAYLAND_STACK_H__ */
@@ -0,0 +1,301 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "clayland-viewporter.h"
+#include "viewporter-server-protocol.h"
+
+#define WP_VIEWPORTER_VERSION 1
+
+struct _ClaylandViewporter
+{
+  ClaylandCompositor *compositor;
+  struct wl_global *global;
+};
+
+void
+clayland_viewport_state_init (ClaylandViewportState *state)
+{
+  state->src_x = 0;
+  state->src_y = 0;
+  state->src_width = -1;
+  state->src_height = -1;
+  state->dst_width = -1;
+  state->dst_height = -1;
+}
+
+gboolean
+clayland_viewport_state_is_set (const ClaylandViewportState *state)
+{
+  return state->src_width >= 0 || state->dst_width >= 0;
+}
+
+gboolean
+clayland_viewport_commit (ClaylandSurface *surface)
+{
+  ClaylandViewportState *state = &surface->pending.viewport;
+  float buffer_width, buffer_height;
+
+  if (!surface->pending.viewport_changed &&
+      !surface->pending.newly_attached)
+    return TRUE;
+
+  /* Without a destination size the surface gets the size of the
+   * source rectangle which therefore has to be whole */
+  if (surface->viewport_resource &&
+      state->src_width >= 0 &&
+      state->dst_width < 0 &&
+      (state->src_width != (int) state->src_width ||
+       state->src_height != (int) state->src_height))
+    {
+      wl_resource_post_error (surface->viewport_resource,
+                              WP_VIEWPORT_ERROR_BAD_SIZE,
+                              "source size is not integer");
+      return FALSE;
+    }
+
+  /* The source rectangle is in the buffer once it has been transformed
+   * and scaled */
+  clayland_surface_get_scaled_buffer_size (surface,
+                                           &buffer_width,
+                                           &buffer_height);
+
+  if (surface->viewport_resource &&
+      state->src_width >= 0 &&
+      surface->buffer_ref.buffer &&
+      (state->src_x + state->src_width > buffer_width ||
+       state->src_y + state->src_height > buffer_height))
+    {
+      wl_resource_post_error (surface->viewport_resource,
+                              WP_VIEWPORT_ERROR_OUT_OF_BUFFER,
+                              "source rectangle extends outside of the "
+                              "buffer");
+      return FALSE;
+    }
+
+  surface->viewport = *state;
+  surface->pending.viewport_changed = FALSE;
+
+  return TRUE;
+}
+
+static void
+viewport_destroy_cb (struct wl_resource *resource)
+{
+  ClaylandSurface *surface = wl_resource_get_user_data (resource);
+
+  if (surface == NULL)
+    return;
+
+  /* The surface goes back to its buffer's size on the next commit */
+  clayland_viewport_state_init (&surface->pending.viewport);
+  surface->pending.viewport_changed = TRUE;
+  surface->viewport_resource = NULL;
+}
+
+void
+clayland_viewport_surface_destroyed (ClaylandSurface *surface)
+{
+  if (surface->viewport_resource)
+    wl_resource_set_user_data (surface->viewport_resource, NULL);
+}
+
+static void
+viewport_destroy (struct wl_client *client,
+                  struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+viewport_set_source (struct wl_client *client,
+                     struct wl_resource *resource,
+                     wl_fixed_t x,
+                     wl_fixed_t y,
+                     wl_fixed_t width,
+                     wl_fixed_t height)
+{
+  ClaylandSurface *surface = wl_resource_get_user_data (resource);
+  ClaylandViewportState *state;
+
+  if (surface == NULL)
+    {
+      wl_resource_post_error (resource,
+                              WP_VIEWPORT_ERROR_NO_SURFACE,
+                              "the surface has been destroyed");
+      return;
+    }
+
+  state = &surface->pending.viewport;
+
+  if (x == wl_fixed_from_int (-1) && y == wl_fixed_from_int (-1) &&
+      width == wl_fixed_from_int (-1) && height == wl_fixed_from_int (-1))
+    {
+      state->src_x = 0;
+      state->src_y = 0;
+      state->src_width = -1;
+      state->src_height = -1;
+    }
+  else if (x < 0 || y < 0 || width <= 0 || height <= 0)
+    {
+      wl_resource_post_error (resource,
+                              WP_VIEWPORT_ERROR_BAD_VALUE,
+                              "invalid source rectangle");
+      return;
+    }
+  else
+    {
+      state->src_x = wl_fixed_to_double (x);
+      state->src_y = wl_fixed_to_double (y);
+      state->src_width = wl_fixed_to_double (width);
+      state->src_height = wl_fixed_to_double (height);
+    }
+
+  surface->pending.viewport_changed = TRUE;
+}
+
+static void
+viewport_set_destination (struct wl_client *client,
+                          struct wl_resource *resource,
+                          int32_t width,
+                          int32_t height)
+{
+  ClaylandSurface *surface = wl_resource_get_user_data (resource);
+  ClaylandViewportState *state;
+
+  if (surface == NULL)
+    {
+      wl_resource_post_error (resource,
+                              WP_VIEWPORT_ERROR_NO_SURFACE,
+                              "the surface has been destroyed");
+      return;
+    }
+
+  state = &surface->pending.viewport;
+
+  if (width == -1 && height == -1)
+    {
+      state->dst_width = -1;
+      state->dst_height = -1;
+    }
+  else if (width <= 0 || height <= 0)
+    {
+      wl_resource_post_error (resource,
+                              WP_VIEWPORT_ERROR_BAD_VALUE,
+                              "invalid destination size");
+      return;
+    }
+  else
+    {
+      state->dst_width = width;
+      state->dst_height = height;
+    }
+
+  surface->pending.viewport_changed = TRUE;
+}
+
+static const struct wp_viewport_interface clayland_viewport_interface =
+{
+  viewport_destroy,
+  viewport_set_source,
+  viewport_set_destination
+};
+
+static void
+viewporter_destroy (struct wl_client *client,
+                    struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+viewporter_get_viewport (struct wl_client *client,
+                         struct wl_resource *resource,
+                         guint32 id,
+                         struct wl_resource *surface_resource)
+{
+  ClaylandSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  if (surface->viewport_resource)
+    {
+      wl_resource_post_error (resource,
+                              WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS,
+                              "the surface already has a viewport");
+      return;
+    }
+
+  surface->viewport_resource =
+    wl_resource_create (client, &wp_viewport_interface,
+                        wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (surface->viewport_resource,
+                                  &clayland_viewport_interface,
+                                  surface,
+                                  viewport_destroy_cb);
+}
+
+static const struct wp_viewporter_interface clayland_viewporter_interface =
+{
+  viewporter_destroy,
+  viewporter_get_viewport
+};
+
+static void
+bind_viewporter (struct wl_client *client,
+                 void *data,
+                 guint32 version,
+                 guint32 id)
+{
+  ClaylandViewporter *viewporter = data;
+  struct wl_resource *resource;
+
+  resource = wl_resource_create (client, &wp_viewporter_interface,
+                                 MIN (version, WP_VIEWPORTER_VERSION), id);
+  wl_resource_set_implementation (resource,
+                                  &clayland_viewporter_interface,
+                                  viewporter,
+                                  NULL);
+}
+
+ClaylandViewporter *
+clayland_viewporter_init (ClaylandCompositor *compositor)
+{
+  ClaylandViewporter *viewporter = g_slice_new0 (ClaylandViewporter);
+
+  viewporter->compositor = compositor;
+
+  viewporter->global = wl_global_create (compositor->wayland_display,
+                                         &wp_viewporter_interface,
+                                         WP_VIEWPORTER_VERSION,
+                                         viewporter, bind_viewporter);
+  if (viewporter->global == NULL)
+    g_error ("Failed to register a global wp_viewporter object");
+
+  return viewporter;
+}
+
+void
+clayland_viewporter_free (ClaylandViewporter *viewporter)
+{
+  wl_global_destroy (viewporter->global);
+
+  g_slice_free (ClaylandViewporter, viewporter);
+}
@@ -0,0 +1,60 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_VIEWPORTER_H__
+#define __CLAYLAND_VIEWPORTER_H__
+
+#include <wayland-server.h>
+#include <glib.h>
+
+#include "clayland-compositor.h"
+
+/* wp_viewporter lets clients crop and scale their buffers. The state is
+ * double-buffered in ClaylandSurface and applied on commit. */
+
+typedef struct _ClaylandViewporter ClaylandViewporter;
+
+/* Registers the wp_viewporter global */
+ClaylandViewporter *
+clayland_viewporter_init (ClaylandCompositor *compositor);
+
+void
+clayland_viewporter_free (ClaylandViewporter *viewporter);
+
+/* Resets the state to no source rectangle and no destination size */
+void
+clayland_viewport_state_init (ClaylandViewportState *state);
+
+/* Whether a source rectangle or a destination size is set */
+gboolean
+clayland_viewport_state_is_set (const ClaylandViewportState *state);
+
+/* Checks the pending viewport of the surface against its new buffer
+ * and applies it. Returns FALSE, after posting an error, if it isn't
+ * valid. */
+gboolean
+clayland_viewport_commit (ClaylandSurface *surface);
+
+/* Makes the viewport object of a surface being destroyed inert */
+void
+clayland_viewport_surface_destroyed (ClaylandSurface *surface);
+
+#endif /* __CLAYLAND_VIEWPORTER_H__ */
@@ -0,0 +1,152 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "clayland-window-grab.h"
+#include "clayland-pointer.h"
+
+void
+clayland_window_grab_end (ClaylandWindowGrab *window_grab)
+{
+  ClaylandPointer *pointer = window_grab->grab.pointer;
+
+  if (window_grab->end)
+    window_grab->end (window_grab);
+
+  clayland_pointer_end_grab (pointer);
+
+  g_slice_free (ClaylandWindowGrab, window_grab);
+}
+
+static void
+window_grab_focus (ClaylandPointerGrab *grab,
+                   ClaylandSurface *surface,
+                   wl_fixed_t x,
+                   wl_fixed_t y)
+{
+  /* No client gets pointer focus while the window is being moved */
+  grab->focus = NULL;
+}
+
+static void
+window_grab_button (ClaylandPointerGrab *grab,
+                    uint32_t time,
+                    uint32_t button,
+                    uint32_t state)
+{
+  ClaylandWindowGrab *window_grab = wl_container_of (grab, window_grab, grab);
+
+  if (grab->pointer->button_count == 0 &&
+      state == WL_POINTER_BUTTON_STATE_RELEASED)
+    clayland_window_grab_end (window_grab);
+}
+
+static void
+move_grab_motion (ClaylandPointerGrab *grab,
+                  uint32_t time,
+                  wl_fixed_t x,
+                  wl_fixed_t y)
+{
+  ClaylandWindowGrab *window_grab = wl_container_of (grab, window_grab, grab);
+  ClaylandPointer *pointer = grab->pointer;
+
+  clayland_surface_set_position (window_grab->surface,
+                                 wl_fixed_to_int (pointer->x +
+                                                  window_grab->dx),
+                                 wl_fixed_to_int (pointer->y +
+                                                  window_grab->dy));
+}
+
+static const ClaylandPointerGrabInterface move_grab_interface = {
+  window_grab_focus,
+  move_grab_motion,
+  window_grab_button
+};
+
+static void
+resize_grab_motion (ClaylandPointerGrab *grab,
+                    uint32_t time,
+                    wl_fixed_t x,
+                    wl_fixed_t y)
+{
+  ClaylandWindowGrab *window_grab = wl_container_of (grab, window_grab, grab);
+  ClaylandPointer *pointer = grab->pointer;
+  int32_t dx = wl_fixed_to_int (pointer->x - pointer->grab_x);
+  int32_t dy = wl_fixed_to_int (pointer->y - pointer->grab_y);
+  int32_t width = window_grab->width;
+  int32_t height = window_grab->height;
+
+  if (window_grab->edges & WL_SHELL_SURFACE_RESIZE_LEFT)
+    width -= dx;
+  else if (window_grab->edges & WL_SHELL_SURFACE_RESIZE_RIGHT)
+    width += dx;
+
+  if (window_grab->edges & WL_SHELL_SURFACE_RESIZE_TOP)
+    height -= dy;
+  else if (window_grab->edges & WL_SHELL_SURFACE_RESIZE_BOTTOM)
+    height += dy;
+
+  if (window_grab->resize)
+    window_grab->resize (window_grab, width, height);
+}
+
+static const ClaylandPointerGrabInterface resize_grab_interface = {
+  window_grab_focus,
+  resize_grab_motion,
+  window_grab_button
+};
+
+ClaylandWindowGrab *
+clayland_window_grab_start (ClaylandSurface *surface,
+                            ClaylandSeat *seat,
+                            guint32 serial,
+                            guint32 edges,
+                            int32_t width,
+                            int32_t height)
+{
+  ClaylandPointer *pointer = &seat->pointer;
+  ClaylandWindowGrab *window_grab;
+
+  /* Only start the grab from an implicit grab on this surface */
+  if (pointer->button_count == 0 ||
+      pointer->grab != &pointer->default_grab ||
+      pointer->grab_serial != serial ||
+      pointer->focus != surface)
+    return NULL;
+
+  window_grab = g_slice_new0 (ClaylandWindowGrab);
+  window_grab->grab.interface =
+    edges ? &resize_grab_interface : &move_grab_interface;
+  window_grab->surface = surface;
+  window_grab->dx = wl_fixed_from_int (surface->x) - pointer->grab_x;
+  window_grab->dy = wl_fixed_from_int (surface->y) - pointer->grab_y;
+  window_grab->edges = edges;
+  window_grab->width = width;
+  window_grab->height = height;
+
+  clayland_pointer_set_focus (pointer, NULL,
+                              wl_fixed_from_int (0),
+                              wl_fixed_from_int (0));
+  clayland_pointer_start_grab (pointer, &window_grab->grab);
+
+  return window_grab;
+}
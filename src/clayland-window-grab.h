@@ -0,0 +1,71 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_WINDOW_GRAB_H__
+#define __CLAYLAND_WINDOW_GRAB_H__
+
+#include <wayland-server.h>
+#include <glib.h>
+
+#include "clayland-seat.h"
+
+/* Pointer grab for the interactive moves and resizes of the shells.
+ * The edges use the values of wl_shell_surface.resize, which
+ * xdg_toplevel.resize_edge shares. */
+
+typedef struct _ClaylandWindowGrab ClaylandWindowGrab;
+
+struct _ClaylandWindowGrab
+{
+  ClaylandPointerGrab grab;
+  ClaylandSurface *surface;
+
+  /* Offset from the pointer to the window position for moves */
+  wl_fixed_t dx, dy;
+
+  /* Edges being dragged, 0 for a move, and the window size at the
+   * start of a resize */
+  guint32 edges;
+  int32_t width, height;
+
+  /* Called with the size the pointer asks for during a resize. It
+   * isn't clamped to anything. */
+  void (*resize) (ClaylandWindowGrab *grab, int32_t width, int32_t height);
+  /* Called when the grab ends, just before it is freed */
+  void (*end) (ClaylandWindowGrab *grab);
+  void *data;
+};
+
+/* Starts moving the surface, or resizing it from its current size if
+ * edges isn't 0. Returns NULL unless the serial belongs to an
+ * implicit grab on the surface. */
+ClaylandWindowGrab *
+clayland_window_grab_start (ClaylandSurface *surface,
+                            ClaylandSeat *seat,
+                            guint32 serial,
+                            guint32 edges,
+                            int32_t width,
+                            int32_t height);
+
+void
+clayland_window_grab_end (ClaylandWindowGrab *window_grab);
+
+#endif /* __CLAYLAND_WINDOW_GRAB_H__ */
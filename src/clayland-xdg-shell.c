@@ -0,0 +1,2041 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <clutter/clutter.h>
+#include <string.h>
+
+#include "xdg-shell-server-protocol.h"
+#include "clayland-xdg-shell.h"
+#include "clayland-seat.h"
+#include "clayland-pointer.h"
+#include "clayland-keyboard.h"
+#include "clayland-popup.h"
+#include "clayland-stack.h"
+#include "clayland-window-grab.h"
+
+#define XDG_WM_BASE_VERSION 6
+
+/* Configures are normally sent straight after a frame has been
+ * painted. If nothing gets painted in this many milliseconds after one
+ * has been scheduled, it is sent anyway. */
+#define CONFIGURE_TIMEOUT 16
+
+#define STATE_BIT(state) (1 << XDG_TOPLEVEL_STATE_ ## state)
+
+typedef struct _ClaylandXdgSurface ClaylandXdgSurface;
+
+typedef enum
+{
+  CLAYLAND_XDG_ROLE_NONE,
+  CLAYLAND_XDG_ROLE_TOPLEVEL,
+  CLAYLAND_XDG_ROLE_POPUP
+} ClaylandXdgRole;
+
+struct _ClaylandXdgShell
+{
+  ClaylandCompositor *compositor;
+  struct wl_global *global;
+
+  /* xdg_surfaces with a configure to send after the next frame */
+  struct wl_list configure_list;
+  struct wl_event_source *configure_timer;
+  struct wl_listener frame_listener;
+
+  /* Toplevel which currently has the activated state */
+  ClaylandXdgSurface *activated;
+  struct wl_listener keyboard_focus_listener;
+
+  struct wl_listener output_changed_listener;
+
+  /* xdg_wm_base resources, which the pings go through */
+  struct wl_list resource_list;
+};
+
+typedef struct
+{
+  int32_t width, height;
+  /* The anchor rectangle may be empty so whether it has been set is
+   * tracked separately */
+  gboolean anchor_rect_set;
+  cairo_rectangle_int_t anchor_rect;
+  guint32 anchor;
+  guint32 gravity;
+  guint32 constraint_adjustment;
+  int32_t offset_x, offset_y;
+  /* Whether the popup should be constrained again when its parent
+   * changes */
+  gboolean reactive;
+  /* The parent size and configure the popup is being positioned
+   * for, if any */
+  int32_t parent_width, parent_height;
+  guint32 parent_configure;
+} ClaylandXdgPositioner;
+
+typedef struct
+{
+  struct wl_list link;
+  guint32 serial;
+
+  /* xdg_toplevel.configure */
+  int32_t width, height;
+  guint32 states;
+  guint32 resize_edges;
+
+  /* xdg_popup.configure, relative to the parent's window geometry */
+  cairo_rectangle_int_t popup_geometry;
+} ClaylandXdgConfigure;
+
+struct _ClaylandXdgSurface
+{
+  ClaylandXdgShell *shell;
+  ClaylandSurface *surface;
+  struct wl_resource *resource;
+  struct wl_listener surface_destroy_listener;
+
+  ClaylandXdgRole role;
+  /* The xdg_toplevel or xdg_popup, NULL once it has been destroyed */
+  struct wl_resource *role_resource;
+
+  /* Configures sent to the client that it hasn't acknowledged yet,
+   * oldest first */
+  struct wl_list configure_list;
+  /* The most recently acknowledged configure. Its state is applied
+   * atomically with the next commit. */
+  ClaylandXdgConfigure *acked;
+  /* Whether the client has acknowledged a configure since it was last
+   * unmapped. Buffers may only be attached after that. */
+  gboolean configured;
+  gboolean mapped;
+
+  /* Link in ClaylandXdgShell::configure_list */
+  struct wl_list schedule_link;
+
+  /* xdg_surface.set_window_geometry */
+  gboolean geometry_set;
+  cairo_rectangle_int_t geometry;
+  gboolean pending_geometry_set;
+  cairo_rectangle_int_t pending_geometry;
+
+  /* Size of the actor after the previous commit */
+  float width, height;
+
+  /* xdg_popups that have this surface as their parent */
+  struct wl_list popup_list;
+
+  struct
+  {
+    /* State that goes in the next configure */
+    guint32 states;
+    int32_t width, height;
+    guint32 resize_edges;
+
+    /* State of the last applied configure */
+    guint32 current_states;
+
+    /* Position and window geometry size to go back to when leaving
+     * the maximized or fullscreen state */
+    float saved_x, saved_y;
+    int32_t saved_width, saved_height;
+
+    int32_t min_width, min_height;
+    int32_t max_width, max_height;
+    int32_t pending_min_width, pending_min_height;
+    int32_t pending_max_width, pending_max_height;
+
+    struct wl_resource *parent_resource;
+    struct wl_listener parent_destroy_listener;
+
+    char *title;
+    char *app_id;
+
+    ClaylandWindowGrab *grab;
+  } toplevel;
+
+  struct
+  {
+    ClaylandXdgSurface *parent;
+    /* Link in the parent's popup_list */
+    struct wl_list link;
+    ClaylandXdgPositioner positioner;
+    cairo_rectangle_int_t geometry;
+    /* xdg_popup.grab */
+    ClaylandPopup grab;
+  } popup;
+};
+
+static void xdg_surface_commit (ClaylandSurface *surface,
+                                int32_t sx,
+                                int32_t sy);
+
+static ClaylandXdgSurface *
+xdg_surface_from_surface (ClaylandSurface *surface)
+{
+  if (surface->configure != xdg_surface_commit)
+    return NULL;
+
+  return surface->configure_private;
+}
+
+/* Popups are kept on the output of their toplevel */
+static ClaylandOutput *
+xdg_surface_get_output (ClaylandXdgSurface *xdg_surface)
+{
+  while (xdg_surface->role == CLAYLAND_XDG_ROLE_POPUP &&
+         xdg_surface->popup.parent)
+    xdg_surface = xdg_surface->popup.parent;
+
+  return clayland_compositor_get_surface_output (xdg_surface->shell->compositor,
+                                                 xdg_surface->surface);
+}
+
+static void
+xdg_surface_get_geometry (ClaylandXdgSurface *xdg_surface,
+                          cairo_rectangle_int_t *geometry)
+{
+  if (xdg_surface->geometry_set)
+    *geometry = xdg_surface->geometry;
+  else
+    {
+      geometry->x = 0;
+      geometry->y = 0;
+      geometry->width = xdg_surface->width;
+      geometry->height = xdg_surface->height;
+    }
+}
+
+static void
+xdg_surface_schedule_configure (ClaylandXdgSurface *xdg_surface)
+{
+  ClaylandXdgShell *shell = xdg_surface->shell;
+
+  if (!xdg_surface->role_resource ||
+      !wl_list_empty (&xdg_surface->schedule_link))
+    return;
+
+  if (wl_list_empty (&shell->configure_list))
+    wl_event_source_timer_update (shell->configure_timer, CONFIGURE_TIMEOUT);
+
+  wl_list_insert (shell->configure_list.prev, &xdg_surface->schedule_link);
+}
+
+static void
+xdg_positioner_get_geometry (const ClaylandXdgPositioner *positioner,
+                             cairo_rectangle_int_t *geometry)
+{
+  const cairo_rectangle_int_t *rect = &positioner->anchor_rect;
+  int32_t x, y;
+
+  switch (positioner->anchor)
+    {
+    case XDG_POSITIONER_ANCHOR_LEFT:
+    case XDG_POSITIONER_ANCHOR_TOP_LEFT:
+    case XDG_POSITIONER_ANCHOR_BOTTOM_LEFT:
+      x = rect->x;
+      break;
+    case XDG_POSITIONER_ANCHOR_RIGHT:
+    case XDG_POSITIONER_ANCHOR_TOP_RIGHT:
+    case XDG_POSITIONER_ANCHOR_BOTTOM_RIGHT:
+      x = rect->x + rect->width;
+      break;
+    default:
+      x = rect->x + rect->width / 2;
+      break;
+    }
+
+  switch (positioner->anchor)
+    {
+    case XDG_POSITIONER_ANCHOR_TOP:
+    case XDG_POSITIONER_ANCHOR_TOP_LEFT:
+    case XDG_POSITIONER_ANCHOR_TOP_RIGHT:
+      y = rect->y;
+      break;
+    case XDG_POSITIONER_ANCHOR_BOTTOM:
+    case XDG_POSITIONER_ANCHOR_BOTTOM_LEFT:
+    case XDG_POSITIONER_ANCHOR_BOTTOM_RIGHT:
+      y = rect->y + rect->height;
+      break;
+    default:
+      y = rect->y + rect->height / 2;
+      break;
+    }
+
+  switch (positioner->gravity)
+    {
+    case XDG_POSITIONER_GRAVITY_LEFT:
+    case XDG_POSITIONER_GRAVITY_TOP_LEFT:
+    case XDG_POSITIONER_GRAVITY_BOTTOM_LEFT:
+      x -= positioner->width;
+      break;
+    case XDG_POSITIONER_GRAVITY_RIGHT:
+    case XDG_POSITIONER_GRAVITY_TOP_RIGHT:
+    case XDG_POSITIONER_GRAVITY_BOTTOM_RIGHT:
+      break;
+    default:
+      x -= positioner->width / 2;
+      break;
+    }
+
+  switch (positioner->gravity)
+    {
+    case XDG_POSITIONER_GRAVITY_TOP:
+    case XDG_POSITIONER_GRAVITY_TOP_LEFT:
+    case XDG_POSITIONER_GRAVITY_TOP_RIGHT:
+      y -= positioner->height;
+      break;
+    case XDG_POSITIONER_GRAVITY_BOTTOM:
+    case XDG_POSITIONER_GRAVITY_BOTTOM_LEFT:
+    case XDG_POSITIONER_GRAVITY_BOTTOM_RIGHT:
+      break;
+    default:
+      y -= positioner->height / 2;
+      break;
+    }
+
+  geometry->x = x + positioner->offset_x;
+  geometry->y = y + positioner->offset_y;
+  geometry->width = positioner->width;
+  geometry->height = positioner->height;
+}
+
+/* Returns the position of the window geometry of xdg_surface in stage
+ * coordinates */
+static void
+xdg_surface_get_window_position (ClaylandXdgSurface *xdg_surface,
+                                 float *x,
+                                 float *y)
+{
+  cairo_rectangle_int_t geometry;
+
+  *x = 0;
+  *y = 0;
+
+  if (!xdg_surface->surface)
+    return;
+
+  xdg_surface_get_geometry (xdg_surface, &geometry);
+  *x = xdg_surface->surface->x + geometry.x;
+  *y = xdg_surface->surface->y + geometry.y;
+}
+
+static void
+xdg_popup_compute_geometry (ClaylandXdgSurface *xdg_surface,
+                            cairo_rectangle_int_t *geometry)
+{
+  ClaylandXdgPositioner *positioner = &xdg_surface->popup.positioner;
+  ClaylandOutput *output = xdg_surface_get_output (xdg_surface);
+  float parent_x, parent_y;
+  int32_t x, y;
+
+  xdg_positioner_get_geometry (positioner, geometry);
+
+  if (!xdg_surface->popup.parent)
+    return;
+
+  /* Only sliding is supported to keep the popup on the output. That
+   * is what menus need the most. */
+  xdg_surface_get_window_position (xdg_surface->popup.parent,
+                                   &parent_x, &parent_y);
+  x = parent_x + geometry->x;
+  y = parent_y + geometry->y;
+
+  if (positioner->constraint_adjustment &
+      XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_X)
+    {
+      if (x + geometry->width > output->x + output->width)
+        x = output->x + output->width - geometry->width;
+      if (x < output->x)
+        x = output->x;
+    }
+
+  if (positioner->constraint_adjustment &
+      XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_Y)
+    {
+      if (y + geometry->height > output->y + output->height)
+        y = output->y + output->height - geometry->height;
+      if (y < output->y)
+        y = output->y;
+    }
+
+  geometry->x = x - (int32_t) parent_x;
+  geometry->y = y - (int32_t) parent_y;
+}
+
+static void
+send_configure (ClaylandXdgSurface *xdg_surface)
+{
+  ClaylandXdgConfigure *configure = g_slice_new0 (ClaylandXdgConfigure);
+  struct wl_display *display =
+    xdg_surface->shell->compositor->wayland_display;
+
+  configure->serial = wl_display_next_serial (display);
+
+  if (xdg_surface->role == CLAYLAND_XDG_ROLE_TOPLEVEL)
+    {
+      int version = wl_resource_get_version (xdg_surface->role_resource);
+      struct wl_array states;
+      guint32 state;
+
+      configure->width = xdg_surface->toplevel.width;
+      configure->height = xdg_surface->toplevel.height;
+      configure->states = xdg_surface->toplevel.states;
+      configure->resize_edges = xdg_surface->toplevel.resize_edges;
+
+      wl_array_init (&states);
+      for (state = XDG_TOPLEVEL_STATE_MAXIMIZED;
+           state <= XDG_TOPLEVEL_STATE_SUSPENDED;
+           state++)
+        {
+          guint32 *p;
+
+          if (!(configure->states & (1 << state)))
+            continue;
+          if (state == XDG_TOPLEVEL_STATE_SUSPENDED &&
+              version < XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION)
+            continue;
+
+          p = wl_array_add (&states, sizeof (guint32));
+          *p = state;
+        }
+
+      xdg_toplevel_send_configure (xdg_surface->role_resource,
+                                   configure->width,
+                                   configure->height,
+                                   &states);
+      wl_array_release (&states);
+    }
+  else
+    {
+      xdg_popup_compute_geometry (xdg_surface, &configure->popup_geometry);
+
+      xdg_popup_send_configure (xdg_surface->role_resource,
+                                configure->popup_geometry.x,
+                                configure->popup_geometry.y,
+                                configure->popup_geometry.width,
+                                configure->popup_geometry.height);
+    }
+
+  xdg_surface_send_configure (xdg_surface->resource, configure->serial);
+
+  wl_list_insert (xdg_surface->configure_list.prev, &configure->link);
+}
+
+static void
+xdg_shell_flush_configures (ClaylandXdgShell *shell)
+{
+  wl_event_source_timer_update (shell->configure_timer, 0);
+
+  while (!wl_list_empty (&shell->configure_list))
+    {
+      ClaylandXdgSurface *xdg_surface =
+        wl_container_of (shell->configure_list.next,
+                         xdg_surface, schedule_link);
+
+      wl_list_remove (&xdg_surface->schedule_link);
+      wl_list_init (&xdg_surface->schedule_link);
+
+      send_configure (xdg_surface);
+    }
+}
+
+static void
+xdg_toplevel_set_state (ClaylandXdgSurface *xdg_surface,
+                        guint32 bit,
+                        gboolean enabled)
+{
+  guint32 states = xdg_surface->toplevel.states;
+
+  if (enabled)
+    states |= bit;
+  else
+    states &= ~bit;
+
+  if (states == xdg_surface->toplevel.states)
+    return;
+
+  xdg_surface->toplevel.states = states;
+  xdg_surface_schedule_configure (xdg_surface);
+}
+
+/* Toplevels whose actors can't be seen at all are told that they are
+ * suspended so that they can stop rendering. The stacking is walked
+ * from the top, accumulating the opaque regions of the windows seen so
+ * far. */
+static void
+xdg_shell_update_suspended (ClaylandXdgShell *shell)
+{
+  ClaylandCompositor *compositor = shell->compositor;
+  cairo_region_t *outputs = cairo_region_create ();
+  cairo_region_t *opaque = cairo_region_create ();
+  ClaylandSurface *surface;
+  GList *l;
+
+  for (l = compositor->outputs; l; l = l->next)
+    {
+      ClaylandOutput *output = l->data;
+      cairo_rectangle_int_t rect =
+        { output->x, output->y, output->width, output->height };
+
+      cairo_region_union_rectangle (outputs, &rect);
+    }
+
+  wl_list_for_each_reverse (surface, &compositor->stack, stack_link)
+    {
+      ClaylandXdgSurface *xdg_surface;
+      cairo_rectangle_int_t rect;
+      gdouble scale_x = 1.0, scale_y = 1.0;
+      guint8 opacity = 255;
+      float width, height;
+      gboolean visible = TRUE, hidden;
+
+      clayland_surface_get_size (surface, &width, &height);
+
+      /* Without Clutter every window in the stacking gets painted as
+       * it is */
+      if (surface->actor)
+        {
+          clutter_actor_get_scale (surface->actor, &scale_x, &scale_y);
+          opacity = clutter_actor_get_opacity (surface->actor);
+          visible = (CLUTTER_ACTOR_IS_VISIBLE (surface->actor) &&
+                     opacity > 0);
+        }
+
+      rect.x = surface->x;
+      rect.y = surface->y;
+      rect.width = width * scale_x;
+      rect.height = height * scale_y;
+
+      if (visible)
+        {
+          cairo_region_t *area = cairo_region_create_rectangle (&rect);
+
+          cairo_region_intersect (area, outputs);
+          cairo_region_subtract (area, opaque);
+          hidden = cairo_region_is_empty (area);
+          cairo_region_destroy (area);
+        }
+      else
+        hidden = TRUE;
+
+      xdg_surface = xdg_surface_from_surface (surface);
+      if (xdg_surface &&
+          xdg_surface->role == CLAYLAND_XDG_ROLE_TOPLEVEL &&
+          xdg_surface->mapped)
+        xdg_toplevel_set_state (xdg_surface, STATE_BIT (SUSPENDED), hidden);
+
+      /* Only unscaled, fully opaque windows occlude what's below */
+      if (visible && !hidden &&
+          surface->opaque_region &&
+          opacity == 255 &&
+          scale_x == 1.0 && scale_y == 1.0)
+        {
+          cairo_region_t *region = cairo_region_copy (surface->opaque_region);
+
+          cairo_region_translate (region, rect.x, rect.y);
+          cairo_region_intersect_rectangle (region, &rect);
+          cairo_region_union (opaque, region);
+          cairo_region_destroy (region);
+        }
+    }
+
+  cairo_region_destroy (opaque);
+  cairo_region_destroy (outputs);
+}
+
+static void
+frame_cb (struct wl_listener *listener,
+          void *data)
+{
+  ClaylandXdgShell *shell = wl_container_of (listener, shell, frame_listener);
+
+  xdg_shell_update_suspended (shell);
+  xdg_shell_flush_configures (shell);
+}
+
+static int
+configure_timer_cb (void *data)
+{
+  ClaylandXdgShell *shell = data;
+
+  xdg_shell_flush_configures (shell);
+
+  return 0;
+}
+
+static void
+keyboard_focus_cb (struct wl_listener *listener,
+                   void *data)
+{
+  ClaylandXdgShell *shell =
+    wl_container_of (listener, shell, keyboard_focus_listener);
+  ClaylandKeyboard *keyboard = data;
+  ClaylandXdgSurface *focus = NULL;
+
+  if (keyboard->focus)
+    focus = xdg_surface_from_surface (keyboard->focus);
+
+  /* Focusing a menu keeps the window it belongs to activated */
+  while (focus && focus->role == CLAYLAND_XDG_ROLE_POPUP)
+    focus = focus->popup.parent;
+
+  if (focus && focus->role != CLAYLAND_XDG_ROLE_TOPLEVEL)
+    focus = NULL;
+
+  if (focus == shell->activated)
+    return;
+
+  if (shell->activated)
+    xdg_toplevel_set_state (shell->activated, STATE_BIT (ACTIVATED), FALSE);
+
+  shell->activated = focus;
+
+  if (focus)
+    xdg_toplevel_set_state (focus, STATE_BIT (ACTIVATED), TRUE);
+}
+
+static void
+xdg_positioner_destroy (struct wl_client *client,
+                        struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+xdg_positioner_set_size (struct wl_client *client,
+                         struct wl_resource *resource,
+                         int32_t width,
+                         int32_t height)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  if (width <= 0 || height <= 0)
+    {
+      wl_resource_post_error (resource,
+                              XDG_POSITIONER_ERROR_INVALID_INPUT,
+                              "invalid positioner size");
+      return;
+    }
+
+  positioner->width = width;
+  positioner->height = height;
+}
+
+static void
+xdg_positioner_set_anchor_rect (struct wl_client *client,
+                                struct wl_resource *resource,
+                                int32_t x,
+                                int32_t y,
+                                int32_t width,
+                                int32_t height)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  if (width < 0 || height < 0)
+    {
+      wl_resource_post_error (resource,
+                              XDG_POSITIONER_ERROR_INVALID_INPUT,
+                              "invalid anchor rectangle");
+      return;
+    }
+
+  positioner->anchor_rect.x = x;
+  positioner->anchor_rect.y = y;
+  positioner->anchor_rect.width = width;
+  positioner->anchor_rect.height = height;
+  positioner->anchor_rect_set = TRUE;
+}
+
+static void
+xdg_positioner_set_anchor (struct wl_client *client,
+                           struct wl_resource *resource,
+                           guint32 anchor)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  positioner->anchor = anchor;
+}
+
+static void
+xdg_positioner_set_gravity (struct wl_client *client,
+                            struct wl_resource *resource,
+                            guint32 gravity)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  positioner->gravity = gravity;
+}
+
+static void
+xdg_positioner_set_constraint_adjustment (struct wl_client *client,
+                                          struct wl_resource *resource,
+                                          guint32 constraint_adjustment)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  positioner->constraint_adjustment = constraint_adjustment;
+}
+
+static void
+xdg_positioner_set_offset (struct wl_client *client,
+                           struct wl_resource *resource,
+                           int32_t x,
+                           int32_t y)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  positioner->offset_x = x;
+  positioner->offset_y = y;
+}
+
+static void
+xdg_positioner_set_reactive (struct wl_client *client,
+                             struct wl_resource *resource)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  positioner->reactive = TRUE;
+}
+
+static void
+xdg_positioner_set_parent_size (struct wl_client *client,
+                                struct wl_resource *resource,
+                                int32_t parent_width,
+                                int32_t parent_height)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  positioner->parent_width = parent_width;
+  positioner->parent_height = parent_height;
+}
+
+static void
+xdg_positioner_set_parent_configure (struct wl_client *client,
+                                     struct wl_resource *resource,
+                                     guint32 serial)
+{
+  ClaylandXdgPositioner *positioner = wl_resource_get_user_data (resource);
+
+  positioner->parent_configure = serial;
+}
+
+static const struct xdg_positioner_interface clayland_xdg_positioner_interface =
+{
+  xdg_positioner_destroy,
+  xdg_positioner_set_size,
+  xdg_positioner_set_anchor_rect,
+  xdg_positioner_set_anchor,
+  xdg_positioner_set_gravity,
+  xdg_positioner_set_constraint_adjustment,
+  xdg_positioner_set_offset,
+  xdg_positioner_set_reactive,
+  xdg_positioner_set_parent_size,
+  xdg_positioner_set_parent_configure
+};
+
+static void
+xdg_positioner_destroy_cb (struct wl_resource *resource)
+{
+  g_slice_free (ClaylandXdgPositioner, wl_resource_get_user_data (resource));
+}
+
+static void
+xdg_grab_end_cb (ClaylandWindowGrab *window_grab)
+{
+  ClaylandXdgSurface *xdg_surface = window_grab->data;
+
+  xdg_surface->toplevel.grab = NULL;
+
+  if (window_grab->edges)
+    {
+      xdg_surface->toplevel.resize_edges = 0;
+      xdg_toplevel_set_state (xdg_surface, STATE_BIT (RESIZING), FALSE);
+    }
+}
+
+static void
+xdg_grab_resize_cb (ClaylandWindowGrab *window_grab,
+                    int32_t width,
+                    int32_t height)
+{
+  ClaylandXdgSurface *xdg_surface = window_grab->data;
+
+  if (xdg_surface->toplevel.max_width > 0)
+    width = MIN (width, xdg_surface->toplevel.max_width);
+  if (xdg_surface->toplevel.max_height > 0)
+    height = MIN (height, xdg_surface->toplevel.max_height);
+  width = MAX (width, MAX (xdg_surface->toplevel.min_width, 1));
+  height = MAX (height, MAX (xdg_surface->toplevel.min_height, 1));
+
+  if (width == xdg_surface->toplevel.width &&
+      height == xdg_surface->toplevel.height)
+    return;
+
+  /* Only the latest size requested within a frame gets sent */
+  xdg_surface->toplevel.width = width;
+  xdg_surface->toplevel.height = height;
+  xdg_surface_schedule_configure (xdg_surface);
+}
+
+static ClaylandWindowGrab *
+xdg_grab_start (ClaylandXdgSurface *xdg_surface,
+                ClaylandSeat *seat,
+                guint32 serial,
+                guint32 edges,
+                int32_t width,
+                int32_t height)
+{
+  ClaylandWindowGrab *window_grab;
+
+  if (xdg_surface->toplevel.grab || !xdg_surface->mapped)
+    return NULL;
+
+  /* Maximized and fullscreen windows stay where they are */
+  if (xdg_surface->toplevel.current_states &
+      (STATE_BIT (MAXIMIZED) | STATE_BIT (FULLSCREEN)))
+    return NULL;
+
+  window_grab = clayland_window_grab_start (xdg_surface->surface, seat,
+                                            serial, edges, width, height);
+  if (!window_grab)
+    return NULL;
+
+  window_grab->resize = xdg_grab_resize_cb;
+  window_grab->end = xdg_grab_end_cb;
+  window_grab->data = xdg_surface;
+  xdg_surface->toplevel.grab = window_grab;
+
+  return window_grab;
+}
+
+static void
+xdg_popup_dismiss (ClaylandXdgSurface *xdg_surface)
+{
+  ClaylandXdgSurface *child, *tmp;
+
+  /* Popups are dismissed from the top of the chain down */
+  wl_list_for_each_safe (child, tmp, &xdg_surface->popup_list, popup.link)
+    xdg_popup_dismiss (child);
+
+  if (xdg_surface->role != CLAYLAND_XDG_ROLE_POPUP)
+    return;
+
+  clayland_popup_ungrab (&xdg_surface->popup.grab);
+
+  if (xdg_surface->role_resource)
+    xdg_popup_send_popup_done (xdg_surface->role_resource);
+
+  if (xdg_surface->popup.parent)
+    {
+      wl_list_remove (&xdg_surface->popup.link);
+      wl_list_init (&xdg_surface->popup.link);
+      xdg_surface->popup.parent = NULL;
+    }
+
+  if (xdg_surface->surface)
+    clayland_stack_remove_window (xdg_surface->shell->compositor,
+                                  xdg_surface->surface);
+}
+
+static void
+xdg_surface_free_configures (ClaylandXdgSurface *xdg_surface)
+{
+  ClaylandXdgConfigure *configure, *tmp;
+
+  wl_list_for_each_safe (configure, tmp, &xdg_surface->configure_list, link)
+    g_slice_free (ClaylandXdgConfigure, configure);
+  wl_list_init (&xdg_surface->configure_list);
+
+  if (xdg_surface->acked)
+    {
+      g_slice_free (ClaylandXdgConfigure, xdg_surface->acked);
+      xdg_surface->acked = NULL;
+    }
+
+  wl_list_remove (&xdg_surface->schedule_link);
+  wl_list_init (&xdg_surface->schedule_link);
+}
+
+static void
+xdg_surface_unmap (ClaylandXdgSurface *xdg_surface)
+{
+  ClaylandXdgShell *shell = xdg_surface->shell;
+  ClaylandXdgSurface *child, *tmp;
+
+  wl_list_for_each_safe (child, tmp, &xdg_surface->popup_list, popup.link)
+    xdg_popup_dismiss (child);
+
+  if (xdg_surface->role == CLAYLAND_XDG_ROLE_POPUP)
+    clayland_popup_ungrab (&xdg_surface->popup.grab);
+
+  if (xdg_surface->role == CLAYLAND_XDG_ROLE_TOPLEVEL)
+    {
+      if (xdg_surface->toplevel.grab)
+        clayland_window_grab_end (xdg_surface->toplevel.grab);
+
+      if (shell->activated == xdg_surface)
+        shell->activated = NULL;
+
+      xdg_surface->toplevel.states = 0;
+      xdg_surface->toplevel.current_states = 0;
+      xdg_surface->toplevel.width = 0;
+      xdg_surface->toplevel.height = 0;
+    }
+
+  if (xdg_surface->surface)
+    clayland_stack_remove_window (shell->compositor, xdg_surface->surface);
+
+  /* The client has to go through the initial configure again before
+   * it can map the surface */
+  xdg_surface_free_configures (xdg_surface);
+  xdg_surface->configured = FALSE;
+  xdg_surface->mapped = FALSE;
+}
+
+static void
+xdg_surface_map (ClaylandXdgSurface *xdg_surface)
+{
+  clayland_stack_add_window (xdg_surface->shell->compositor,
+                             xdg_surface->surface);
+
+  xdg_surface->mapped = TRUE;
+}
+
+static void
+xdg_toplevel_apply (ClaylandXdgSurface *xdg_surface,
+                    ClaylandXdgConfigure *acked,
+                    gboolean newly_mapped,
+                    float old_width,
+                    float old_height)
+{
+  ClaylandSurface *surface = xdg_surface->surface;
+  ClaylandOutput *output = xdg_surface_get_output (xdg_surface);
+  guint32 fill = STATE_BIT (MAXIMIZED) | STATE_BIT (FULLSCREEN);
+  guint32 old_states = xdg_surface->toplevel.current_states;
+  guint32 states;
+  cairo_rectangle_int_t geometry;
+  float x, y;
+
+  xdg_surface->toplevel.min_width = xdg_surface->toplevel.pending_min_width;
+  xdg_surface->toplevel.min_height = xdg_surface->toplevel.pending_min_height;
+  xdg_surface->toplevel.max_width = xdg_surface->toplevel.pending_max_width;
+  xdg_surface->toplevel.max_height = xdg_surface->toplevel.pending_max_height;
+
+  if (acked)
+    xdg_surface->toplevel.current_states = acked->states;
+  states = xdg_surface->toplevel.current_states;
+
+  xdg_surface_get_geometry (xdg_surface, &geometry);
+  x = surface->x;
+  y = surface->y;
+
+  if (states & STATE_BIT (FULLSCREEN))
+    {
+      if (!(old_states & fill) && !newly_mapped)
+        {
+          xdg_surface->toplevel.saved_x = x;
+          xdg_surface->toplevel.saved_y = y;
+        }
+
+      x = output->x + (output->width - geometry.width) / 2 - geometry.x;
+      y = output->y + (output->height - geometry.height) / 2 - geometry.y;
+    }
+  else if (states & STATE_BIT (MAXIMIZED))
+    {
+      if (!(old_states & fill) && !newly_mapped)
+        {
+          xdg_surface->toplevel.saved_x = x;
+          xdg_surface->toplevel.saved_y = y;
+        }
+
+      x = output->x - geometry.x;
+      y = output->y - geometry.y;
+    }
+  else if (old_states & fill)
+    {
+      x = xdg_surface->toplevel.saved_x;
+      y = xdg_surface->toplevel.saved_y;
+    }
+  else if (newly_mapped)
+    {
+      ClaylandXdgSurface *parent = NULL;
+
+      if (xdg_surface->toplevel.parent_resource)
+        parent =
+          wl_resource_get_user_data (xdg_surface->toplevel.parent_resource);
+
+      /* Dialogs are centered over the window they belong to and
+       * everything else over the output */
+      if (parent && parent->mapped)
+        {
+          cairo_rectangle_int_t parent_geometry;
+          float parent_x, parent_y;
+
+          xdg_surface_get_window_position (parent, &parent_x, &parent_y);
+          xdg_surface_get_geometry (parent, &parent_geometry);
+
+          x = parent_x + (parent_geometry.width - geometry.width) / 2;
+          y = parent_y + (parent_geometry.height - geometry.height) / 2;
+        }
+      else
+        {
+          x = output->x + (output->width - geometry.width) / 2;
+          y = output->y + (output->height - geometry.height) / 2;
+        }
+
+      x = MAX (x, output->x) - geometry.x;
+      y = MAX (y, output->y) - geometry.y;
+    }
+  else if (acked && acked->resize_edges)
+    {
+      float width, height;
+
+      /* Keep the edges opposite to the ones being dragged in place */
+      clayland_surface_get_size (surface, &width, &height);
+
+      if (acked->resize_edges & XDG_TOPLEVEL_RESIZE_EDGE_LEFT)
+        x += old_width - width;
+      if (acked->resize_edges & XDG_TOPLEVEL_RESIZE_EDGE_TOP)
+        y += old_height - height;
+    }
+
+  clayland_surface_set_position (surface, x, y);
+}
+
+static void
+xdg_popup_apply (ClaylandXdgSurface *xdg_surface,
+                 ClaylandXdgConfigure *acked)
+{
+  ClaylandXdgSurface *parent = xdg_surface->popup.parent;
+  cairo_rectangle_int_t geometry;
+  float parent_x, parent_y;
+
+  if (acked)
+    xdg_surface->popup.geometry = acked->popup_geometry;
+
+  if (!parent)
+    return;
+
+  xdg_surface_get_window_position (parent, &parent_x, &parent_y);
+  xdg_surface_get_geometry (xdg_surface, &geometry);
+
+  clayland_surface_set_position (xdg_surface->surface,
+                                 parent_x + xdg_surface->popup.geometry.x -
+                                 geometry.x,
+                                 parent_y + xdg_surface->popup.geometry.y -
+                                 geometry.y);
+}
+
+/* Reactive popups get a new configure when their parent has changed
+ * in a way that places them differently */
+static void
+xdg_popup_update_reactive (ClaylandXdgSurface *xdg_surface)
+{
+  cairo_rectangle_int_t geometry, *last = &xdg_surface->popup.geometry;
+
+  if (!xdg_surface->popup.positioner.reactive || !xdg_surface->mapped)
+    return;
+
+  /* Compared with the last configure sent, even if it hasn't been
+   * acknowledged yet */
+  if (!wl_list_empty (&xdg_surface->configure_list))
+    {
+      ClaylandXdgConfigure *configure =
+        wl_container_of (xdg_surface->configure_list.prev, configure, link);
+
+      last = &configure->popup_geometry;
+    }
+
+  xdg_popup_compute_geometry (xdg_surface, &geometry);
+
+  if (geometry.x != last->x || geometry.y != last->y ||
+      geometry.width != last->width || geometry.height != last->height)
+    xdg_surface_schedule_configure (xdg_surface);
+}
+
+static void
+xdg_surface_commit (ClaylandSurface *surface,
+                    int32_t sx,
+                    int32_t sy)
+{
+  ClaylandXdgSurface *xdg_surface = surface->configure_private;
+  ClaylandXdgSurface *child;
+  ClaylandXdgConfigure *acked;
+  gboolean newly_mapped;
+  float old_width = xdg_surface->width, old_height = xdg_surface->height;
+
+  if (xdg_surface->role == CLAYLAND_XDG_ROLE_NONE)
+    {
+      wl_resource_post_error (xdg_surface->resource,
+                              XDG_SURFACE_ERROR_NOT_CONSTRUCTED,
+                              "xdg_surface has no role");
+      return;
+    }
+
+  if (!xdg_surface->role_resource)
+    return;
+
+  if (surface->pending.newly_attached &&
+      surface->pending.buffer &&
+      !xdg_surface->configured)
+    {
+      wl_resource_post_error (xdg_surface->resource,
+                              XDG_SURFACE_ERROR_UNCONFIGURED_BUFFER,
+                              "buffer attached before the first configure "
+                              "was acknowledged");
+      return;
+    }
+
+  if (xdg_surface->pending_geometry_set)
+    {
+      xdg_surface->geometry = xdg_surface->pending_geometry;
+      xdg_surface->geometry_set = TRUE;
+      xdg_surface->pending_geometry_set = FALSE;
+    }
+
+  /* Attaching a NULL buffer unmaps the surface */
+  if (surface->pending.newly_attached && !surface->pending.buffer)
+    {
+      if (xdg_surface->mapped)
+        xdg_surface_unmap (xdg_surface);
+      return;
+    }
+
+  if (!surface->buffer_ref.buffer)
+    {
+      /* The initial commit without a buffer asks for the first
+       * configure */
+      if (!xdg_surface->configured &&
+          wl_list_empty (&xdg_surface->configure_list))
+        xdg_surface_schedule_configure (xdg_surface);
+      return;
+    }
+
+  if (!xdg_surface->mapped &&
+      xdg_surface->role == CLAYLAND_XDG_ROLE_POPUP &&
+      !xdg_surface->popup.parent)
+    {
+      wl_resource_post_error (xdg_surface->resource,
+                              XDG_WM_BASE_ERROR_INVALID_POPUP_PARENT,
+                              "popup mapped without a parent");
+      return;
+    }
+
+  newly_mapped = !xdg_surface->mapped;
+
+
+  acked = xdg_surface->acked;
+  xdg_surface->acked = NULL;
+
+  /* The size is needed for the default window geometry */
+  clayland_surface_get_size (surface,
+                             &xdg_surface->width, &xdg_surface->height);
+
+  if (xdg_surface->role == CLAYLAND_XDG_ROLE_TOPLEVEL)
+    xdg_toplevel_apply (xdg_surface, acked, newly_mapped,
+                        old_width, old_height);
+  else
+    xdg_popup_apply (xdg_surface, acked);
+
+  /* Stacked once it's in place */
+  if (newly_mapped)
+    xdg_surface_map (xdg_surface);
+
+  wl_list_for_each (child, &xdg_surface->popup_list, popup.link)
+    xdg_popup_update_reactive (child);
+
+  if (acked)
+    g_slice_free (ClaylandXdgConfigure, acked);
+}
+
+static void
+xdg_toplevel_destroy (struct wl_client *client,
+                      struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+toplevel_parent_destroy_cb (struct wl_listener *listener,
+                            void *data)
+{
+  ClaylandXdgSurface *xdg_surface =
+    wl_container_of (listener, xdg_surface, toplevel.parent_destroy_listener);
+
+  xdg_surface->toplevel.parent_resource = NULL;
+}
+
+static void
+xdg_toplevel_set_parent (struct wl_client *client,
+                         struct wl_resource *resource,
+                         struct wl_resource *parent_resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (!xdg_surface)
+    return;
+
+  if (xdg_surface->toplevel.parent_resource)
+    {
+      wl_list_remove (&xdg_surface->toplevel.parent_destroy_listener.link);
+      xdg_surface->toplevel.parent_resource = NULL;
+    }
+
+  if (parent_resource)
+    {
+      xdg_surface->toplevel.parent_resource = parent_resource;
+      xdg_surface->toplevel.parent_destroy_listener.notify =
+        toplevel_parent_destroy_cb;
+      wl_resource_add_destroy_listener
+        (parent_resource, &xdg_surface->toplevel.parent_destroy_listener);
+    }
+}
+
+static void
+xdg_toplevel_set_title (struct wl_client *client,
+                        struct wl_resource *resource,
+                        const char *title)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (!xdg_surface)
+    return;
+
+  g_free (xdg_surface->toplevel.title);
+  xdg_surface->toplevel.title = g_strdup (title);
+}
+
+static void
+xdg_toplevel_set_app_id (struct wl_client *client,
+                         struct wl_resource *resource,
+                         const char *app_id)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (!xdg_surface)
+    return;
+
+  g_free (xdg_surface->toplevel.app_id);
+  xdg_surface->toplevel.app_id = g_strdup (app_id);
+}
+
+static void
+xdg_toplevel_show_window_menu (struct wl_client *client,
+                               struct wl_resource *resource,
+                               struct wl_resource *seat_resource,
+                               guint32 serial,
+                               int32_t x,
+                               int32_t y)
+{
+  /* There is no window menu to show. The capability isn't advertised
+   * so clients shouldn't ask for it. */
+}
+
+static void
+xdg_toplevel_move (struct wl_client *client,
+                   struct wl_resource *resource,
+                   struct wl_resource *seat_resource,
+                   guint32 serial)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  ClaylandSeat *seat = wl_resource_get_user_data (seat_resource);
+
+  if (!xdg_surface || !xdg_surface->surface)
+    return;
+
+  xdg_grab_start (xdg_surface, seat, serial, 0, 0, 0);
+}
+
+static void
+xdg_toplevel_resize (struct wl_client *client,
+                     struct wl_resource *resource,
+                     struct wl_resource *seat_resource,
+                     guint32 serial,
+                     guint32 edges)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  ClaylandSeat *seat = wl_resource_get_user_data (seat_resource);
+  cairo_rectangle_int_t geometry;
+
+  if (!xdg_surface || !xdg_surface->surface)
+    return;
+
+  if (edges == XDG_TOPLEVEL_RESIZE_EDGE_NONE ||
+      edges > XDG_TOPLEVEL_RESIZE_EDGE_BOTTOM_RIGHT ||
+      (edges & 3) == 3 || (edges & 12) == 12)
+    {
+      wl_resource_post_error (resource,
+                              XDG_TOPLEVEL_ERROR_INVALID_RESIZE_EDGE,
+                              "invalid resize edge %u", edges);
+      return;
+    }
+
+  xdg_surface_get_geometry (xdg_surface, &geometry);
+  if (!xdg_grab_start (xdg_surface, seat, serial,
+                       edges, geometry.width, geometry.height))
+    return;
+
+  xdg_surface->toplevel.width = geometry.width;
+  xdg_surface->toplevel.height = geometry.height;
+  xdg_surface->toplevel.resize_edges = edges;
+  xdg_toplevel_set_state (xdg_surface, STATE_BIT (RESIZING), TRUE);
+}
+
+static void
+xdg_toplevel_set_max_size (struct wl_client *client,
+                           struct wl_resource *resource,
+                           int32_t width,
+                           int32_t height)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (!xdg_surface)
+    return;
+
+  if (width < 0 || height < 0)
+    {
+      wl_resource_post_error (resource,
+                              XDG_TOPLEVEL_ERROR_INVALID_SIZE,
+                              "invalid maximum size");
+      return;
+    }
+
+  xdg_surface->toplevel.pending_max_width = width;
+  xdg_surface->toplevel.pending_max_height = height;
+}
+
+static void
+xdg_toplevel_set_min_size (struct wl_client *client,
+                           struct wl_resource *resource,
+                           int32_t width,
+                           int32_t height)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (!xdg_surface)
+    return;
+
+  if (width < 0 || height < 0)
+    {
+      wl_resource_post_error (resource,
+                              XDG_TOPLEVEL_ERROR_INVALID_SIZE,
+                              "invalid minimum size");
+      return;
+    }
+
+  xdg_surface->toplevel.pending_min_width = width;
+  xdg_surface->toplevel.pending_min_height = height;
+}
+
+static void
+xdg_toplevel_set_fill_state (ClaylandXdgSurface *xdg_surface,
+                             guint32 bit,
+                             gboolean enabled)
+{
+  guint32 fill = STATE_BIT (MAXIMIZED) | STATE_BIT (FULLSCREEN);
+  guint32 old_states = xdg_surface->toplevel.states;
+  ClaylandOutput *output = xdg_surface_get_output (xdg_surface);
+
+  if (enabled && !(old_states & fill) && xdg_surface->mapped)
+    {
+      cairo_rectangle_int_t geometry;
+
+      xdg_surface_get_geometry (xdg_surface, &geometry);
+      xdg_surface->toplevel.saved_width = geometry.width;
+      xdg_surface->toplevel.saved_height = geometry.height;
+    }
+
+  xdg_toplevel_set_state (xdg_surface, bit, enabled);
+
+  /* The client gets a configure in reply even if it asked for the
+   * state it already has */
+  xdg_surface_schedule_configure (xdg_surface);
+
+  if (xdg_surface->toplevel.states == old_states)
+    return;
+
+  if (xdg_surface->toplevel.states & fill)
+    {
+      xdg_surface->toplevel.width = output->width;
+      xdg_surface->toplevel.height = output->height;
+    }
+  else
+    {
+      /* Zero lets the client pick the size if it was never mapped
+       * in the normal state */
+      xdg_surface->toplevel.width = xdg_surface->toplevel.saved_width;
+      xdg_surface->toplevel.height = xdg_surface->toplevel.saved_height;
+    }
+}
+
+static void
+xdg_toplevel_set_maximized (struct wl_client *client,
+                            struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (xdg_surface)
+    xdg_toplevel_set_fill_state (xdg_surface, STATE_BIT (MAXIMIZED), TRUE);
+}
+
+static void
+xdg_toplevel_unset_maximized (struct wl_client *client,
+                              struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (xdg_surface)
+    xdg_toplevel_set_fill_state (xdg_surface, STATE_BIT (MAXIMIZED), FALSE);
+}
+
+static void
+xdg_toplevel_set_fullscreen (struct wl_client *client,
+                             struct wl_resource *resource,
+                             struct wl_resource *output_resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (xdg_surface)
+    xdg_toplevel_set_fill_state (xdg_surface, STATE_BIT (FULLSCREEN), TRUE);
+}
+
+static void
+xdg_toplevel_unset_fullscreen (struct wl_client *client,
+                               struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (xdg_surface)
+    xdg_toplevel_set_fill_state (xdg_surface, STATE_BIT (FULLSCREEN), FALSE);
+}
+
+static void
+xdg_toplevel_set_minimized (struct wl_client *client,
+                            struct wl_resource *resource)
+{
+  /* There's nothing that could bring a minimized window back so the
+   * request is ignored */
+}
+
+static const struct xdg_toplevel_interface clayland_xdg_toplevel_interface =
+{
+  xdg_toplevel_destroy,
+  xdg_toplevel_set_parent,
+  xdg_toplevel_set_title,
+  xdg_toplevel_set_app_id,
+  xdg_toplevel_show_window_menu,
+  xdg_toplevel_move,
+  xdg_toplevel_resize,
+  xdg_toplevel_set_max_size,
+  xdg_toplevel_set_min_size,
+  xdg_toplevel_set_maximized,
+  xdg_toplevel_unset_maximized,
+  xdg_toplevel_set_fullscreen,
+  xdg_toplevel_unset_fullscreen,
+  xdg_toplevel_set_minimized
+};
+
+static void
+xdg_toplevel_destroy_cb (struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  /* The xdg_surface may already have been destroyed if the client went
+   * away */
+  if (!xdg_surface)
+    return;
+
+  xdg_surface_unmap (xdg_surface);
+  xdg_surface->role_resource = NULL;
+
+  if (xdg_surface->toplevel.parent_resource)
+    {
+      wl_list_remove (&xdg_surface->toplevel.parent_destroy_listener.link);
+      xdg_surface->toplevel.parent_resource = NULL;
+    }
+
+  g_free (xdg_surface->toplevel.title);
+  xdg_surface->toplevel.title = NULL;
+  g_free (xdg_surface->toplevel.app_id);
+  xdg_surface->toplevel.app_id = NULL;
+}
+
+static void
+xdg_popup_destroy (struct wl_client *client,
+                   struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (xdg_surface && !wl_list_empty (&xdg_surface->popup_list))
+    {
+      wl_resource_post_error (resource,
+                              XDG_WM_BASE_ERROR_NOT_THE_TOPMOST_POPUP,
+                              "destroyed popup is not the topmost popup");
+      return;
+    }
+
+  wl_resource_destroy (resource);
+}
+
+static void
+xdg_popup_grab_dismiss (ClaylandPopup *popup)
+{
+  ClaylandXdgSurface *xdg_surface =
+    wl_container_of (popup, xdg_surface, popup.grab);
+
+  xdg_popup_dismiss (xdg_surface);
+}
+
+static void
+xdg_popup_grab (struct wl_client *client,
+                struct wl_resource *resource,
+                struct wl_resource *seat_resource,
+                guint32 serial)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  ClaylandSeat *seat = wl_resource_get_user_data (seat_resource);
+
+  if (!xdg_surface || !xdg_surface->surface)
+    return;
+
+  if (xdg_surface->mapped)
+    {
+      wl_resource_post_error (resource,
+                              XDG_POPUP_ERROR_INVALID_GRAB,
+                              "grab requested on a mapped popup");
+      return;
+    }
+
+  if (!clayland_popup_grab (&xdg_surface->popup.grab, seat, serial))
+    xdg_popup_dismiss (xdg_surface);
+}
+
+static void
+xdg_popup_reposition (struct wl_client *client,
+                      struct wl_resource *resource,
+                      struct wl_resource *positioner_resource,
+                      guint32 token)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  ClaylandXdgPositioner *positioner =
+    wl_resource_get_user_data (positioner_resource);
+
+  if (!xdg_surface)
+    return;
+
+  xdg_surface->popup.positioner = *positioner;
+
+  xdg_popup_send_repositioned (resource, token);
+  xdg_surface_schedule_configure (xdg_surface);
+}
+
+static const struct xdg_popup_interface clayland_xdg_popup_interface =
+{
+  xdg_popup_destroy,
+  xdg_popup_grab,
+  xdg_popup_reposition
+};
+
+static void
+xdg_popup_destroy_cb (struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (!xdg_surface)
+    return;
+
+  xdg_surface->role_resource = NULL;
+
+  if (xdg_surface->popup.parent)
+    {
+      wl_list_remove (&xdg_surface->popup.link);
+      wl_list_init (&xdg_surface->popup.link);
+      xdg_surface->popup.parent = NULL;
+    }
+
+  xdg_surface_unmap (xdg_surface);
+}
+
+static void
+xdg_surface_destroy (struct wl_client *client,
+                     struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (xdg_surface->role_resource)
+    {
+      wl_resource_post_error (resource,
+                              XDG_SURFACE_ERROR_DEFUNCT_ROLE_OBJECT,
+                              "xdg_surface destroyed before its role object");
+      return;
+    }
+
+  wl_resource_destroy (resource);
+}
+
+static gboolean
+xdg_surface_set_role (ClaylandXdgSurface *xdg_surface,
+                      ClaylandXdgRole role)
+{
+  if (xdg_surface->role != CLAYLAND_XDG_ROLE_NONE)
+    {
+      wl_resource_post_error (xdg_surface->resource,
+                              XDG_SURFACE_ERROR_ALREADY_CONSTRUCTED,
+                              "xdg_surface already has a role");
+      return FALSE;
+    }
+
+  xdg_surface->role = role;
+
+  return TRUE;
+}
+
+static void
+xdg_surface_get_toplevel (struct wl_client *client,
+                          struct wl_resource *resource,
+                          guint32 id)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  int version = wl_resource_get_version (resource);
+
+  if (!xdg_surface_set_role (xdg_surface, CLAYLAND_XDG_ROLE_TOPLEVEL))
+    return;
+
+  xdg_surface->role_resource =
+    wl_resource_create (client, &xdg_toplevel_interface, version, id);
+  wl_resource_set_implementation (xdg_surface->role_resource,
+                                  &clayland_xdg_toplevel_interface,
+                                  xdg_surface,
+                                  xdg_toplevel_destroy_cb);
+
+  if (version >= XDG_TOPLEVEL_WM_CAPABILITIES_SINCE_VERSION)
+    {
+      struct wl_array capabilities;
+      guint32 *p;
+
+      wl_array_init (&capabilities);
+      p = wl_array_add (&capabilities, sizeof (guint32));
+      *p = XDG_TOPLEVEL_WM_CAPABILITIES_MAXIMIZE;
+      p = wl_array_add (&capabilities, sizeof (guint32));
+      *p = XDG_TOPLEVEL_WM_CAPABILITIES_FULLSCREEN;
+
+      xdg_toplevel_send_wm_capabilities (xdg_surface->role_resource,
+                                         &capabilities);
+      wl_array_release (&capabilities);
+    }
+}
+
+static void
+xdg_surface_get_popup (struct wl_client *client,
+                       struct wl_resource *resource,
+                       guint32 id,
+                       struct wl_resource *parent_resource,
+                       struct wl_resource *positioner_resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  ClaylandXdgPositioner *positioner =
+    wl_resource_get_user_data (positioner_resource);
+  ClaylandXdgSurface *parent = NULL;
+
+  if (positioner->width <= 0 || !positioner->anchor_rect_set)
+    {
+      wl_resource_post_error (resource,
+                              XDG_WM_BASE_ERROR_INVALID_POSITIONER,
+                              "incomplete xdg_positioner");
+      return;
+    }
+
+  if (parent_resource)
+    parent = wl_resource_get_user_data (parent_resource);
+
+  if (!xdg_surface_set_role (xdg_surface, CLAYLAND_XDG_ROLE_POPUP))
+    return;
+
+  /* A popup without a parent is meant to get one through another
+   * protocol before it is mapped. There is none so mapping it is an
+   * error, which xdg_surface_commit reports. */
+  xdg_surface->popup.positioner = *positioner;
+  xdg_surface->popup.parent = parent;
+  if (parent)
+    wl_list_insert (&parent->popup_list, &xdg_surface->popup.link);
+  clayland_popup_init (&xdg_surface->popup.grab,
+                       xdg_surface->surface,
+                       xdg_popup_grab_dismiss);
+
+  xdg_surface->role_resource =
+    wl_resource_create (client, &xdg_popup_interface,
+                        wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (xdg_surface->role_resource,
+                                  &clayland_xdg_popup_interface,
+                                  xdg_surface,
+                                  xdg_popup_destroy_cb);
+}
+
+static void
+xdg_surface_set_window_geometry (struct wl_client *client,
+                                 struct wl_resource *resource,
+                                 int32_t x,
+                                 int32_t y,
+                                 int32_t width,
+                                 int32_t height)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (width <= 0 || height <= 0)
+    {
+      wl_resource_post_error (resource,
+                              XDG_SURFACE_ERROR_INVALID_SIZE,
+                              "invalid window geometry size");
+      return;
+    }
+
+  xdg_surface->pending_geometry.x = x;
+  xdg_surface->pending_geometry.y = y;
+  xdg_surface->pending_geometry.width = width;
+  xdg_surface->pending_geometry.height = height;
+  xdg_surface->pending_geometry_set = TRUE;
+}
+
+static void
+xdg_surface_ack_configure (struct wl_client *client,
+                           struct wl_resource *resource,
+                           guint32 serial)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  ClaylandXdgConfigure *configure, *tmp;
+  gboolean found = FALSE;
+
+  wl_list_for_each (configure, &xdg_surface->configure_list, link)
+    if (configure->serial == serial)
+      {
+        found = TRUE;
+        break;
+      }
+
+  if (!found)
+    {
+      wl_resource_post_error (resource,
+                              XDG_SURFACE_ERROR_INVALID_SERIAL,
+                              "wrong configure serial %u", serial);
+      return;
+    }
+
+  /* Acknowledging a configure implicitly acknowledges all of the ones
+   * sent before it. Only the newest one gets applied. */
+  wl_list_for_each_safe (configure, tmp, &xdg_surface->configure_list, link)
+    {
+      wl_list_remove (&configure->link);
+
+      if (configure->serial == serial)
+        {
+          if (xdg_surface->acked)
+            g_slice_free (ClaylandXdgConfigure, xdg_surface->acked);
+          xdg_surface->acked = configure;
+          break;
+        }
+
+      g_slice_free (ClaylandXdgConfigure, configure);
+    }
+
+  xdg_surface->configured = TRUE;
+}
+
+static const struct xdg_surface_interface clayland_xdg_surface_interface =
+{
+  xdg_surface_destroy,
+  xdg_surface_get_toplevel,
+  xdg_surface_get_popup,
+  xdg_surface_set_window_geometry,
+  xdg_surface_ack_configure
+};
+
+static void
+xdg_surface_detach (ClaylandXdgSurface *xdg_surface)
+{
+  ClaylandSurface *surface = xdg_surface->surface;
+
+  if (!surface)
+    return;
+
+  wl_list_remove (&xdg_surface->surface_destroy_listener.link);
+  surface->configure = NULL;
+  surface->configure_private = NULL;
+  surface->ping = NULL;
+  xdg_surface->surface = NULL;
+}
+
+static void
+xdg_surface_destroy_cb (struct wl_resource *resource)
+{
+  ClaylandXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  struct wl_resource *role_resource = xdg_surface->role_resource;
+  ClaylandXdgSurface *child, *tmp;
+
+  /* The role object can only outlive the xdg_surface when the client
+   * is being torn down */
+  if (role_resource)
+    {
+      if (xdg_surface->role == CLAYLAND_XDG_ROLE_TOPLEVEL)
+        xdg_toplevel_destroy_cb (role_resource);
+      else
+        xdg_popup_destroy_cb (role_resource);
+      wl_resource_set_user_data (role_resource, NULL);
+    }
+
+  wl_list_for_each_safe (child, tmp, &xdg_surface->popup_list, popup.link)
+    xdg_popup_dismiss (child);
+
+  if (xdg_surface->shell->activated == xdg_surface)
+    xdg_surface->shell->activated = NULL;
+
+  xdg_surface_free_configures (xdg_surface);
+  xdg_surface_detach (xdg_surface);
+
+  g_slice_free (ClaylandXdgSurface, xdg_surface);
+}
+
+static void
+xdg_surface_handle_surface_destroy (struct wl_listener *listener,
+                                    void *data)
+{
+  ClaylandXdgSurface *xdg_surface =
+    wl_container_of (listener, xdg_surface, surface_destroy_listener);
+
+  if (xdg_surface->role == CLAYLAND_XDG_ROLE_TOPLEVEL &&
+      xdg_surface->toplevel.grab)
+    clayland_window_grab_end (xdg_surface->toplevel.grab);
+  else if (xdg_surface->role == CLAYLAND_XDG_ROLE_POPUP)
+    clayland_popup_ungrab (&xdg_surface->popup.grab);
+
+  /* The actor is destroyed along with the surface */
+  xdg_surface_detach (xdg_surface);
+}
+
+static void
+xdg_wm_base_destroy (struct wl_client *client,
+                     struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+xdg_wm_base_create_positioner (struct wl_client *client,
+                               struct wl_resource *resource,
+                               guint32 id)
+{
+  ClaylandXdgPositioner *positioner = g_slice_new0 (ClaylandXdgPositioner);
+  struct wl_resource *positioner_resource;
+
+  positioner_resource =
+    wl_resource_create (client, &xdg_positioner_interface,
+                        wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (positioner_resource,
+                                  &clayland_xdg_positioner_interface,
+                                  positioner,
+                                  xdg_positioner_destroy_cb);
+}
+
+/* The client may have several xdg_wm_base objects. Any of them will
+   do for the ping. */
+static void
+xdg_surface_ping (ClaylandSurface *surface,
+                  guint32 serial)
+{
+  ClaylandXdgSurface *xdg_surface = surface->configure_private;
+  struct wl_resource *resource =
+    wl_resource_find_for_client (&xdg_surface->shell->resource_list,
+                                 wl_resource_get_client (surface->resource));
+
+  if (resource)
+    xdg_wm_base_send_ping (resource, serial);
+}
+
+static void
+xdg_wm_base_get_xdg_surface (struct wl_client *client,
+                             struct wl_resource *resource,
+                             guint32 id,
+                             struct wl_resource *surface_resource)
+{
+  ClaylandXdgShell *shell = wl_resource_get_user_data (resource);
+  ClaylandSurface *surface = wl_resource_get_user_data (surface_resource);
+  ClaylandXdgSurface *xdg_surface;
+
+  if (surface->configure || surface->shell_surface)
+    {
+      wl_resource_post_error (resource,
+                              XDG_WM_BASE_ERROR_ROLE,
+                              "surface already has a role");
+      return;
+    }
+
+  if (surface->buffer_ref.buffer || surface->pending.buffer)
+    {
+      wl_resource_post_error (resource,
+                              XDG_WM_BASE_ERROR_INVALID_SURFACE_STATE,
+                              "surface already has a buffer attached");
+      return;
+    }
+
+  xdg_surface = g_slice_new0 (ClaylandXdgSurface);
+  xdg_surface->shell = shell;
+  xdg_surface->surface = surface;
+  wl_list_init (&xdg_surface->configure_list);
+  wl_list_init (&xdg_surface->schedule_link);
+  wl_list_init (&xdg_surface->popup_list);
+  wl_list_init (&xdg_surface->popup.link);
+
+  xdg_surface->surface_destroy_listener.notify =
+    xdg_surface_handle_surface_destroy;
+  wl_resource_add_destroy_listener (surface->resource,
+                                    &xdg_surface->surface_destroy_listener);
+
+  surface->configure = xdg_surface_commit;
+  surface->configure_private = xdg_surface;
+  surface->ping = xdg_surface_ping;
+
+  xdg_surface->resource =
+    wl_resource_create (client, &xdg_surface_interface,
+                        wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (xdg_surface->resource,
+                                  &clayland_xdg_surface_interface,
+                                  xdg_surface,
+                                  xdg_surface_destroy_cb);
+}
+
+static void
+xdg_wm_base_pong (struct wl_client *client,
+                  struct wl_resource *resource,
+                  guint32 serial)
+{
+  ClaylandXdgShell *shell = wl_resource_get_user_data (resource);
+
+  clayland_compositor_client_pong (shell->compositor, client, serial);
+}
+
+static const struct xdg_wm_base_interface clayland_xdg_wm_base_interface =
+{
+  xdg_wm_base_destroy,
+  xdg_wm_base_create_positioner,
+  xdg_wm_base_get_xdg_surface,
+  xdg_wm_base_pong
+};
+
+static void
+unbind_xdg_wm_base (struct wl_resource *resource)
+{
+  wl_list_remove (wl_resource_get_link (resource));
+}
+
+static void
+bind_xdg_wm_base (struct wl_client *client,
+                  void *data,
+                  guint32 version,
+                  guint32 id)
+{
+  ClaylandXdgShell *shell = data;
+  struct wl_resource *resource;
+
+  resource = wl_resource_create (client, &xdg_wm_base_interface,
+                                 MIN (version, XDG_WM_BASE_VERSION), id);
+  wl_resource_set_implementation (resource,
+                                  &clayland_xdg_wm_base_interface,
+                                  shell,
+                                  unbind_xdg_wm_base);
+  wl_list_insert (&shell->resource_list, wl_resource_get_link (resource));
+}
+
+/* Maximized and fullscreen toplevels on an output that changed mode
+   are asked to take its new size. They move to fit it once they've
+   acknowledged that. */
+static void
+output_changed_cb (struct wl_listener *listener,
+                   void *data)
+{
+  ClaylandXdgShell *shell =
+    wl_container_of (listener, shell, output_changed_listener);
+  ClaylandOutput *output = data;
+  guint32 fill = STATE_BIT (MAXIMIZED) | STATE_BIT (FULLSCREEN);
+  ClaylandSurface *surface;
+
+  wl_list_for_each (surface, &shell->compositor->stack, stack_link)
+    {
+      ClaylandXdgSurface *xdg_surface = xdg_surface_from_surface (surface);
+
+      if (!xdg_surface ||
+          xdg_surface->role != CLAYLAND_XDG_ROLE_TOPLEVEL ||
+          !(xdg_surface->toplevel.states & fill) ||
+          xdg_surface_get_output (xdg_surface) != output)
+        continue;
+
+      xdg_surface->toplevel.width = output->width;
+      xdg_surface->toplevel.height = output->height;
+      xdg_surface_schedule_configure (xdg_surface);
+    }
+
+  xdg_shell_update_suspended (shell);
+}
+
+ClaylandXdgShell *
+clayland_xdg_shell_init (ClaylandCompositor *compositor)
+{
+  ClaylandXdgShell *shell = g_slice_new0 (ClaylandXdgShell);
+
+  shell->compositor = compositor;
+  wl_list_init (&shell->configure_list);
+  wl_list_init (&shell->resource_list);
+
+  shell->configure_timer =
+    wl_event_loop_add_timer (compositor->wayland_loop,
+                             configure_timer_cb,
+                             shell);
+
+  shell->frame_listener.notify = frame_cb;
+  wl_signal_add (&compositor->frame_signal, &shell->frame_listener);
+
+  shell->keyboard_focus_listener.notify = keyboard_focus_cb;
+  wl_signal_add (&compositor->seat->keyboard.focus_signal,
+                 &shell->keyboard_focus_listener);
+
+  shell->output_changed_listener.notify = output_changed_cb;
+  wl_signal_add (&compositor->output_changed_signal,
+                 &shell->output_changed_listener);
+
+  shell->global = wl_global_create (compositor->wayland_display,
+                                    &xdg_wm_base_interface,
+                                    XDG_WM_BASE_VERSION,
+                                    shell, bind_xdg_wm_base);
+  if (shell->global == NULL)
+    g_error ("Failed to register a global xdg_wm_base object");
+
+  return shell;
+}
+
+void
+clayland_xdg_shell_free (ClaylandXdgShell *shell)
+{
+  wl_global_destroy (shell->global);
+  wl_list_remove (&shell->frame_listener.link);
+  wl_list_remove (&shell->keyboard_focus_listener.link);
+  wl_list_remove (&shell->output_changed_listener.link);
+  wl_event_source_remove (shell->configure_timer);
+
+  g_slice_free (ClaylandXdgShell, shell);
+}
@@ -0,0 +1,39 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_XDG_SHELL_H__
+#define __CLAYLAND_XDG_SHELL_H__
+
+#include <wayland-server.h>
+#include <glib.h>
+
+#include "clayland-compositor.h"
+
+typedef struct _ClaylandXdgShell ClaylandXdgShell;
+
+/* Registers the xdg_wm_base global */
+ClaylandXdgShell *
+clayland_xdg_shell_init (ClaylandCompositor *compositor);
+
+void
+clayland_xdg_shell_free (ClaylandXdgShell *shell);
+
+#endif /* __CLAYLAND_XDG_SHELL_H__ */
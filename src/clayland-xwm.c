@@ -0,0 +1,1066 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <clutter/clutter.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "clayland-xwm.h"
+#include "clayland-seat.h"
+#include "clayland-stack.h"
+
+/* Values of the WM_STATE property from the ICCCM */
+#define ICCCM_WITHDRAWN_STATE 0
+#define ICCCM_NORMAL_STATE 1
+
+typedef enum
+{
+  ATOM_WM_PROTOCOLS,
+  ATOM_WM_TAKE_FOCUS,
+  ATOM_WM_STATE,
+  ATOM_UTF8_STRING,
+  ATOM_NET_WM_NAME,
+  ATOM_NET_SUPPORTING_WM_CHECK,
+  ATOM_NET_ACTIVE_WINDOW,
+
+  N_ATOMS
+} ClaylandXwmAtom;
+
+static const char * const atom_names[N_ATOMS] =
+  {
+    "WM_PROTOCOLS",
+    "WM_TAKE_FOCUS",
+    "WM_STATE",
+    "UTF8_STRING",
+    "_NET_WM_NAME",
+    "_NET_SUPPORTING_WM_CHECK",
+    "_NET_ACTIVE_WINDOW"
+  };
+
+typedef struct _ClaylandXwmRequest ClaylandXwmRequest;
+
+typedef void (* ClaylandXwmReplyFunc) (ClaylandXwm *xwm,
+                                       void *reply,
+                                       ClaylandXwmRequest *request);
+
+/* A request whose reply hasn't been read yet. The replies come back in
+ * the order the requests were made so these are kept in a queue. */
+struct _ClaylandXwmRequest
+{
+  unsigned int sequence;
+  ClaylandXwmReplyFunc func;
+
+  /* The window is looked up again when the reply arrives because it
+   * may have been destroyed in the meantime */
+  xcb_window_t window;
+  guint32 arg;
+};
+
+typedef struct
+{
+  ClaylandXwm *xwm;
+  xcb_window_t id;
+
+  int x, y;
+  int width, height;
+  gboolean override_redirect;
+  gboolean mapped;
+
+  ClaylandSurface *surface;
+  struct wl_listener surface_destroy_listener;
+
+  /* Properties. Transient windows are kept above the window they are
+   * transient for and are placed over it when they are first mapped. */
+  xcb_window_t transient_for;
+  gboolean take_focus;
+
+  /* Set while the window is being raised, in case the transient_for
+   * properties make a loop */
+  gboolean raising;
+} ClaylandXwmWindow;
+
+struct _ClaylandXwm
+{
+  ClaylandCompositor *compositor;
+
+  /* xcb_connect_to_fd waits for the server to answer the connection
+   * setup so it runs in connect_thread. conn stays NULL until it has
+   * finished, which connect_source is told about through
+   * connect_pipe. */
+  int fd;
+  GThread *connect_thread;
+  int connect_pipe[2];
+  struct wl_event_source *connect_source;
+
+  xcb_connection_t *conn;
+  xcb_screen_t *screen;
+  xcb_window_t wm_window;
+  struct wl_event_source *source;
+
+  xcb_atom_t atoms[N_ATOMS];
+  int atoms_pending;
+  /* Events received before all of the atoms are known */
+  GQueue held_events;
+
+  GQueue requests;
+
+  /* Map from X window ID to ClaylandXwmWindow */
+  GHashTable *windows;
+
+  xcb_window_t focus;
+  struct wl_listener keyboard_focus_listener;
+};
+
+static void xwm_surface_commit (ClaylandSurface *surface,
+                                int32_t sx,
+                                int32_t sy);
+
+static void
+xwm_queue_request (ClaylandXwm *xwm,
+                   unsigned int sequence,
+                   ClaylandXwmReplyFunc func,
+                   xcb_window_t window,
+                   guint32 arg)
+{
+  ClaylandXwmRequest *request = g_slice_new (ClaylandXwmRequest);
+
+  request->sequence = sequence;
+  request->func = func;
+  request->window = window;
+  request->arg = arg;
+
+  g_queue_push_tail (&xwm->requests, request);
+}
+
+static void
+xwm_dispatch_replies (ClaylandXwm *xwm)
+{
+  ClaylandXwmRequest *request;
+
+  while ((request = g_queue_peek_head (&xwm->requests)))
+    {
+      void *reply = NULL;
+      xcb_generic_error_t *error = NULL;
+
+      /* This never reads from the connection so it doesn't block */
+      if (!xcb_poll_for_reply (xwm->conn, request->sequence,
+                               &reply, &error))
+        break;
+
+      g_queue_pop_head (&xwm->requests);
+
+      /* Errors are expected when the window went away before the
+       * request got to the server */
+      if (reply)
+        request->func (xwm, reply, request);
+
+      free (reply);
+      free (error);
+      g_slice_free (ClaylandXwmRequest, request);
+    }
+}
+
+static ClaylandXwmWindow *
+xwm_lookup_window (ClaylandXwm *xwm,
+                   xcb_window_t id)
+{
+  return g_hash_table_lookup (xwm->windows, GUINT_TO_POINTER (id));
+}
+
+static ClaylandXwmWindow *
+xwm_ensure_window (ClaylandXwm *xwm,
+                   xcb_window_t id)
+{
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, id);
+
+  if (window)
+    return window;
+
+  window = g_slice_new0 (ClaylandXwmWindow);
+  window->xwm = xwm;
+  window->id = id;
+
+  g_hash_table_insert (xwm->windows, GUINT_TO_POINTER (id), window);
+
+  return window;
+}
+
+static void
+xwm_window_detach_surface (ClaylandXwmWindow *window)
+{
+  ClaylandSurface *surface = window->surface;
+
+  if (!surface)
+    return;
+
+  wl_list_remove (&window->surface_destroy_listener.link);
+  surface->configure = NULL;
+  surface->configure_private = NULL;
+  window->surface = NULL;
+}
+
+static void
+xwm_window_free (ClaylandXwmWindow *window)
+{
+  ClaylandXwm *xwm = window->xwm;
+
+  if (window->surface)
+    clayland_stack_remove_window (xwm->compositor, window->surface);
+
+  xwm_window_detach_surface (window);
+
+  if (xwm->focus == window->id)
+    xwm->focus = XCB_WINDOW_NONE;
+
+  g_slice_free (ClaylandXwmWindow, window);
+}
+
+/* Puts the surface's actor where the X window is and shows it if the
+ * window is mapped and there is something to show */
+static void
+xwm_window_update_actor (ClaylandXwmWindow *window)
+{
+  ClaylandCompositor *compositor = window->xwm->compositor;
+  ClaylandSurface *surface = window->surface;
+
+  if (!surface || !surface->actor)
+    return;
+
+  clayland_surface_set_position (surface, window->x, window->y);
+
+  if (window->mapped && surface->buffer_ref.buffer)
+    {
+      if (wl_list_empty (&surface->stack_link))
+        clayland_stack_add_window (compositor, surface);
+    }
+  else if (!wl_list_empty (&surface->stack_link))
+    clayland_stack_remove_window (compositor, surface);
+}
+
+static void
+xwm_surface_commit (ClaylandSurface *surface,
+                    int32_t sx,
+                    int32_t sy)
+{
+  xwm_window_update_actor (surface->configure_private);
+}
+
+static void
+xwm_handle_surface_destroy (struct wl_listener *listener,
+                            void *data)
+{
+  ClaylandXwmWindow *window =
+    wl_container_of (listener, window, surface_destroy_listener);
+
+  /* The actor is destroyed along with the surface */
+  xwm_window_detach_surface (window);
+}
+
+static void
+xwm_set_wm_state (ClaylandXwm *xwm,
+                  xcb_window_t window,
+                  guint32 state)
+{
+  guint32 property[2] = { state, XCB_WINDOW_NONE };
+
+  xcb_change_property (xwm->conn,
+                       XCB_PROP_MODE_REPLACE,
+                       window,
+                       xwm->atoms[ATOM_WM_STATE],
+                       xwm->atoms[ATOM_WM_STATE],
+                       32, /* format */
+                       G_N_ELEMENTS (property), property);
+}
+
+static void
+property_reply_cb (ClaylandXwm *xwm,
+                   void *data,
+                   ClaylandXwmRequest *request)
+{
+  xcb_get_property_reply_t *reply = data;
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, request->window);
+  xcb_atom_t atom = request->arg;
+  const char *value;
+  int length;
+
+  if (!window)
+    return;
+
+  /* A deleted property has no value */
+  value = xcb_get_property_value (reply);
+  length = xcb_get_property_value_length (reply);
+
+  if (atom == XCB_ATOM_WM_TRANSIENT_FOR)
+    {
+      if (reply->format == 32 && length >= 4)
+        window->transient_for = *(const xcb_window_t *) value;
+      else
+        window->transient_for = XCB_WINDOW_NONE;
+    }
+  else if (atom == xwm->atoms[ATOM_WM_PROTOCOLS])
+    {
+      const xcb_atom_t *protocols = (const xcb_atom_t *) value;
+      int i;
+
+      window->take_focus = FALSE;
+
+      if (reply->format != 32)
+        return;
+
+      for (i = 0; i < length / 4; i++)
+        if (protocols[i] == xwm->atoms[ATOM_WM_TAKE_FOCUS])
+          window->take_focus = TRUE;
+    }
+}
+
+static gboolean
+xwm_is_interesting_property (ClaylandXwm *xwm,
+                             xcb_atom_t atom)
+{
+  return (atom == XCB_ATOM_WM_TRANSIENT_FOR ||
+          atom == xwm->atoms[ATOM_WM_PROTOCOLS]);
+}
+
+static void
+xwm_fetch_property (ClaylandXwm *xwm,
+                    xcb_window_t window,
+                    xcb_atom_t atom)
+{
+  xcb_get_property_cookie_t cookie;
+
+  cookie = xcb_get_property (xwm->conn,
+                             0, /* delete */
+                             window,
+                             atom,
+                             XCB_ATOM_ANY,
+                             0, /* offset */
+                             2048); /* length in 32-bit units */
+
+  xwm_queue_request (xwm, cookie.sequence, property_reply_cb, window, atom);
+}
+
+static void
+xwm_window_fetch_properties (ClaylandXwmWindow *window)
+{
+  ClaylandXwm *xwm = window->xwm;
+
+  xwm_fetch_property (xwm, window->id, XCB_ATOM_WM_TRANSIENT_FOR);
+  xwm_fetch_property (xwm, window->id, xwm->atoms[ATOM_WM_PROTOCOLS]);
+}
+
+static void
+geometry_reply_cb (ClaylandXwm *xwm,
+                   void *data,
+                   ClaylandXwmRequest *request)
+{
+  xcb_get_geometry_reply_t *reply = data;
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, request->window);
+
+  if (!window)
+    return;
+
+  window->x = reply->x;
+  window->y = reply->y;
+  window->width = reply->width;
+  window->height = reply->height;
+
+  xwm_window_update_actor (window);
+}
+
+static void
+attributes_reply_cb (ClaylandXwm *xwm,
+                     void *data,
+                     ClaylandXwmRequest *request)
+{
+  xcb_get_window_attributes_reply_t *reply = data;
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, request->window);
+
+  if (!window)
+    return;
+
+  window->override_redirect = reply->override_redirect;
+  window->mapped = reply->map_state == XCB_MAP_STATE_VIEWABLE;
+
+  if (window->mapped)
+    xwm_window_fetch_properties (window);
+
+  xwm_window_update_actor (window);
+}
+
+/* Picks up the windows that were created before we became the window
+ * manager */
+static void
+query_tree_reply_cb (ClaylandXwm *xwm,
+                     void *data,
+                     ClaylandXwmRequest *request)
+{
+  xcb_query_tree_reply_t *reply = data;
+  xcb_window_t *children = xcb_query_tree_children (reply);
+  int i, n_children = xcb_query_tree_children_length (reply);
+
+  for (i = 0; i < n_children; i++)
+    {
+      xcb_get_geometry_cookie_t geometry_cookie;
+      xcb_get_window_attributes_cookie_t attributes_cookie;
+
+      if (children[i] == xwm->wm_window)
+        continue;
+
+      xwm_ensure_window (xwm, children[i]);
+
+      geometry_cookie = xcb_get_geometry (xwm->conn, children[i]);
+      xwm_queue_request (xwm, geometry_cookie.sequence,
+                         geometry_reply_cb, children[i], 0);
+
+      attributes_cookie = xcb_get_window_attributes (xwm->conn, children[i]);
+      xwm_queue_request (xwm, attributes_cookie.sequence,
+                         attributes_reply_cb, children[i], 0);
+    }
+}
+
+static void
+xwm_handle_create_notify (ClaylandXwm *xwm,
+                          xcb_create_notify_event_t *event)
+{
+  ClaylandXwmWindow *window;
+
+  if (event->window == xwm->wm_window)
+    return;
+
+  /* The window may already be known if X Wayland told us about its
+   * surface before we saw this event */
+  window = xwm_ensure_window (xwm, event->window);
+  window->x = event->x;
+  window->y = event->y;
+  window->width = event->width;
+  window->height = event->height;
+  window->override_redirect = event->override_redirect;
+
+  xwm_window_update_actor (window);
+}
+
+static void
+xwm_handle_destroy_notify (ClaylandXwm *xwm,
+                           xcb_destroy_notify_event_t *event)
+{
+  g_hash_table_remove (xwm->windows, GUINT_TO_POINTER (event->window));
+}
+
+/* Raises the window in both the X server and our stacking, along
+ * with the windows that are transient for it */
+static void
+xwm_window_raise (ClaylandXwmWindow *window)
+{
+  ClaylandXwm *xwm = window->xwm;
+  guint32 values[1] = { XCB_STACK_MODE_ABOVE };
+  ClaylandXwmWindow *transient;
+  GHashTableIter iter;
+
+  if (window->raising)
+    return;
+
+  window->raising = TRUE;
+
+  xcb_configure_window (xwm->conn, window->id,
+                        XCB_CONFIG_WINDOW_STACK_MODE, values);
+  if (window->surface)
+    clayland_stack_raise_window (xwm->compositor, window->surface);
+
+  g_hash_table_iter_init (&iter, xwm->windows);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &transient))
+    if (transient->transient_for == window->id && transient->mapped)
+      xwm_window_raise (transient);
+
+  window->raising = FALSE;
+}
+
+/* The properties fetched for the MapRequest come back before this
+ * reply, so whether the window is transient is known by now */
+static void
+map_geometry_reply_cb (ClaylandXwm *xwm,
+                       void *data,
+                       ClaylandXwmRequest *request)
+{
+  xcb_get_geometry_reply_t *reply = data;
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, request->window);
+  ClaylandXwmWindow *parent;
+  guint32 values[2];
+
+  if (!window)
+    return;
+
+  parent = xwm_lookup_window (xwm, window->transient_for);
+
+  /* Transient windows that didn't pick a position are centered over
+   * their parent */
+  if (parent && parent->mapped && reply->x == 0 && reply->y == 0)
+    {
+      values[0] = parent->x + (parent->width - reply->width) / 2;
+      values[1] = parent->y + (parent->height - reply->height) / 2;
+      xcb_configure_window (xwm->conn, window->id,
+                            XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y,
+                            values);
+    }
+
+  xwm_set_wm_state (xwm, window->id, ICCCM_NORMAL_STATE);
+  xwm_window_raise (window);
+  xcb_map_window (xwm->conn, window->id);
+}
+
+static void
+xwm_handle_map_request (ClaylandXwm *xwm,
+                        xcb_map_request_event_t *event)
+{
+  ClaylandXwmWindow *window = xwm_ensure_window (xwm, event->window);
+  xcb_get_geometry_cookie_t cookie;
+
+  xwm_window_fetch_properties (window);
+
+  cookie = xcb_get_geometry (xwm->conn, window->id);
+  xwm_queue_request (xwm, cookie.sequence,
+                     map_geometry_reply_cb, window->id, 0);
+}
+
+static void
+xwm_handle_map_notify (ClaylandXwm *xwm,
+                       xcb_map_notify_event_t *event)
+{
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, event->window);
+
+  if (!window)
+    return;
+
+  window->mapped = TRUE;
+
+  /* Override redirect windows never go through MapRequest */
+  if (window->override_redirect)
+    xwm_window_fetch_properties (window);
+
+  xwm_window_update_actor (window);
+}
+
+static void
+xwm_handle_unmap_notify (ClaylandXwm *xwm,
+                         xcb_unmap_notify_event_t *event)
+{
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, event->window);
+
+  if (!window)
+    return;
+
+  if (window->mapped && !window->override_redirect)
+    xwm_set_wm_state (xwm, window->id, ICCCM_WITHDRAWN_STATE);
+
+  window->mapped = FALSE;
+  xwm_window_update_actor (window);
+}
+
+static void
+xwm_handle_configure_request (ClaylandXwm *xwm,
+                              xcb_configure_request_event_t *event)
+{
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, event->window);
+  guint32 values[7];
+  guint16 mask = 0;
+  int i = 0;
+
+  /* The values have to be in the order of the mask bits */
+  if (event->value_mask & XCB_CONFIG_WINDOW_X)
+    {
+      values[i++] = event->x;
+      mask |= XCB_CONFIG_WINDOW_X;
+    }
+  if (event->value_mask & XCB_CONFIG_WINDOW_Y)
+    {
+      values[i++] = event->y;
+      mask |= XCB_CONFIG_WINDOW_Y;
+    }
+  if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+    {
+      values[i++] = event->width;
+      mask |= XCB_CONFIG_WINDOW_WIDTH;
+    }
+  if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+    {
+      values[i++] = event->height;
+      mask |= XCB_CONFIG_WINDOW_HEIGHT;
+    }
+  if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+    {
+      values[i++] = event->border_width;
+      mask |= XCB_CONFIG_WINDOW_BORDER_WIDTH;
+    }
+  if (event->value_mask & XCB_CONFIG_WINDOW_SIBLING)
+    {
+      values[i++] = event->sibling;
+      mask |= XCB_CONFIG_WINDOW_SIBLING;
+    }
+  if (event->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
+    {
+      values[i++] = event->stack_mode;
+      mask |= XCB_CONFIG_WINDOW_STACK_MODE;
+    }
+
+  xcb_configure_window (xwm->conn, event->window, mask, values);
+
+  /* Keep our stacking in step with windows that raise themselves.
+   * Their transient windows come up with them. */
+  if (window &&
+      (event->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) &&
+      event->stack_mode == XCB_STACK_MODE_ABOVE &&
+      !(event->value_mask & XCB_CONFIG_WINDOW_SIBLING))
+    xwm_window_raise (window);
+}
+
+static void
+xwm_handle_configure_notify (ClaylandXwm *xwm,
+                             xcb_configure_notify_event_t *event)
+{
+  ClaylandXwmWindow *window = xwm_lookup_window (xwm, event->window);
+
+  if (!window)
+    return;
+
+  window->x = event->x;
+  window->y = event->y;
+  window->width = event->width;
+  window->height = event->height;
+  window->override_redirect = event->override_redirect;
+
+  xwm_window_update_actor (window);
+}
+
+static void
+xwm_handle_property_notify (ClaylandXwm *xwm,
+                            xcb_property_notify_event_t *event)
+{
+  if (!xwm_lookup_window (xwm, event->window) ||
+      !xwm_is_interesting_property (xwm, event->atom))
+    return;
+
+  xwm_fetch_property (xwm, event->window, event->atom);
+}
+
+static void
+xwm_handle_event (ClaylandXwm *xwm,
+                  xcb_generic_event_t *event)
+{
+  switch (event->response_type & ~0x80)
+    {
+    case 0:
+      {
+        xcb_generic_error_t *error = (xcb_generic_error_t *) event;
+
+        /* Most errors come from windows that were destroyed before our
+         * requests about them got to the server */
+        if (error->error_code != XCB_WINDOW)
+          g_warning ("X error %d for request %d.%d",
+                     error->error_code,
+                     error->major_code,
+                     error->minor_code);
+      }
+      break;
+    case XCB_CREATE_NOTIFY:
+      xwm_handle_create_notify (xwm, (xcb_create_notify_event_t *) event);
+      break;
+    case XCB_DESTROY_NOTIFY:
+      xwm_handle_destroy_notify (xwm, (xcb_destroy_notify_event_t *) event);
+      break;
+    case XCB_MAP_REQUEST:
+      xwm_handle_map_request (xwm, (xcb_map_request_event_t *) event);
+      break;
+    case XCB_MAP_NOTIFY:
+      xwm_handle_map_notify (xwm, (xcb_map_notify_event_t *) event);
+      break;
+    case XCB_UNMAP_NOTIFY:
+      xwm_handle_unmap_notify (xwm, (xcb_unmap_notify_event_t *) event);
+      break;
+    case XCB_CONFIGURE_REQUEST:
+      xwm_handle_configure_request (xwm,
+                                    (xcb_configure_request_event_t *) event);
+      break;
+    case XCB_CONFIGURE_NOTIFY:
+      xwm_handle_configure_notify (xwm,
+                                   (xcb_configure_notify_event_t *) event);
+      break;
+    case XCB_PROPERTY_NOTIFY:
+      xwm_handle_property_notify (xwm,
+                                  (xcb_property_notify_event_t *) event);
+      break;
+    default:
+      break;
+    }
+}
+
+static int
+xwm_dispatch (int fd,
+              uint32_t mask,
+              void *data)
+{
+  ClaylandXwm *xwm = data;
+  xcb_generic_event_t *event;
+
+  while ((event = xcb_poll_for_event (xwm->conn)))
+    {
+      if (xwm->atoms_pending)
+        {
+          g_queue_push_tail (&xwm->held_events, event);
+          continue;
+        }
+
+      xwm_handle_event (xwm, event);
+      free (event);
+    }
+
+  /* Reading the events above also reads any replies that arrived */
+  xwm_dispatch_replies (xwm);
+
+  if (xcb_connection_has_error (xwm->conn))
+    {
+      /* The X server went away. It's cleaned up when the process is
+       * reaped. */
+      g_warning ("Lost the connection to the X server");
+      wl_event_source_remove (xwm->source);
+      xwm->source = NULL;
+      return 0;
+    }
+
+  xcb_flush (xwm->conn);
+
+  return 0;
+}
+
+static void
+xwm_atoms_ready (ClaylandXwm *xwm)
+{
+  xcb_window_t root = xwm->screen->root;
+  xcb_query_tree_cookie_t cookie;
+  xcb_generic_event_t *event;
+  static const char name[] = "clayland";
+
+  /* Advertise ourselves as an EWMH compliant window manager */
+  xwm->wm_window = xcb_generate_id (xwm->conn);
+  xcb_create_window (xwm->conn,
+                     XCB_COPY_FROM_PARENT,
+                     xwm->wm_window,
+                     root,
+                     0, 0, 10, 10,
+                     0, /* border width */
+                     XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                     xwm->screen->root_visual,
+                     0, NULL);
+  xcb_change_property (xwm->conn, XCB_PROP_MODE_REPLACE,
+                       xwm->wm_window,
+                       xwm->atoms[ATOM_NET_WM_NAME],
+                       xwm->atoms[ATOM_UTF8_STRING],
+                       8, /* format */
+                       strlen (name), name);
+  xcb_change_property (xwm->conn, XCB_PROP_MODE_REPLACE,
+                       xwm->wm_window,
+                       xwm->atoms[ATOM_NET_SUPPORTING_WM_CHECK],
+                       XCB_ATOM_WINDOW,
+                       32, /* format */
+                       1, &xwm->wm_window);
+  xcb_change_property (xwm->conn, XCB_PROP_MODE_REPLACE,
+                       root,
+                       xwm->atoms[ATOM_NET_SUPPORTING_WM_CHECK],
+                       XCB_ATOM_WINDOW,
+                       32, /* format */
+                       1, &xwm->wm_window);
+
+  cookie = xcb_query_tree (xwm->conn, root);
+  xwm_queue_request (xwm, cookie.sequence, query_tree_reply_cb, root, 0);
+
+  while ((event = g_queue_pop_head (&xwm->held_events)))
+    {
+      xwm_handle_event (xwm, event);
+      free (event);
+    }
+}
+
+static void
+intern_atom_reply_cb (ClaylandXwm *xwm,
+                      void *data,
+                      ClaylandXwmRequest *request)
+{
+  xcb_intern_atom_reply_t *reply = data;
+
+  xwm->atoms[request->arg] = reply->atom;
+
+  if (--xwm->atoms_pending == 0)
+    xwm_atoms_ready (xwm);
+}
+
+static void
+keyboard_focus_cb (struct wl_listener *listener,
+                   void *data)
+{
+  ClaylandXwm *xwm = wl_container_of (listener, xwm, keyboard_focus_listener);
+  ClaylandKeyboard *keyboard = data;
+  ClaylandXwmWindow *window = NULL;
+  xcb_window_t focus;
+
+  if (!xwm->conn)
+    return;
+
+  if (keyboard->focus && keyboard->focus->configure == xwm_surface_commit)
+    window = keyboard->focus->configure_private;
+
+  focus = window ? window->id : XCB_WINDOW_NONE;
+  if (focus == xwm->focus)
+    return;
+
+  xwm->focus = focus;
+
+  if (window)
+    {
+      if (window->take_focus)
+        {
+          xcb_client_message_event_t message;
+
+          memset (&message, 0, sizeof message);
+          message.response_type = XCB_CLIENT_MESSAGE;
+          message.format = 32;
+          message.window = window->id;
+          message.type = xwm->atoms[ATOM_WM_PROTOCOLS];
+          message.data.data32[0] = xwm->atoms[ATOM_WM_TAKE_FOCUS];
+          message.data.data32[1] = XCB_TIME_CURRENT_TIME;
+
+          xcb_send_event (xwm->conn, 0, window->id,
+                          XCB_EVENT_MASK_NO_EVENT,
+                          (const char *) &message);
+        }
+
+      xcb_set_input_focus (xwm->conn, XCB_INPUT_FOCUS_POINTER_ROOT,
+                           window->id, XCB_TIME_CURRENT_TIME);
+      xwm_window_raise (window);
+    }
+  else
+    xcb_set_input_focus (xwm->conn, XCB_INPUT_FOCUS_POINTER_ROOT,
+                         XCB_WINDOW_NONE, XCB_TIME_CURRENT_TIME);
+
+  xcb_change_property (xwm->conn, XCB_PROP_MODE_REPLACE,
+                       xwm->screen->root,
+                       xwm->atoms[ATOM_NET_ACTIVE_WINDOW],
+                       XCB_ATOM_WINDOW,
+                       32, /* format */
+                       1, &focus);
+
+  xcb_flush (xwm->conn);
+}
+
+/* Sets up the connection once xcb has read the server's answer to
+ * the connection setup */
+static void
+xwm_connected (ClaylandXwm *xwm,
+               xcb_connection_t *conn)
+{
+  ClaylandCompositor *compositor = xwm->compositor;
+  guint32 values[1];
+  int i;
+
+  if (xcb_connection_has_error (conn))
+    {
+      g_warning ("Failed to connect to the X server as its window manager");
+      xcb_disconnect (conn);
+      return;
+    }
+
+  xwm->conn = conn;
+
+  /* The setup was read by xcb_connect_to_fd so this doesn't block */
+  xwm->screen = xcb_setup_roots_iterator (xcb_get_setup (conn)).data;
+
+  for (i = 0; i < N_ATOMS; i++)
+    {
+      xcb_intern_atom_cookie_t cookie =
+        xcb_intern_atom (conn, 0, strlen (atom_names[i]), atom_names[i]);
+
+      xwm_queue_request (xwm, cookie.sequence, intern_atom_reply_cb,
+                         XCB_WINDOW_NONE, i);
+    }
+  xwm->atoms_pending = N_ATOMS;
+
+  /* If another window manager is already running this results in an
+   * error event */
+  values[0] = (XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
+               XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT |
+               XCB_EVENT_MASK_PROPERTY_CHANGE);
+  xcb_change_window_attributes (conn, xwm->screen->root,
+                                XCB_CW_EVENT_MASK, values);
+
+  xwm->source = wl_event_loop_add_fd (compositor->wayland_loop,
+                                      xcb_get_file_descriptor (conn),
+                                      WL_EVENT_READABLE,
+                                      xwm_dispatch,
+                                      xwm);
+
+  xcb_flush (conn);
+}
+
+static gpointer
+xwm_connect_thread (gpointer data)
+{
+  ClaylandXwm *xwm = data;
+  xcb_connection_t *conn = xcb_connect_to_fd (xwm->fd, NULL);
+  char done = 0;
+
+  /* The main thread picks the connection up from g_thread_join */
+  while (write (xwm->connect_pipe[1], &done, 1) < 0 && errno == EINTR)
+    ;
+
+  return conn;
+}
+
+static xcb_connection_t *
+xwm_join_connect_thread (ClaylandXwm *xwm)
+{
+  xcb_connection_t *conn = g_thread_join (xwm->connect_thread);
+
+  xwm->connect_thread = NULL;
+  wl_event_source_remove (xwm->connect_source);
+  xwm->connect_source = NULL;
+  close (xwm->connect_pipe[0]);
+  close (xwm->connect_pipe[1]);
+
+  return conn;
+}
+
+static int
+xwm_connect_done (int fd,
+                  uint32_t mask,
+                  void *data)
+{
+  ClaylandXwm *xwm = data;
+
+  xwm_connected (xwm, xwm_join_connect_thread (xwm));
+
+  return 0;
+}
+
+ClaylandXwm *
+clayland_xwm_new (ClaylandCompositor *compositor,
+                  int fd)
+{
+  ClaylandXwm *xwm;
+
+  xwm = g_slice_new0 (ClaylandXwm);
+  xwm->compositor = compositor;
+  xwm->fd = fd;
+  g_queue_init (&xwm->requests);
+  g_queue_init (&xwm->held_events);
+  xwm->windows =
+    g_hash_table_new_full (NULL, NULL,
+                           NULL, (GDestroyNotify) xwm_window_free);
+
+  xwm->keyboard_focus_listener.notify = keyboard_focus_cb;
+  wl_signal_add (&compositor->seat->keyboard.focus_signal,
+                 &xwm->keyboard_focus_listener);
+
+  if (pipe2 (xwm->connect_pipe, O_CLOEXEC) < 0)
+    {
+      g_warning ("pipe failed for the X window manager");
+      close (fd);
+      return xwm;
+    }
+
+  xwm->connect_source = wl_event_loop_add_fd (compositor->wayland_loop,
+                                              xwm->connect_pipe[0],
+                                              WL_EVENT_READABLE,
+                                              xwm_connect_done,
+                                              xwm);
+  xwm->connect_thread = g_thread_new ("clayland-xwm-connect",
+                                      xwm_connect_thread,
+                                      xwm);
+
+  return xwm;
+}
+
+void
+clayland_xwm_set_window_id (ClaylandXwm *xwm,
+                            ClaylandSurface *surface,
+                            guint32 id)
+{
+  ClaylandXwmWindow *window;
+
+  if (surface->configure || surface->shell_surface)
+    {
+      g_warning ("set_window_id for surface %p which already has a role",
+                 surface);
+      return;
+    }
+
+  /* The CreateNotify for the window may still be on its way to us.
+   * Its geometry is filled in when it arrives. */
+  window = xwm_ensure_window (xwm, id);
+
+  xwm_window_detach_surface (window);
+
+  window->surface = surface;
+  window->surface_destroy_listener.notify = xwm_handle_surface_destroy;
+  wl_resource_add_destroy_listener (surface->resource,
+                                    &window->surface_destroy_listener);
+
+  surface->configure = xwm_surface_commit;
+  surface->configure_private = window;
+
+  xwm_window_update_actor (window);
+}
+
+void
+clayland_xwm_free (ClaylandXwm *xwm)
+{
+  ClaylandXwmRequest *request;
+  xcb_generic_event_t *event;
+
+  wl_list_remove (&xwm->keyboard_focus_listener.link);
+
+  /* Shutting the socket down makes xcb give up on a server that
+   * hasn't answered yet */
+  if (xwm->connect_thread)
+    {
+      shutdown (xwm->fd, SHUT_RDWR);
+      xcb_disconnect (xwm_join_connect_thread (xwm));
+    }
+
+  if (xwm->source)
+    wl_event_source_remove (xwm->source);
+
+  g_hash_table_destroy (xwm->windows);
+
+  while ((request = g_queue_pop_head (&xwm->requests)))
+    g_slice_free (ClaylandXwmRequest, request);
+  while ((event = g_queue_pop_head (&xwm->held_events)))
+    free (event);
+
+  if (xwm->conn)
+    xcb_disconnect (xwm->conn);
+
+  g_slice_free (ClaylandXwm, xwm);
+}
@@ -0,0 +1,48 @@
+/*
+ * Clayland
+ *
+ * An example Wayland compositor using Clutter
+ *
+ * Copyright (C) 2013  Intel Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLAYLAND_XWM_H__
+#define __CLAYLAND_XWM_H__
+
+#include <wayland-server.h>
+#include <glib.h>
+
+#include "clayland-compositor.h"
+
+typedef struct _ClaylandXwm ClaylandXwm;
+
+/* Becomes the window manager of the X server at the other end of fd.
+ * Nothing waits for the X server, not even its answer to the
+ * connection setup, which is read in a thread. */
+ClaylandXwm *
+clayland_xwm_new (ClaylandCompositor *compositor,
+                  int fd);
+
+/* Associates the surface X Wayland created for an X window with it */
+void
+clayland_xwm_set_window_id (ClaylandXwm *xwm,
+                            ClaylandSurface *surface,
+                            guint32 id);
+
+void
+clayland_xwm_free (ClaylandXwm *xwm);
+
+#endif /* __CLAYLAND_XWM_H__ */
@@ -29,6 +29,8 @@
 #include <glib.h>
 #include <sys/time.h>
 #include <string.h>
+#include <stdio.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -37,6 +39,7 @@
 #include <sys/un.h>
 #include <stdlib.h>
 #include <sys/wait.h>
+#include <signal.h>
 
 #include <wayland-server.h>
 
@@ -45,6 +48,17 @@
 #include "clayland-seat.h"
 #include "clayland-data-device.h"
 #include "clayland-keyboard.h"
+#include "clayland-pointer.h"
+#include "clayland-clipboard.h"
+#include "clayland-xdg-shell.h"
+#include "clayland-popup.h"
+#include "clayland-stack.h"
+#include "clayland-xwm.h"
+#include "clayland-arena.h"
+#include "clayland-headless.h"
+#include "clayland-shm-convert.h"
+#include "clayland-viewporter.h"
+#include "clayland-window-grab.h"
 
 typedef struct
 {
@@ -52,32 +66,46 @@ typedef struct
   cairo_region_t *region;
 } ClaylandRegion;
 
-typedef struct
+struct _ClaylandShellSurface
 {
+  ClaylandCompositor *compositor;
   ClaylandSurface *surface;
   struct wl_resource *resource;
   struct wl_listener surface_destroy_listener;
-} ClaylandShellSurface;
-
-typedef struct
-{
-  guint32 flags;
-  int width;
-  int height;
-  int refresh;
-} ClaylandMode;
-
-typedef struct
-{
-  struct wl_object wayland_output;
-  int x;
-  int y;
-  int width_mm;
-  int height_mm;
-  /* XXX: with sliced stages we'd reference a CoglFramebuffer here. */
 
-  GList *modes;
-} ClaylandOutput;
+  /* wl_shell_surface.set_fullscreen */
+  gboolean fullscreen;
+  guint32 fullscreen_method;
+  guint32 framerate;
+  ClaylandOutput *output;
+
+  /* wl_shell_surface.set_popup */
+  gboolean popup;
+  ClaylandPopup popup_grab;
+  ClaylandSurface *popup_parent;
+  struct wl_listener popup_parent_destroy_listener;
+  int32_t popup_x, popup_y;
+
+  /* Interactive move or resize in progress */
+  ClaylandWindowGrab *grab;
+
+  /* Edges being dragged. The opposite edges are kept in place when the
+   * client commits a buffer of a new size. */
+  guint32 resize_edges;
+
+  /* We only let one configure be in flight at a time. Sizes requested
+   * before the client has committed a buffer in response replace
+   * pending_configure, which then gets sent after the next frame. */
+  gboolean configure_in_flight;
+  gboolean configure_pending;
+  struct
+  {
+    guint32 edges;
+    int32_t width;
+    int32_t height;
+  } pending_configure;
+  struct wl_list configure_link;
+};
 
 typedef struct
 {
@@ -96,44 +124,86 @@ typedef struct
   struct wl_resource *resource;
 } ClaylandFrameCallback;
 
-struct _ClaylandCompositor
-{
-  struct wl_display *wayland_display;
-  struct wl_event_loop *wayland_loop;
-  ClutterActor *stage;
-  GList *outputs;
-  GSource *wayland_event_source;
-  GList *surfaces;
-  struct wl_list frame_callbacks;
-
-  int xwayland_display_index;
-  char *xwayland_lockfile;
-  int xwayland_abstract_fd;
-  int xwayland_unix_fd;
-  pid_t xwayland_pid;
-  struct wl_client *xwayland_client;
-  struct wl_resource *xserver_resource;
-
-  ClaylandSeat *seat;
-};
+struct _ClaylandClient
+{
+  struct wl_client *wayland_client;
+  struct wl_listener destroy_listener;
+  ClaylandCompositor *compositor;
 
-static int signal_pipe[2];
+  /* Serial of the outstanding wl_shell_surface.ping or 0 */
+  guint32 ping_serial;
+  gint64 ping_time;
 
-void
-report_signal (int signal)
-{
-  switch (signal)
-    {
-    case SIGINT:
-      write (signal_pipe[1], "I", 1);
-      break;
-    case SIGCHLD:
-      write (signal_pipe[1], "C", 1);
-      break;
-    default:
-      break;
-    }
-}
+  /* Round trip time of the last ping in microseconds or -1 */
+  gint64 pong_latency;
+
+  gboolean unresponsive;
+};
+
+/* Only used when running headless. Otherwise Clutter runs the loop. */
+static GMainLoop *main_loop;
+
+/* Signals handled through signalfd in the Wayland event loop. They are
+ * blocked for the whole process so they can only be delivered there. */
+static const int handled_signals[] = { SIGINT, SIGTERM, SIGCHLD, SIGUSR1 };
+static struct wl_event_source *signal_sources[G_N_ELEMENTS (handled_signals)];
+
+static void clayland_compositor_update_fullscreen (ClaylandCompositor *compositor);
+static void output_pace_frame_callbacks (ClaylandOutput *output);
+
+/* Clients are pinged every PING_INTERVAL milliseconds and considered
+ * unresponsive if the ping is still outstanding at the next round */
+#define PING_INTERVAL 5000
+
+/* Version 3 adds wl_surface.set_buffer_scale and version 4
+ * wl_surface.damage_buffer */
+#define COMPOSITOR_VERSION 4
+
+/* Version 2 adds wl_output.done and wl_output.scale */
+#define OUTPUT_VERSION 2
+
+/* An X server that dies within XWAYLAND_STABLE_TIME microseconds of
+ * being started is considered to have crashed. The sockets aren't
+ * watched again until a delay that doubles with each crash in a row,
+ * so a server that can't start doesn't get forked over and over. */
+#define XWAYLAND_STABLE_TIME (10 * G_USEC_PER_SEC)
+#define XWAYLAND_RESTART_MIN_DELAY 250
+#define XWAYLAND_RESTART_MAX_DELAY 30000
+
+static void shell_surface_commit (ClaylandShellSurface *shell_surface,
+                                  gboolean newly_attached,
+                                  float old_width,
+                                  float old_height);
+static void shell_surface_place_fullscreen (ClaylandShellSurface *shell_surface);
+static void shell_output_changed (ClaylandCompositor *compositor,
+                                  ClaylandOutput *output);
+static void shell_surface_place_popup (ClaylandShellSurface *shell_surface);
+static void shell_surface_unset_popup (ClaylandShellSurface *shell_surface);
+static void watch_xwayland_sockets (ClaylandCompositor *compositor);
+static void remove_signal_handlers (void);
+
+static gboolean option_clipboard_manager = FALSE;
+static char *option_headless = NULL;
+static char *option_dump_frames = NULL;
+static int option_render_threads = 1;
+static char **option_outputs = NULL;
+
+static GOptionEntry options[] =
+  {
+    { "clipboard-manager", 0, 0, G_OPTION_ARG_NONE, &option_clipboard_manager,
+      "Keep a copy of the selection in the compositor", NULL },
+    { "headless", 0, 0, G_OPTION_ARG_STRING, &option_headless,
+      "Run without a display and composite in software", "WxH[@HZ]" },
+    { "dump-frames", 0, 0, G_OPTION_ARG_FILENAME, &option_dump_frames,
+      "Save the frames painted when headless as PPM files in DIR", "DIR" },
+    { "render-threads", 0, 0, G_OPTION_ARG_INT, &option_render_threads,
+      "Number of threads painting when headless, 0 for one per CPU", "N" },
+    { "output", 0, 0, G_OPTION_ARG_STRING_ARRAY, &option_outputs,
+      "Add an output with the given modes, the preferred one first, "
+      "showing the region of the stage at X,Y. Can be given more than "
+      "once.", "WxH[@HZ][,WxH[@HZ]...][+X+Y]" },
+    { NULL }
+  };
 
 static guint32
 get_time (void)
@@ -207,7 +277,7 @@ clayland_buffer_destroy_handler (struct wl_listener *listener,
   ClaylandBuffer *buffer = wl_container_of (listener, buffer, destroy_listener);
 
   wl_signal_emit (&buffer->destroy_signal, buffer);
-  g_slice_free (ClaylandBuffer, buffer);
+  clayland_arena_free (buffer);
 }
 
 static ClaylandBuffer *
@@ -225,7 +295,8 @@ clayland_buffer_from_resource (struct wl_resource *resource)
     }
   else
     {
-      buffer = g_slice_new0 (ClaylandBuffer);
+      buffer = clayland_arena_new0 (wl_resource_get_client (resource),
+                                    ClaylandBuffer);
 
       buffer->resource = resource;
       wl_signal_init (&buffer->destroy_signal);
@@ -275,14 +346,152 @@ clayland_buffer_reference (ClaylandBufferReference *ref,
   ref->destroy_listener.notify = clayland_buffer_reference_handle_destroy;
 }
 
+/* Repaints part of the stage in the headless renderer. Clutter keeps
+   track of where its actors are itself. */
+static void
+damage_stage_area (ClaylandCompositor *compositor,
+                   int x,
+                   int y,
+                   int width,
+                   int height)
+{
+  cairo_rectangle_int_t rectangle = { x, y, width, height };
+
+  if (compositor->headless && width > 0 && height > 0)
+    clayland_headless_damage_rectangle (compositor->headless, &rectangle);
+}
+
+/* Maps a region through the matrix, rounding outwards. The matrices
+   used here only ever rotate by multiples of 90 degrees so rectangles
+   stay rectangles. */
+static cairo_region_t *
+transform_region (const cairo_matrix_t *matrix,
+                  const cairo_region_t *region)
+{
+  cairo_region_t *result = cairo_region_create ();
+  int i, n_rectangles;
+
+  n_rectangles = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rectangles; i++)
+    {
+      cairo_rectangle_int_t rectangle;
+      double x1, y1, x2, y2;
+
+      cairo_region_get_rectangle (region, i, &rectangle);
+
+      x1 = rectangle.x;
+      y1 = rectangle.y;
+      x2 = rectangle.x + rectangle.width;
+      y2 = rectangle.y + rectangle.height;
+      cairo_matrix_transform_point (matrix, &x1, &y1);
+      cairo_matrix_transform_point (matrix, &x2, &y2);
+
+      rectangle.x = floor (MIN (x1, x2));
+      rectangle.y = floor (MIN (y1, y2));
+      rectangle.width = ceil (MAX (x1, x2)) - rectangle.x;
+      rectangle.height = ceil (MAX (y1, y2)) - rectangle.y;
+      cairo_region_union_rectangle (result, &rectangle);
+    }
+
+  return result;
+}
+
+/* Converts a region in surface coordinates to the part of the buffer
+   it shows */
+static cairo_region_t *
+surface_to_buffer_region (ClaylandSurface *surface,
+                          cairo_region_t *region)
+{
+  cairo_matrix_t matrix;
+
+  clayland_surface_get_buffer_matrix (surface, &matrix);
+  if (cairo_matrix_invert (&matrix) != CAIRO_STATUS_SUCCESS)
+    return cairo_region_create ();
+
+  return transform_region (&matrix, region);
+}
+
+/* Gets the damage committed by the surface as a single region in
+   buffer pixels, clipped to the buffer. Clients that already know
+   what changed in their buffer send it with damage_buffer and that
+   is used as is. */
+static cairo_region_t *
+surface_get_buffer_damage (ClaylandSurface *surface,
+                           cairo_region_t *damage,
+                           cairo_region_t *buffer_damage)
+{
+  cairo_rectangle_int_t extents = { 0, 0, 0, 0 };
+  cairo_region_t *region;
+  float width, height;
+
+  if (cairo_region_is_empty (damage))
+    region = cairo_region_copy (buffer_damage);
+  else
+    {
+      region = surface_to_buffer_region (surface, damage);
+      cairo_region_union (region, buffer_damage);
+    }
+
+  clayland_surface_get_buffer_size (surface, &width, &height);
+  extents.width = width;
+  extents.height = height;
+  cairo_region_intersect_rectangle (region, &extents);
+
+  return region;
+}
+
+/* Uploads the whole of the current buffer into the actor */
+static void
+surface_attach_actor_buffer (ClaylandSurface *surface)
+{
+  ClutterWaylandSurface *surface_actor =
+    CLUTTER_WAYLAND_SURFACE (surface->actor);
+  struct wl_resource *buffer = surface->buffer_ref.buffer->resource;
+  GError *error = NULL;
+
+  if (!clutter_wayland_surface_attach_buffer (surface_actor, buffer, &error))
+    {
+      g_warning ("Failed to attach buffer to "
+                 "ClutterWaylandSurface: %s\n",
+                 error->message);
+      g_clear_error (&error);
+    }
+}
+
+/* Uploads the damaged part of the buffer and queues a redraw of the
+   area of the surface it covers */
 static void
 surface_damaged (ClaylandSurface *surface,
-                 cairo_region_t *region)
+                 cairo_region_t *buffer_region)
 {
-  if (surface->actor &&
+  ClaylandCompositor *compositor = surface->compositor;
+
+  /* The headless renderer reads straight from the buffers */
+  if (compositor->headless)
+    {
+      cairo_rectangle_int_t extents = { 0, 0, 0, 0 };
+      cairo_region_t *region;
+      cairo_matrix_t matrix;
+      float width, height;
+
+      clayland_surface_get_buffer_matrix (surface, &matrix);
+      region = transform_region (&matrix, buffer_region);
+      clayland_surface_get_size (surface, &width, &height);
+      extents.width = ceil (width);
+      extents.height = ceil (height);
+      cairo_region_intersect_rectangle (region, &extents);
+
+      clayland_headless_surface_damaged (compositor->headless,
+                                         surface,
+                                         region,
+                                         buffer_region);
+
+      cairo_region_destroy (region);
+    }
+  else if (surface->actor &&
       surface->buffer_ref.buffer)
     {
-      int i, n_rectangles = cairo_region_num_rectangles (region);
+      int i, n_rectangles = cairo_region_num_rectangles (buffer_region);
       ClutterWaylandSurface *surface_actor =
         CLUTTER_WAYLAND_SURFACE (surface->actor);
       struct wl_resource *wayland_buffer = surface->buffer_ref.buffer->resource;
@@ -291,7 +500,7 @@ surface_damaged (ClaylandSurface *surface,
         {
           cairo_rectangle_int_t rectangle;
 
-          cairo_region_get_rectangle (region, i, &rectangle);
+          cairo_region_get_rectangle (buffer_region, i, &rectangle);
 
           clutter_wayland_surface_damage_buffer (surface_actor,
                                                  wayland_buffer,
@@ -303,6 +512,78 @@ surface_damaged (ClaylandSurface *surface,
     }
 }
 
+static gboolean
+matrix_is_identity (const cairo_matrix_t *matrix)
+{
+  return (matrix->xx == 1 && matrix->yx == 0 &&
+          matrix->xy == 0 && matrix->yy == 1 &&
+          matrix->x0 == 0 && matrix->y0 == 0);
+}
+
+/* Makes the actor show its buffer with the transform, scale and
+   viewport of the surface. ClutterWaylandSurface always draws the
+   whole buffer at its natural size so the actor is given a transform
+   from buffer pixels to the surface, and with a viewport the source
+   rectangle is cut out with a clip. The custom transform replaces the
+   actor's scale so this has to be called again whenever the scale
+   changes. */
+static void
+surface_update_actor_geometry (ClaylandSurface *surface)
+{
+  ClutterActor *actor = surface->actor;
+  cairo_matrix_t matrix, inverse;
+  ClutterMatrix transform;
+  gdouble scale_x, scale_y;
+  float width, height;
+  double x1 = 0, y1 = 0, x2, y2;
+
+  if (!actor)
+    return;
+
+  clayland_surface_get_buffer_matrix (surface, &matrix);
+
+  if (matrix_is_identity (&matrix))
+    clutter_actor_set_transform (actor, NULL);
+  else
+    {
+      float m[16] = { 0 };
+
+      clutter_actor_get_scale (actor, &scale_x, &scale_y);
+
+      m[0] = matrix.xx * scale_x;
+      m[1] = matrix.yx * scale_y;
+      m[4] = matrix.xy * scale_x;
+      m[5] = matrix.yy * scale_y;
+      m[10] = 1;
+      m[12] = matrix.x0 * scale_x;
+      m[13] = matrix.y0 * scale_y;
+      m[15] = 1;
+
+      cogl_matrix_init_from_array (&transform, m);
+      clutter_actor_set_transform (actor, &transform);
+    }
+
+  if (!clayland_viewport_state_is_set (&surface->viewport))
+    {
+      clutter_actor_remove_clip (actor);
+      return;
+    }
+
+  /* The clip is in buffer pixels */
+  clayland_surface_get_size (surface, &width, &height);
+  x2 = width;
+  y2 = height;
+  inverse = matrix;
+  if (cairo_matrix_invert (&inverse) != CAIRO_STATUS_SUCCESS)
+    return;
+  cairo_matrix_transform_point (&inverse, &x1, &y1);
+  cairo_matrix_transform_point (&inverse, &x2, &y2);
+
+  clutter_actor_set_clip (actor,
+                          MIN (x1, x2), MIN (y1, y2),
+                          fabs (x2 - x1), fabs (y2 - y1));
+}
+
 static void
 clayland_surface_destroy (struct wl_client *wayland_client,
                           struct wl_resource *wayland_resource)
@@ -353,6 +634,20 @@ clayland_surface_damage (struct wl_client *client,
   cairo_region_union_rectangle (surface->pending.damage, &rectangle);
 }
 
+static void
+clayland_surface_damage_buffer (struct wl_client *client,
+                                struct wl_resource *surface_resource,
+                                gint32 x,
+                                gint32 y,
+                                gint32 width,
+                                gint32 height)
+{
+  ClaylandSurface *surface = wl_resource_get_user_data (surface_resource);
+  cairo_rectangle_int_t rectangle = { x, y, width, height };
+
+  cairo_region_union_rectangle (surface->pending.buffer_damage, &rectangle);
+}
+
 static void
 destroy_frame_callback (struct wl_resource *callback_resource)
 {
@@ -360,7 +655,7 @@ destroy_frame_callback (struct wl_resource *callback_resource)
     wl_resource_get_user_data (callback_resource);
 
   wl_list_remove (&callback->link);
-  g_slice_free (ClaylandFrameCallback, callback);
+  clayland_arena_free (callback);
 }
 
 static void
@@ -371,7 +666,7 @@ clayland_surface_frame (struct wl_client *client,
   ClaylandFrameCallback *callback;
   ClaylandSurface *surface = wl_resource_get_user_data (surface_resource);
 
-  callback = g_slice_new0 (ClaylandFrameCallback);
+  callback = clayland_arena_new0 (client, ClaylandFrameCallback);
   callback->compositor = surface->compositor;
   callback->resource = wl_client_add_object (client,
                                              &wl_callback_interface,
@@ -385,9 +680,23 @@ clayland_surface_frame (struct wl_client *client,
 
 static void
 clayland_surface_set_opaque_region (struct wl_client *client,
-                               struct wl_resource *resource,
-                               struct wl_resource *region)
+                                    struct wl_resource *resource,
+                                    struct wl_resource *region_resource)
 {
+  ClaylandSurface *surface = wl_resource_get_user_data (resource);
+
+  if (surface->pending.opaque_region)
+    cairo_region_destroy (surface->pending.opaque_region);
+
+  if (region_resource)
+    {
+      ClaylandRegion *region = wl_resource_get_user_data (region_resource);
+      surface->pending.opaque_region = cairo_region_copy (region->region);
+    }
+  else
+    surface->pending.opaque_region = NULL;
+
+  surface->pending.opaque_region_set = TRUE;
 }
 
 static void
@@ -410,6 +719,27 @@ clayland_surface_commit (struct wl_client *client,
 {
   ClaylandSurface *surface = wl_resource_get_user_data (resource);
   ClaylandCompositor *compositor = surface->compositor;
+  gboolean newly_attached = surface->pending.newly_attached;
+  gboolean created_actor = FALSE;
+  gboolean damaged = (!cairo_region_is_empty (surface->pending.damage) ||
+                      !cairo_region_is_empty (surface->pending.buffer_damage));
+  gboolean geometry_changed = surface->pending.viewport_changed;
+  int old_x = surface->x, old_y = surface->y;
+  float old_width, old_height;
+  cairo_region_t *buffer_damage;
+  ClaylandOutput *output;
+
+  clayland_surface_get_size (surface, &old_width, &old_height);
+
+  /* wl_surface.set_opaque_region */
+  if (surface->pending.opaque_region_set)
+    {
+      if (surface->opaque_region)
+        cairo_region_destroy (surface->opaque_region);
+      surface->opaque_region = surface->pending.opaque_region;
+      surface->pending.opaque_region = NULL;
+      surface->pending.opaque_region_set = FALSE;
+    }
 
   /* wl_surface.attach */
   if (surface->pending.newly_attached &&
@@ -417,36 +747,70 @@ clayland_surface_commit (struct wl_client *client,
     {
       clayland_buffer_reference (&surface->buffer_ref, surface->pending.buffer);
 
-      if (surface->pending.buffer)
+      if (surface->pending.buffer && compositor->headless)
+        {
+          /* There are no actors without Clutter so the first buffer
+           * is what makes it a window */
+          if (wl_list_empty (&surface->stack_link) && !surface->configure)
+            {
+              clayland_stack_add_window (compositor, surface);
+              created_actor = TRUE;
+            }
+        }
+      else if (surface->pending.buffer)
         {
-          ClutterWaylandSurface *surface_actor;
-          GError *error = NULL;
-          struct wl_resource *buffer = surface->pending.buffer->resource;
-
           if (!surface->actor)
             {
-              ClutterActor *stage = compositor->stage;
-
               surface->actor =
                 clutter_wayland_surface_new ((struct wl_surface *) surface);
-              clutter_container_add_actor (CLUTTER_CONTAINER (stage),
-                                           surface->actor);
-              clutter_actor_set_reactive (surface->actor, TRUE);
+              clutter_actor_set_position (surface->actor,
+                                          surface->x, surface->y);
+              created_actor = TRUE;
             }
 
-          surface_actor = CLUTTER_WAYLAND_SURFACE (surface->actor);
-
-          if (!clutter_wayland_surface_attach_buffer (surface_actor,
-                                                      buffer,
-                                                      &error))
+          /* The buffers of a client that doesn't answer pings aren't
+           * uploaded until it's back. A new actor still needs its
+           * first one. */
+          if (surface->client->unresponsive && !created_actor)
+            surface->held_attach = TRUE;
+          else
             {
-              g_warning ("Failed to attach buffer to "
-                         "ClutterWaylandSurface: %s\n",
-                         error->message);
-              g_clear_error (&error);
+              surface_attach_actor_buffer (surface);
+              surface->held_attach = FALSE;
             }
+
+          /* Surfaces with a role place their actor themselves. This is
+           * done once the buffer is attached so that the actor already
+           * has its size when it's stacked. */
+          if (created_actor && !surface->configure)
+            clayland_stack_add_window (compositor, surface);
         }
     }
+
+  /* wl_surface.set_buffer_transform and set_buffer_scale */
+  if (surface->pending.buffer_transform != surface->buffer_transform ||
+      surface->pending.buffer_scale != surface->buffer_scale)
+    {
+      surface->buffer_transform = surface->pending.buffer_transform;
+      surface->buffer_scale = surface->pending.buffer_scale;
+      /* The source rectangle has to be checked against the new size */
+      surface->pending.viewport_changed = TRUE;
+      geometry_changed = TRUE;
+    }
+
+  /* wp_viewport. The buffer transform, scale and viewport change the
+   * size of the surface so they are applied before the role sees
+   * it. */
+  if (!clayland_viewport_commit (surface))
+    return;
+  if (geometry_changed || newly_attached)
+    surface_update_actor_geometry (surface);
+  if (geometry_changed && !wl_list_empty (&surface->stack_link))
+    clayland_compositor_damage_window (compositor, surface);
+
+  if (surface->configure)
+    surface->configure (surface, surface->pending.sx, surface->pending.sy);
+
   if (surface->pending.buffer)
     {
       wl_list_remove (&surface->pending.buffer_destroy_listener.link);
@@ -456,16 +820,101 @@ clayland_surface_commit (struct wl_client *client,
   surface->pending.sy = 0;
   surface->pending.newly_attached = FALSE;
 
-  /* wl_surface.damage */
-  if (surface->buffer_ref.buffer &&
-      surface->actor)
-    surface_damaged (surface, surface->pending.damage);
+  if (surface->shell_surface)
+    shell_surface_commit (surface->shell_surface,
+                          newly_attached,
+                          old_width, old_height);
+
+  /* A new window may be stacked above the fullscreen one or the
+   * fullscreen surface may have changed size */
+  if (created_actor ||
+      (surface->shell_surface && surface->shell_surface->fullscreen))
+    clayland_compositor_update_fullscreen (compositor);
+
+  /* The headless renderer only repaints what was damaged so a window
+   * that changed size has to be repainted along with what it
+   * uncovered */
+  if (compositor->headless && !wl_list_empty (&surface->stack_link))
+    {
+      float width, height;
+
+      clayland_surface_get_size (surface, &width, &height);
+      if (width != old_width || height != old_height)
+        {
+          damage_stage_area (compositor, old_x, old_y, old_width, old_height);
+          clayland_compositor_damage_window (compositor, surface);
+        }
+    }
+
+  /* A client that doesn't answer pings may still be committing from
+   * another thread. Don't spend any time uploading or painting its
+   * updates and don't send it frame events it won't read until it's
+   * back. */
+  if (surface->client->unresponsive)
+    {
+      if (damaged && surface->buffer_ref.buffer)
+        {
+          buffer_damage =
+            surface_get_buffer_damage (surface,
+                                       surface->pending.damage,
+                                       surface->pending.buffer_damage);
+          cairo_region_union (surface->held_damage, buffer_damage);
+          cairo_region_destroy (buffer_damage);
+        }
+      empty_region (surface->pending.damage);
+      empty_region (surface->pending.buffer_damage);
+
+      wl_list_insert_list (&surface->held_frame_callback_list,
+                           &surface->pending.frame_callback_list);
+      wl_list_init (&surface->pending.frame_callback_list);
+
+      return;
+    }
+
+  /* wl_surface.damage and damage_buffer. Both are merged in buffer
+   * pixels now that the transform, scale and viewport of this commit
+   * are known. */
+  if (damaged && surface->buffer_ref.buffer)
+    {
+      buffer_damage =
+        surface_get_buffer_damage (surface,
+                                   surface->pending.damage,
+                                   surface->pending.buffer_damage);
+      surface_damaged (surface, buffer_damage);
+      cairo_region_destroy (buffer_damage);
+    }
   empty_region (surface->pending.damage);
+  empty_region (surface->pending.buffer_damage);
 
   /* wl_surface.frame */
-  wl_list_insert_list (&compositor->frame_callbacks,
+  if (wl_list_empty (&surface->pending.frame_callback_list))
+    return;
+
+  if (compositor->fullscreen_surface &&
+      compositor->fullscreen_surface->surface == surface &&
+      compositor->fullscreen_surface->framerate)
+    {
+      wl_list_insert_list (&compositor->fullscreen_frame_callbacks,
+                           &surface->pending.frame_callback_list);
+      wl_list_init (&surface->pending.frame_callback_list);
+      return;
+    }
+
+  output = clayland_compositor_get_surface_output (compositor, surface);
+  wl_list_insert_list (&output->frame_callbacks,
                        &surface->pending.frame_callback_list);
   wl_list_init (&surface->pending.frame_callback_list);
+
+  /* Commits that only ask for a frame callback don't cause a redraw.
+   * The headless frame clock ticks without painting when there is no
+   * damage. Clutter only paints when something was damaged so if no
+   * frame is coming the callbacks are paced by the output instead. */
+  if (compositor->headless)
+    clayland_headless_schedule_frame (compositor->headless, output);
+  else if (!newly_attached && !damaged &&
+           !clutter_stage_is_redraw_queued
+             (CLUTTER_STAGE (compositor->stage)))
+    output_pace_frame_callbacks (output);
 }
 
 static void
@@ -473,6 +922,36 @@ clayland_surface_set_buffer_transform (struct wl_client *client,
                                        struct wl_resource *resource,
                                        int32_t transform)
 {
+  ClaylandSurface *surface = wl_resource_get_user_data (resource);
+
+  if (transform < WL_OUTPUT_TRANSFORM_NORMAL ||
+      transform > WL_OUTPUT_TRANSFORM_FLIPPED_270)
+    {
+      wl_resource_post_error (resource,
+                              WL_SURFACE_ERROR_INVALID_TRANSFORM,
+                              "invalid buffer transform %d", transform);
+      return;
+    }
+
+  surface->pending.buffer_transform = transform;
+}
+
+static void
+clayland_surface_set_buffer_scale (struct wl_client *client,
+                                   struct wl_resource *resource,
+                                   int32_t scale)
+{
+  ClaylandSurface *surface = wl_resource_get_user_data (resource);
+
+  if (scale < 1)
+    {
+      wl_resource_post_error (resource,
+                              WL_SURFACE_ERROR_INVALID_SCALE,
+                              "invalid buffer scale %d", scale);
+      return;
+    }
+
+  surface->pending.buffer_scale = scale;
 }
 
 const struct wl_surface_interface clayland_surface_interface = {
@@ -483,11 +962,11 @@ const struct wl_surface_interface clayland_surface_interface = {
   clayland_surface_set_opaque_region,
   clayland_surface_set_input_region,
   clayland_surface_commit,
-  clayland_surface_set_buffer_transform
+  clayland_surface_set_buffer_transform,
+  clayland_surface_set_buffer_scale,
+  clayland_surface_damage_buffer
 };
 
-/* This should be called whenever the window stacking changes to
-   update the current position on all of the input devices */
 void
 clayland_compositor_repick (ClaylandCompositor *compositor)
 {
@@ -496,272 +975,1351 @@ clayland_compositor_repick (ClaylandCompositor *compositor)
                         NULL);
 }
 
-static void
-clayland_surface_free (ClaylandSurface *surface)
+void
+clayland_compositor_queue_redraw (ClaylandCompositor *compositor)
 {
-  ClaylandCompositor *compositor = surface->compositor;
-  ClaylandFrameCallback *cb, *next;
-
-  compositor->surfaces = g_list_remove (compositor->surfaces, surface);
+  if (compositor->headless)
+    clayland_headless_queue_redraw (compositor->headless);
+  else
+    clutter_actor_queue_redraw (compositor->stage);
+}
 
-  clayland_buffer_reference (&surface->buffer_ref, NULL);
+void
+clayland_compositor_damage_window (ClaylandCompositor *compositor,
+                                   ClaylandSurface *surface)
+{
+  float width, height;
 
   if (surface->actor)
-    clutter_actor_destroy (surface->actor);
+    clutter_actor_queue_redraw (surface->actor);
+  else
+    {
+      clayland_surface_get_size (surface, &width, &height);
+      damage_stage_area (compositor, surface->x, surface->y, width, height);
+    }
+}
 
-  if (surface->pending.buffer)
-    wl_list_remove (&surface->pending.buffer_destroy_listener.link);
+void
+clayland_surface_set_position (ClaylandSurface *surface,
+                               int x,
+                               int y)
+{
+  ClaylandCompositor *compositor = surface->compositor;
 
-  cairo_region_destroy (surface->pending.damage);
+  if (surface->x == x && surface->y == y)
+    return;
 
-  wl_list_for_each_safe (cb, next,
-                         &surface->pending.frame_callback_list, link)
-    wl_resource_destroy (cb->resource);
+  /* Clutter repaints where the actor was and is itself */
+  if (!surface->actor && !wl_list_empty (&surface->stack_link))
+    clayland_compositor_damage_window (compositor, surface);
 
-  g_slice_free (ClaylandSurface, surface);
+  surface->x = x;
+  surface->y = y;
 
-  clayland_compositor_repick (compositor);
+  if (surface->actor)
+    clutter_actor_set_position (surface->actor, x, y);
+  else if (!wl_list_empty (&surface->stack_link))
+    clayland_compositor_damage_window (compositor, surface);
 }
 
-static void
-clayland_surface_resource_destroy_cb (struct wl_resource *resource)
+void
+clayland_surface_get_buffer_size (ClaylandSurface *surface,
+                                  float *width,
+                                  float *height)
 {
-  ClaylandSurface *surface = wl_resource_get_user_data (resource);
-  clayland_surface_free (surface);
-}
+  struct wl_shm_buffer *shm_buffer;
+  CoglTexture *texture;
 
-static void
-surface_handle_pending_buffer_destroy (struct wl_listener *listener,
-                                       void *data)
-{
-  ClaylandSurface *surface =
-    wl_container_of (listener, surface, pending.buffer_destroy_listener);
+  *width = 0;
+  *height = 0;
 
-  surface->pending.buffer = NULL;
+  /* The size of the actor is changed by the viewport so the buffer's
+   * is taken from its texture */
+  if (surface->actor)
+    {
+      texture = clutter_wayland_surface_get_cogl_texture
+        (CLUTTER_WAYLAND_SURFACE (surface->actor));
+      if (texture)
+        {
+          *width = cogl_texture_get_width (texture);
+          *height = cogl_texture_get_height (texture);
+        }
+    }
+  else if (surface->buffer_ref.buffer &&
+           (shm_buffer =
+            wl_shm_buffer_get (surface->buffer_ref.buffer->resource)))
+    {
+      *width = wl_shm_buffer_get_width (shm_buffer);
+      *height = wl_shm_buffer_get_height (shm_buffer);
+    }
 }
 
-static void
-clayland_compositor_create_surface (struct wl_client *wayland_client,
-                                    struct wl_resource *compositor_resource,
-                                    guint32 id)
+void
+clayland_surface_get_scaled_buffer_size (ClaylandSurface *surface,
+                                         float *width,
+                                         float *height)
 {
-  ClaylandCompositor *compositor =
-    wl_resource_get_user_data (compositor_resource);
-  ClaylandSurface *surface = g_slice_new0 (ClaylandSurface);
+  float buffer_width, buffer_height;
 
-  surface->compositor = compositor;
+  clayland_surface_get_buffer_size (surface, &buffer_width, &buffer_height);
 
-  wl_signal_init (&surface->destroy_signal);
+  switch (surface->buffer_transform)
+    {
+    case WL_OUTPUT_TRANSFORM_90:
+    case WL_OUTPUT_TRANSFORM_270:
+    case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+    case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+      *width = buffer_height / surface->buffer_scale;
+      *height = buffer_width / surface->buffer_scale;
+      break;
+    default:
+      *width = buffer_width / surface->buffer_scale;
+      *height = buffer_height / surface->buffer_scale;
+      break;
+    }
+}
 
-  surface->resource = wl_client_add_object (wayland_client,
-                                            &wl_surface_interface,
-                                            &clayland_surface_interface,
-                                            id,
-                                            surface);
-  wl_resource_set_destructor (surface->resource,
-                              clayland_surface_resource_destroy_cb);
+void
+clayland_surface_get_size (ClaylandSurface *surface,
+                           float *width,
+                           float *height)
+{
+  ClaylandViewportState *viewport = &surface->viewport;
 
-  surface->pending.damage = cairo_region_create ();
+  clayland_surface_get_scaled_buffer_size (surface, width, height);
 
-  surface->pending.buffer_destroy_listener.notify =
-    surface_handle_pending_buffer_destroy;
-  wl_list_init (&surface->pending.frame_callback_list);
+  /* Nothing is shown without a buffer whatever the viewport says */
+  if (*width <= 0 || *height <= 0)
+    return;
 
-  compositor->surfaces = g_list_prepend (compositor->surfaces, surface);
+  if (viewport->dst_width > 0)
+    {
+      *width = viewport->dst_width;
+      *height = viewport->dst_height;
+    }
+  else if (viewport->src_width >= 0)
+    {
+      *width = viewport->src_width;
+      *height = viewport->src_height;
+    }
 }
 
-static void
-clayland_region_destroy (struct wl_client *client,
-                         struct wl_resource *resource)
+void
+clayland_surface_get_buffer_matrix (ClaylandSurface *surface,
+                                    cairo_matrix_t *matrix)
 {
-  wl_resource_destroy (resource);
-}
+  ClaylandViewportState *viewport = &surface->viewport;
+  cairo_matrix_t step;
+  float width, height;
 
-static void
-clayland_region_add (struct wl_client *client,
-                     struct wl_resource *resource,
-                     gint32 x,
-                     gint32 y,
-                     gint32 width,
-                     gint32 height)
-{
-  ClaylandRegion *region = wl_resource_get_user_data (resource);
+  /* Buffer pixels to the buffer scaled down */
+  cairo_matrix_init_scale (matrix,
+                           1.0 / surface->buffer_scale,
+                           1.0 / surface->buffer_scale);
+
+  /* Undo the transform the client applied to its contents. width and
+   * height are the size once it's undone. */
+  clayland_surface_get_scaled_buffer_size (surface, &width, &height);
+
+  switch (surface->buffer_transform)
+    {
+    default:
+    case WL_OUTPUT_TRANSFORM_NORMAL:
+      cairo_matrix_init_identity (&step);
+      break;
+    case WL_OUTPUT_TRANSFORM_90:
+      cairo_matrix_init (&step, 0, 1, -1, 0, width, 0);
+      break;
+    case WL_OUTPUT_TRANSFORM_180:
+      cairo_matrix_init (&step, -1, 0, 0, -1, width, height);
+      break;
+    case WL_OUTPUT_TRANSFORM_270:
+      cairo_matrix_init (&step, 0, -1, 1, 0, 0, height);
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED:
+      cairo_matrix_init (&step, -1, 0, 0, 1, width, 0);
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+      cairo_matrix_init (&step, 0, 1, 1, 0, 0, 0);
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+      cairo_matrix_init (&step, 1, 0, 0, -1, 0, height);
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+      cairo_matrix_init (&step, 0, -1, -1, 0, width, height);
+      break;
+    }
+  cairo_matrix_multiply (matrix, matrix, &step);
+
+  if (!clayland_viewport_state_is_set (viewport) || width <= 0 || height <= 0)
+    return;
+
+  /* Crop and scale to the viewport */
+  clayland_surface_get_size (surface, &width, &height);
+  if (viewport->src_width >= 0)
+    {
+      cairo_matrix_init_translate (&step, -viewport->src_x, -viewport->src_y);
+      cairo_matrix_multiply (matrix, matrix, &step);
+      cairo_matrix_init_scale (&step,
+                               width / viewport->src_width,
+                               height / viewport->src_height);
+    }
+  else
+    {
+      float scaled_width, scaled_height;
+
+      clayland_surface_get_scaled_buffer_size (surface,
+                                               &scaled_width,
+                                               &scaled_height);
+      cairo_matrix_init_scale (&step,
+                               width / scaled_width,
+                               height / scaled_height);
+    }
+  cairo_matrix_multiply (matrix, matrix, &step);
+}
+
+static void
+clayland_surface_free (ClaylandSurface *surface)
+{
+  ClaylandCompositor *compositor = surface->compositor;
+  ClaylandFrameCallback *cb, *next;
+
+  compositor->surfaces = g_list_remove (compositor->surfaces, surface);
+
+  /* This also repicks if the pointer was on the surface. The buffer
+   * is still needed to know what area it uncovers. */
+  clayland_stack_remove_window (compositor, surface);
+
+  clayland_buffer_reference (&surface->buffer_ref, NULL);
+
+  if (surface->actor)
+    clutter_actor_destroy (surface->actor);
+  else if (compositor->headless)
+    clayland_headless_surface_destroyed (compositor->headless, surface);
+
+  clayland_viewport_surface_destroyed (surface);
+
+  if (surface->pending.buffer)
+    wl_list_remove (&surface->pending.buffer_destroy_listener.link);
+
+  cairo_region_destroy (surface->pending.damage);
+  cairo_region_destroy (surface->pending.buffer_damage);
+  cairo_region_destroy (surface->held_damage);
+
+  if (surface->pending.opaque_region)
+    cairo_region_destroy (surface->pending.opaque_region);
+  if (surface->opaque_region)
+    cairo_region_destroy (surface->opaque_region);
+
+  wl_list_for_each_safe (cb, next,
+                         &surface->pending.frame_callback_list, link)
+    wl_resource_destroy (cb->resource);
+  wl_list_for_each_safe (cb, next,
+                         &surface->held_frame_callback_list, link)
+    wl_resource_destroy (cb->resource);
+
+  g_slice_free (ClaylandSurface, surface);
+}
+
+static void
+clayland_surface_resource_destroy_cb (struct wl_resource *resource)
+{
+  ClaylandSurface *surface = wl_resource_get_user_data (resource);
+  clayland_surface_free (surface);
+}
+
+static void
+surface_handle_pending_buffer_destroy (struct wl_listener *listener,
+                                       void *data)
+{
+  ClaylandSurface *surface =
+    wl_container_of (listener, surface, pending.buffer_destroy_listener);
+
+  surface->pending.buffer = NULL;
+}
+
+static void
+clayland_client_destroy_cb (struct wl_listener *listener,
+                            void *data)
+{
+  ClaylandClient *client = wl_container_of (listener, client,
+                                            destroy_listener);
+  GList *l;
+
+  /* This is called before the client's resources are destroyed so its
+   * surfaces are still around and have to forget about it */
+  for (l = client->compositor->surfaces; l; l = l->next)
+    {
+      ClaylandSurface *surface = l->data;
+
+      if (surface->client == client)
+        surface->client = NULL;
+    }
+
+  g_hash_table_remove (client->compositor->clients, client->wayland_client);
+  g_slice_free (ClaylandClient, client);
+}
+
+static ClaylandClient *
+clayland_client_get (ClaylandCompositor *compositor,
+                     struct wl_client *wayland_client)
+{
+  ClaylandClient *client;
+
+  client = g_hash_table_lookup (compositor->clients, wayland_client);
+  if (client)
+    return client;
+
+  client = g_slice_new0 (ClaylandClient);
+  client->wayland_client = wayland_client;
+  client->compositor = compositor;
+  client->pong_latency = -1;
+
+  client->destroy_listener.notify = clayland_client_destroy_cb;
+  wl_client_add_destroy_listener (wayland_client, &client->destroy_listener);
+
+  g_hash_table_insert (compositor->clients, wayland_client, client);
+
+  return client;
+}
+
+static void
+clayland_client_set_unresponsive (ClaylandClient *client,
+                                  gboolean unresponsive)
+{
+  ClaylandCompositor *compositor = client->compositor;
+  ClaylandOutput *output;
+  GList *l;
+
+  if (client->unresponsive == unresponsive)
+    return;
+
+  client->unresponsive = unresponsive;
+
+  if (unresponsive)
+    g_debug ("Client %p is not responding", client->wayland_client);
+  else
+    g_debug ("Client %p is responding again after %" G_GINT64_FORMAT "ms",
+             client->wayland_client, client->pong_latency / 1000);
+
+  for (l = compositor->surfaces; l; l = l->next)
+    {
+      ClaylandSurface *surface = l->data;
+
+      if (surface->client != client)
+        continue;
+
+      /* Dim the windows of hung clients */
+      if (surface->actor)
+        clutter_actor_set_opacity (surface->actor, unresponsive ? 160 : 255);
+
+      if (unresponsive)
+        continue;
+
+      /* Catch up with whatever the client committed while it was
+       * considered hung. Attaching uploads the whole buffer so the
+       * damage isn't needed then. */
+      if (surface->held_attach && surface->actor &&
+          surface->buffer_ref.buffer)
+        surface_attach_actor_buffer (surface);
+      else if (surface->buffer_ref.buffer)
+        surface_damaged (surface, surface->held_damage);
+      surface->held_attach = FALSE;
+      empty_region (surface->held_damage);
+
+      output = clayland_compositor_get_surface_output (compositor, surface);
+      wl_list_insert_list (&output->frame_callbacks,
+                           &surface->held_frame_callback_list);
+      wl_list_init (&surface->held_frame_callback_list);
+    }
+
+  if (!unresponsive)
+    clayland_compositor_queue_redraw (compositor);
+
+  wl_signal_emit (&compositor->client_unresponsive_signal,
+                  client->wayland_client);
+}
+
+gboolean
+clayland_compositor_client_is_unresponsive (ClaylandCompositor *compositor,
+                                            struct wl_client *wayland_client)
+{
+  ClaylandClient *client =
+    g_hash_table_lookup (compositor->clients, wayland_client);
+
+  return client && client->unresponsive;
+}
+
+void
+clayland_compositor_client_pong (ClaylandCompositor *compositor,
+                                 struct wl_client *wayland_client,
+                                 guint32 serial)
+{
+  ClaylandClient *client =
+    g_hash_table_lookup (compositor->clients, wayland_client);
+
+  if (!client || client->ping_serial != serial)
+    return;
+
+  client->pong_latency = g_get_monotonic_time () - client->ping_time;
+  client->ping_serial = 0;
+
+  clayland_client_set_unresponsive (client, FALSE);
+}
+
+static int
+ping_timer_cb (void *data)
+{
+  ClaylandCompositor *compositor = data;
+  GList *l;
+
+  for (l = compositor->surfaces; l; l = l->next)
+    {
+      ClaylandSurface *surface = l->data;
+      ClaylandClient *client = surface->client;
+
+      if (!surface->ping)
+        continue;
+
+      /* Each client only gets pinged once per round */
+      if (client->ping_serial)
+        {
+          if (g_get_monotonic_time () - client->ping_time >=
+              PING_INTERVAL * 1000)
+            clayland_client_set_unresponsive (client, TRUE);
+          continue;
+        }
+
+      client->ping_serial =
+        wl_display_next_serial (compositor->wayland_display);
+      client->ping_time = g_get_monotonic_time ();
+      surface->ping (surface, client->ping_serial);
+    }
+
+  wl_event_source_timer_update (compositor->ping_timer, PING_INTERVAL);
+
+  return 0;
+}
+
+static void
+clayland_compositor_create_surface (struct wl_client *wayland_client,
+                                    struct wl_resource *compositor_resource,
+                                    guint32 id)
+{
+  ClaylandCompositor *compositor =
+    wl_resource_get_user_data (compositor_resource);
+  ClaylandSurface *surface = g_slice_new0 (ClaylandSurface);
+
+  surface->compositor = compositor;
+  surface->client = clayland_client_get (compositor, wayland_client);
+
+  wl_signal_init (&surface->destroy_signal);
+  wl_list_init (&surface->stack_link);
+
+  surface->resource =
+    wl_resource_create (wayland_client, &wl_surface_interface,
+                        wl_resource_get_version (compositor_resource), id);
+  wl_resource_set_implementation (surface->resource,
+                                  &clayland_surface_interface,
+                                  surface,
+                                  clayland_surface_resource_destroy_cb);
+
+  surface->pending.damage = cairo_region_create ();
+  surface->pending.buffer_damage = cairo_region_create ();
+  surface->held_damage = cairo_region_create ();
+  surface->buffer_scale = 1;
+  surface->pending.buffer_scale = 1;
+  clayland_viewport_state_init (&surface->viewport);
+  clayland_viewport_state_init (&surface->pending.viewport);
+  wl_list_init (&surface->held_frame_callback_list);
+
+  surface->pending.buffer_destroy_listener.notify =
+    surface_handle_pending_buffer_destroy;
+  wl_list_init (&surface->pending.frame_callback_list);
+
+  compositor->surfaces = g_list_prepend (compositor->surfaces, surface);
+}
+
+static void
+clayland_region_destroy (struct wl_client *client,
+                         struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+clayland_region_add (struct wl_client *client,
+                     struct wl_resource *resource,
+                     gint32 x,
+                     gint32 y,
+                     gint32 width,
+                     gint32 height)
+{
+  ClaylandRegion *region = wl_resource_get_user_data (resource);
+  cairo_rectangle_int_t rectangle = { x, y, width, height };
+
+  cairo_region_union_rectangle (region->region, &rectangle);
+}
+
+static void
+clayland_region_subtract (struct wl_client *client,
+                     struct wl_resource *resource,
+                     gint32 x,
+                     gint32 y,
+                     gint32 width,
+                     gint32 height)
+{
+  ClaylandRegion *region = wl_resource_get_user_data (resource);
   cairo_rectangle_int_t rectangle = { x, y, width, height };
 
-  cairo_region_union_rectangle (region->region, &rectangle);
+  cairo_region_subtract_rectangle (region->region, &rectangle);
+}
+
+const struct wl_region_interface clayland_region_interface = {
+  clayland_region_destroy,
+  clayland_region_add,
+  clayland_region_subtract
+};
+
+static void
+clayland_region_resource_destroy_cb (struct wl_resource *resource)
+{
+  ClaylandRegion *region = wl_resource_get_user_data (resource);
+
+  cairo_region_destroy (region->region);
+  clayland_arena_free (region);
+}
+
+static void
+clayland_compositor_create_region (struct wl_client *wayland_client,
+                                   struct wl_resource *compositor_resource,
+                                   uint32_t id)
+{
+  ClaylandRegion *region = clayland_arena_new0 (wayland_client,
+                                                ClaylandRegion);
+
+  region->resource = wl_client_add_object (wayland_client,
+                                           &wl_region_interface,
+                                           &clayland_region_interface,
+                                           id,
+                                           region);
+  wl_resource_set_destructor (region->resource,
+                              clayland_region_resource_destroy_cb);
+
+  region->region = cairo_region_create ();
+}
+
+static void
+output_send_mode (ClaylandOutput *output,
+                  struct wl_resource *resource,
+                  ClaylandMode *mode)
+{
+  wl_output_send_mode (resource,
+                       mode->flags |
+                       (mode == output->current_mode ?
+                        WL_OUTPUT_MODE_CURRENT : 0),
+                       mode->width,
+                       mode->height,
+                       mode->refresh);
+}
+
+static void
+output_send_geometry (ClaylandOutput *output,
+                      struct wl_resource *resource)
+{
+  wl_output_send_geometry (resource,
+                           output->x, output->y,
+                           output->width_mm,
+                           output->height_mm,
+                           WL_OUTPUT_SUBPIXEL_UNKNOWN,
+                           "unknown", /* make */
+                           "unknown", /* model */
+                           WL_OUTPUT_TRANSFORM_NORMAL);
+}
+
+static void
+unbind_output (struct wl_resource *resource)
+{
+  wl_list_remove (wl_resource_get_link (resource));
+}
+
+static void
+bind_output (struct wl_client *client,
+             void *data,
+             guint32 version,
+             guint32 id)
+{
+  ClaylandOutput *output = data;
+  struct wl_resource *resource;
+  GList *l;
+
+  resource = wl_resource_create (client, &wl_output_interface,
+                                 MIN (version, OUTPUT_VERSION), id);
+  wl_resource_set_implementation (resource, NULL, output, unbind_output);
+  wl_list_insert (&output->resource_list, wl_resource_get_link (resource));
+
+  output_send_geometry (output, resource);
+
+  for (l = output->modes; l; l = l->next)
+    output_send_mode (output, resource, l->data);
+
+  if (version >= WL_OUTPUT_SCALE_SINCE_VERSION)
+    wl_output_send_scale (resource, 1);
+
+  if (version >= WL_OUTPUT_DONE_SINCE_VERSION)
+    wl_output_send_done (resource);
+}
+
+static void
+update_stage_size (ClaylandCompositor *compositor)
+{
+  float width = 0, height = 0;
+  GList *l;
+
+  if (!compositor->stage)
+    return;
+
+  /* The stage covers all of the outputs */
+  for (l = compositor->outputs; l; l = l->next)
+    {
+      ClaylandOutput *output = l->data;
+
+      width = MAX (width, output->x + output->width);
+      height = MAX (height, output->y + output->height);
+    }
+
+  clutter_actor_set_size (compositor->stage, width, height);
+}
+
+static int output_frame_timer_cb (void *data);
+
+/* Takes ownership of the modes. The first one is the preferred mode
+   and the output starts with it. */
+static void
+clayland_compositor_create_output (ClaylandCompositor *compositor,
+                                   int x,
+                                   int y,
+                                   int width_mm,
+                                   int height_mm,
+                                   GList *modes)
+{
+  ClaylandOutput *output = g_slice_new0 (ClaylandOutput);
+  ClaylandMode *mode = modes->data;
+
+  output->compositor = compositor;
+  wl_list_init (&output->resource_list);
+  output->x = x;
+  output->y = y;
+  output->width = mode->width;
+  output->height = mode->height;
+  output->width_mm = width_mm;
+  output->height_mm = height_mm;
+  output->refresh = mode->refresh;
+  output->modes = modes;
+  output->current_mode = mode;
+  mode->flags |= WL_OUTPUT_MODE_PREFERRED;
+
+  wl_list_init (&output->frame_callbacks);
+  output->frame_timer = wl_event_loop_add_timer (compositor->wayland_loop,
+                                                 output_frame_timer_cb,
+                                                 output);
+
+  output->global = wl_global_create (compositor->wayland_display,
+                                     &wl_output_interface,
+                                     OUTPUT_VERSION,
+                                     output,
+                                     bind_output);
+  if (output->global == NULL)
+    g_error ("Failed to register a global output object");
+
+  compositor->outputs = g_list_append (compositor->outputs, output);
+}
+
+void
+clayland_output_set_mode (ClaylandOutput *output,
+                          ClaylandMode *mode)
+{
+  ClaylandCompositor *compositor = output->compositor;
+  struct wl_resource *resource;
+
+  if (mode == output->current_mode)
+    return;
+
+  output->current_mode = mode;
+  output->width = mode->width;
+  output->height = mode->height;
+  output->refresh = mode->refresh;
+
+  /* Only what's on the output is touched. The stage is resized in
+   * place and the renderer keeps everything else it has. */
+  update_stage_size (compositor);
+  if (compositor->headless)
+    clayland_headless_output_changed (compositor->headless, output);
+  else
+    clayland_compositor_queue_redraw (compositor);
+
+  wl_resource_for_each (resource, &output->resource_list)
+    {
+      output_send_geometry (output, resource);
+      output_send_mode (output, resource, mode);
+
+      if (wl_resource_get_version (resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
+        wl_output_send_done (resource);
+    }
+
+  shell_output_changed (compositor, output);
+  wl_signal_emit (&compositor->output_changed_signal, output);
+
+  clayland_compositor_update_fullscreen (compositor);
+  clayland_compositor_repick (compositor);
+}
+
+static void
+clayland_output_free (ClaylandOutput *output)
+{
+  wl_global_destroy (output->global);
+  wl_event_source_remove (output->frame_timer);
+  g_list_free_full (output->modes, g_free);
+
+  g_slice_free (ClaylandOutput, output);
+}
+
+ClaylandOutput *
+clayland_compositor_get_surface_output (ClaylandCompositor *compositor,
+                                        ClaylandSurface *surface)
+{
+  ClaylandOutput *best = compositor->outputs->data;
+  int best_area = 0;
+  float width, height;
+  GList *l;
+
+  /* Most setups only have the one */
+  if (compositor->outputs->next == NULL)
+    return best;
+
+  clayland_surface_get_size (surface, &width, &height);
+
+  for (l = compositor->outputs; l; l = l->next)
+    {
+      ClaylandOutput *output = l->data;
+      cairo_rectangle_int_t rectangle = { surface->x, surface->y,
+                                          width, height };
+      int x1 = MAX (rectangle.x, output->x);
+      int y1 = MAX (rectangle.y, output->y);
+      int x2 = MIN (rectangle.x + rectangle.width,
+                    output->x + output->width);
+      int y2 = MIN (rectangle.y + rectangle.height,
+                    output->y + output->height);
+
+      if (x2 > x1 && y2 > y1 && (x2 - x1) * (y2 - y1) > best_area)
+        {
+          best = output;
+          best_area = (x2 - x1) * (y2 - y1);
+        }
+    }
+
+  return best;
+}
+
+ClaylandOutput *
+clayland_compositor_get_output_at (ClaylandCompositor *compositor,
+                                   int x,
+                                   int y)
+{
+  GList *l;
+
+  for (l = compositor->outputs; l; l = l->next)
+    {
+      ClaylandOutput *output = l->data;
+
+      if (x >= output->x && x < output->x + output->width &&
+          y >= output->y && y < output->y + output->height)
+        return output;
+    }
+
+  return compositor->outputs->data;
+}
+
+const static struct wl_compositor_interface clayland_compositor_interface = {
+  clayland_compositor_create_surface,
+  clayland_compositor_create_region
+};
+
+static void
+shell_surface_send_pending_configure (ClaylandShellSurface *shell_surface)
+{
+  wl_shell_surface_send_configure (shell_surface->resource,
+                                   shell_surface->pending_configure.edges,
+                                   shell_surface->pending_configure.width,
+                                   shell_surface->pending_configure.height);
+
+  shell_surface->configure_in_flight = TRUE;
+  shell_surface->configure_pending = FALSE;
+}
+
+static void
+send_frame_callbacks (struct wl_list *frame_callbacks)
+{
+  guint32 time = get_time ();
+
+  while (!wl_list_empty (frame_callbacks))
+    {
+      ClaylandFrameCallback *callback =
+        wl_container_of (frame_callbacks->next, callback, link);
+
+      wl_resource_post_event (callback->resource, WL_CALLBACK_DONE, time);
+      wl_resource_destroy (callback->resource);
+    }
+}
+
+static int
+fullscreen_frame_timer_cb (void *data)
+{
+  ClaylandCompositor *compositor = data;
+
+  compositor->fullscreen_last_frame = g_get_monotonic_time ();
+  send_frame_callbacks (&compositor->fullscreen_frame_callbacks);
+
+  return 0;
+}
+
+static int
+output_frame_timer_cb (void *data)
+{
+  ClaylandOutput *output = data;
+
+  output->frame_timer_armed = FALSE;
+  output->last_frame = g_get_monotonic_time ();
+  send_frame_callbacks (&output->frame_callbacks);
+
+  return 0;
+}
+
+/* Sends the frame callbacks of the output now if it has been at least
+   a refresh interval since the last ones, or else when it will have
+   been, unless the timer is already pending. The stage may be painted
+   faster than a slow output refreshes, and nothing gets painted for
+   commits that only ask for a frame callback. */
+static void
+output_pace_frame_callbacks (ClaylandOutput *output)
+{
+  gint64 interval, elapsed;
+
+  if (wl_list_empty (&output->frame_callbacks))
+    return;
+
+  /* The refresh rate is in mHz. A frame is allowed to come a little
+   * early so that jitter in the stage's own clock doesn't make the
+   * callbacks miss every other frame of an output at the same rate. */
+  interval = G_GINT64_CONSTANT (1000000000) / output->refresh;
+  elapsed = g_get_monotonic_time () - output->last_frame;
+
+  if (elapsed >= interval - interval / 8)
+    {
+      wl_event_source_timer_update (output->frame_timer, 0);
+      output_frame_timer_cb (output);
+    }
+  else if (!output->frame_timer_armed)
+    {
+      /* Re-arming the timer on every commit would keep pushing the
+       * callbacks back for a client that commits faster than that */
+      wl_event_source_timer_update (output->frame_timer,
+                                    (interval - elapsed + 999) / 1000);
+      output->frame_timer_armed = TRUE;
+    }
+}
+
+static void
+pace_fullscreen_frame_callbacks (ClaylandCompositor *compositor)
+{
+  ClaylandShellSurface *shell_surface = compositor->fullscreen_surface;
+  gint64 interval, elapsed;
+
+  if (wl_list_empty (&compositor->fullscreen_frame_callbacks))
+    return;
+
+  /* The framerate is in mHz */
+  interval = G_GINT64_CONSTANT (1000000000) / shell_surface->framerate;
+  elapsed = g_get_monotonic_time () - compositor->fullscreen_last_frame;
+
+  if (elapsed >= interval)
+    fullscreen_frame_timer_cb (compositor);
+  else
+    wl_event_source_timer_update (compositor->fullscreen_frame_timer,
+                                  (interval - elapsed + 999) / 1000);
+}
+
+void
+clayland_compositor_finish_frame (ClaylandCompositor *compositor,
+                                  ClaylandOutput *output)
+{
+  GList *l;
+
+  while (!wl_list_empty (&compositor->shell_configure_list))
+    {
+      ClaylandShellSurface *shell_surface =
+        wl_container_of (compositor->shell_configure_list.next,
+                         shell_surface, configure_link);
+
+      wl_list_remove (&shell_surface->configure_link);
+      wl_list_init (&shell_surface->configure_link);
+
+      shell_surface_send_pending_configure (shell_surface);
+    }
+
+  /* The headless renderer paints each output on its own clock so its
+   * frame was already paced. Clutter paints the whole stage on one
+   * clock which is only an upper bound for each output. */
+  if (output)
+    {
+      wl_event_source_timer_update (output->frame_timer, 0);
+      output_frame_timer_cb (output);
+    }
+  else
+    for (l = compositor->outputs; l; l = l->next)
+      output_pace_frame_callbacks (l->data);
+
+  wl_signal_emit (&compositor->frame_signal, compositor);
+
+  if (compositor->fullscreen_surface)
+    pace_fullscreen_frame_callbacks (compositor);
+}
+
+static void
+paint_finished_cb (ClutterActor *self, void *user_data)
+{
+  clayland_compositor_finish_frame (user_data, NULL);
+}
+
+static void
+compositor_bind (struct wl_client *client,
+		 void *data,
+                 guint32 version,
+                 guint32 id)
+{
+  ClaylandCompositor *compositor = data;
+  struct wl_resource *resource;
+
+  resource = wl_resource_create (client, &wl_compositor_interface,
+                                 MIN (version, COMPOSITOR_VERSION), id);
+  wl_resource_set_implementation (resource,
+                                  &clayland_compositor_interface,
+                                  compositor,
+                                  NULL);
+}
+
+static void
+shell_surface_pong (struct wl_client *client,
+                    struct wl_resource *resource,
+                    guint32 serial)
+{
+  ClaylandShellSurface *shell_surface = wl_resource_get_user_data (resource);
+
+  clayland_compositor_client_pong (shell_surface->compositor, client, serial);
+}
+
+static void
+shell_surface_ping (ClaylandSurface *surface,
+                    guint32 serial)
+{
+  wl_shell_surface_send_ping (surface->shell_surface->resource, serial);
+}
+
+static void
+shell_surface_request_configure (ClaylandShellSurface *shell_surface,
+                                 guint32 edges,
+                                 int32_t width,
+                                 int32_t height)
+{
+  shell_surface->pending_configure.edges = edges;
+  shell_surface->pending_configure.width = width;
+  shell_surface->pending_configure.height = height;
+
+  if (shell_surface->configure_in_flight)
+    shell_surface->configure_pending = TRUE;
+  else
+    shell_surface_send_pending_configure (shell_surface);
+}
+
+/* Whether the surface has been added to the stage as a window. Without
+ * Clutter the stacking is all there is. */
+static gboolean
+surface_is_on_stage (ClaylandSurface *surface)
+{
+  if (surface->actor)
+    return clutter_actor_get_parent (surface->actor) != NULL;
+
+  return !wl_list_empty (&surface->stack_link);
+}
+
+static void
+shell_surface_commit (ClaylandShellSurface *shell_surface,
+                      gboolean newly_attached,
+                      float old_width,
+                      float old_height)
+{
+  ClaylandSurface *surface = shell_surface->surface;
+  ClaylandCompositor *compositor = surface->compositor;
+  float width, height;
+
+  if ((!surface->actor && !surface->buffer_ref.buffer) || !newly_attached)
+    return;
+
+  if (shell_surface->fullscreen)
+    shell_surface_place_fullscreen (shell_surface);
+
+  if (shell_surface->popup)
+    shell_surface_place_popup (shell_surface);
+
+  clayland_surface_get_size (surface, &width, &height);
+
+  if (shell_surface->resize_edges &&
+      (width != old_width || height != old_height))
+    {
+      int x = surface->x, y = surface->y;
+
+      if (shell_surface->resize_edges & WL_SHELL_SURFACE_RESIZE_LEFT)
+        x += old_width - width;
+      if (shell_surface->resize_edges & WL_SHELL_SURFACE_RESIZE_TOP)
+        y += old_height - height;
+
+      clayland_surface_set_position (surface, x, y);
+    }
+
+  if (shell_surface->configure_in_flight)
+    {
+      shell_surface->configure_in_flight = FALSE;
+
+      if (shell_surface->configure_pending &&
+          wl_list_empty (&shell_surface->configure_link))
+        wl_list_insert (compositor->shell_configure_list.prev,
+                        &shell_surface->configure_link);
+    }
+
+  if (!shell_surface->grab &&
+      !shell_surface->configure_in_flight &&
+      !shell_surface->configure_pending)
+    shell_surface->resize_edges = 0;
+}
+
+static void
+shell_grab_end_cb (ClaylandWindowGrab *window_grab)
+{
+  ClaylandShellSurface *shell_surface = window_grab->data;
+
+  shell_surface->grab = NULL;
+}
+
+static void
+shell_grab_resize_cb (ClaylandWindowGrab *window_grab,
+                      int32_t width,
+                      int32_t height)
+{
+  shell_surface_request_configure (window_grab->data,
+                                   window_grab->edges,
+                                   MAX (width, 1),
+                                   MAX (height, 1));
+}
+
+static ClaylandWindowGrab *
+shell_grab_start (ClaylandShellSurface *shell_surface,
+                  ClaylandSeat *seat,
+                  guint32 serial,
+                  guint32 edges,
+                  int32_t width,
+                  int32_t height)
+{
+  ClaylandWindowGrab *window_grab;
+
+  if (shell_surface->grab || !shell_surface->surface->actor)
+    return NULL;
+
+  window_grab = clayland_window_grab_start (shell_surface->surface, seat,
+                                            serial, edges, width, height);
+  if (!window_grab)
+    return NULL;
+
+  window_grab->resize = shell_grab_resize_cb;
+  window_grab->end = shell_grab_end_cb;
+  window_grab->data = shell_surface;
+  shell_surface->grab = window_grab;
+
+  return window_grab;
+}
+
+static void
+shell_surface_move (struct wl_client *client,
+                    struct wl_resource *resource,
+                    struct wl_resource *seat_resource,
+                    guint32 serial)
+{
+  ClaylandShellSurface *shell_surface = wl_resource_get_user_data (resource);
+  ClaylandSeat *seat = wl_resource_get_user_data (seat_resource);
+
+  shell_grab_start (shell_surface, seat, serial, 0, 0, 0);
 }
 
 static void
-clayland_region_subtract (struct wl_client *client,
-                     struct wl_resource *resource,
-                     gint32 x,
-                     gint32 y,
-                     gint32 width,
-                     gint32 height)
+shell_surface_resize (struct wl_client *client,
+                      struct wl_resource *resource,
+                      struct wl_resource *seat_resource,
+                      guint32 serial,
+                      guint32 edges)
 {
-  ClaylandRegion *region = wl_resource_get_user_data (resource);
-  cairo_rectangle_int_t rectangle = { x, y, width, height };
+  ClaylandShellSurface *shell_surface = wl_resource_get_user_data (resource);
+  ClaylandSeat *seat = wl_resource_get_user_data (seat_resource);
+  float width, height;
 
-  cairo_region_subtract_rectangle (region->region, &rectangle);
-}
+  if (edges == WL_SHELL_SURFACE_RESIZE_NONE ||
+      edges > WL_SHELL_SURFACE_RESIZE_BOTTOM_RIGHT ||
+      (edges & 3) == 3 || (edges & 12) == 12)
+    return;
 
-const struct wl_region_interface clayland_region_interface = {
-  clayland_region_destroy,
-  clayland_region_add,
-  clayland_region_subtract
-};
+  clayland_surface_get_size (shell_surface->surface, &width, &height);
+  if (!shell_grab_start (shell_surface, seat, serial, edges, width, height))
+    return;
 
-static void
-clayland_region_resource_destroy_cb (struct wl_resource *resource)
+  shell_surface->resize_edges = edges;
+}
+
+static gboolean
+shell_surface_covers_output (ClaylandShellSurface *shell_surface)
 {
-  ClaylandRegion *region = wl_resource_get_user_data (resource);
+  ClaylandSurface *surface = shell_surface->surface;
+  ClaylandOutput *output = shell_surface->output;
+  cairo_rectangle_int_t rectangle;
+  gdouble scale_x = 1.0, scale_y = 1.0;
+  float x = surface->x, y = surface->y, width, height;
 
-  cairo_region_destroy (region->region);
-  g_slice_free (ClaylandRegion, region);
+  /* Windows on the other outputs still have to be painted */
+  if (!surface->opaque_region || shell_surface->compositor->outputs->next)
+    return FALSE;
+
+  clayland_surface_get_size (surface, &width, &height);
+  if (surface->actor)
+    clutter_actor_get_scale (surface->actor, &scale_x, &scale_y);
+
+  rectangle.x = 0;
+  rectangle.y = 0;
+  rectangle.width = width;
+  rectangle.height = height;
+  if (cairo_region_contains_rectangle (surface->opaque_region, &rectangle) !=
+      CAIRO_REGION_OVERLAP_IN)
+    return FALSE;
+
+  return (x <= output->x &&
+          y <= output->y &&
+          x + width * scale_x >= output->x + output->width &&
+          y + height * scale_y >= output->y + output->height);
 }
 
+/* This should be called whenever the stacking, the fullscreen state
+   or the geometry of a fullscreen surface changes */
 static void
-clayland_compositor_create_region (struct wl_client *wayland_client,
-                                   struct wl_resource *compositor_resource,
-                                   uint32_t id)
+clayland_compositor_update_fullscreen (ClaylandCompositor *compositor)
 {
-  ClaylandRegion *region = g_slice_new0 (ClaylandRegion);
+  ClaylandShellSurface *fullscreen_surface = NULL;
+  ClaylandSurface *surface;
+  ClutterActor *top = NULL, *actor;
 
-  region->resource = wl_client_add_object (wayland_client,
-                                           &wl_region_interface,
-                                           &clayland_region_interface,
-                                           id,
-                                           region);
-  wl_resource_set_destructor (region->resource,
-                              clayland_region_resource_destroy_cb);
+  surface = clayland_stack_get_top_window (compositor);
+  if (surface)
+    {
+      top = surface->actor;
 
-  region->region = cairo_region_create ();
+      if (surface->shell_surface &&
+          surface->shell_surface->fullscreen &&
+          shell_surface_covers_output (surface->shell_surface))
+        fullscreen_surface = surface->shell_surface;
+    }
+
+  if (fullscreen_surface == compositor->fullscreen_surface)
+    return;
+
+  /* Everything below an opaque fullscreen surface is hidden so that
+   * Clutter doesn't spend any time painting or picking it. The headless
+   * renderer checks for the fullscreen surface itself. */
+  for (actor = (compositor->stage ?
+                clutter_actor_get_first_child (compositor->stage) : NULL);
+       actor;
+       actor = clutter_actor_get_next_sibling (actor))
+    {
+      if (actor == compositor->seat->overlay)
+        continue;
+
+      if (fullscreen_surface && actor != top)
+        {
+          if (CLUTTER_ACTOR_IS_VISIBLE (actor))
+            {
+              g_object_set_data (G_OBJECT (actor),
+                                 "clayland-covered", GINT_TO_POINTER (TRUE));
+              clutter_actor_hide (actor);
+            }
+        }
+      else if (g_object_get_data (G_OBJECT (actor), "clayland-covered"))
+        {
+          g_object_set_data (G_OBJECT (actor), "clayland-covered", NULL);
+          clutter_actor_show (actor);
+        }
+    }
+
+  /* Callbacks that were waiting for the paced frame go back to the
+   * frame clock of the output */
+  if (compositor->fullscreen_surface)
+    {
+      ClaylandOutput *output = compositor->fullscreen_surface->output;
+
+      wl_list_insert_list (&output->frame_callbacks,
+                           &compositor->fullscreen_frame_callbacks);
+      wl_list_init (&compositor->fullscreen_frame_callbacks);
+      output_pace_frame_callbacks (output);
+    }
+  wl_event_source_timer_update (compositor->fullscreen_frame_timer, 0);
+
+  compositor->fullscreen_surface = fullscreen_surface;
+
+  clayland_compositor_queue_redraw (compositor);
 }
 
-static void
-bind_output (struct wl_client *client,
-             void *data,
-             guint32 version,
-             guint32 id)
+/* Finds the smallest mode of the output that is at least the given
+   size, or the preferred mode if there is none */
+static ClaylandMode *
+output_find_mode (ClaylandOutput *output,
+                  float width,
+                  float height)
 {
-  ClaylandOutput *output = data;
-  struct wl_resource *resource =
-    wl_client_add_object (client, &wl_output_interface, NULL, id, data);
+  ClaylandMode *best = NULL;
   GList *l;
 
-  wl_resource_post_event (resource,
-                          WL_OUTPUT_GEOMETRY,
-                          output->x, output->y,
-                          output->width_mm,
-                          output->height_mm,
-                          0, /* subpixel: unknown */
-                          "unknown", /* make */
-                          "unknown"); /* model */
-
   for (l = output->modes; l; l = l->next)
     {
       ClaylandMode *mode = l->data;
-      wl_resource_post_event (resource,
-                              WL_OUTPUT_MODE,
-                              mode->flags,
-                              mode->width,
-                              mode->height,
-                              mode->refresh);
+
+      if (mode->width < width || mode->height < height)
+        continue;
+
+      if (best == NULL ||
+          mode->width * mode->height < best->width * best->height)
+        best = mode;
     }
+
+  return best ? best : output->modes->data;
 }
 
+/* Scales and centers a fullscreen surface on its output in the
+   output's current mode */
 static void
-clayland_compositor_create_output (ClaylandCompositor *compositor,
-                                   int x,
-                                   int y,
-                                   int width_mm,
-                                   int height_mm)
+shell_surface_fit_fullscreen (ClaylandShellSurface *shell_surface)
 {
-  ClaylandOutput *output = g_slice_new0 (ClaylandOutput);
+  ClaylandOutput *output = shell_surface->output;
+  ClaylandSurface *surface = shell_surface->surface;
+  float width, height, scale = 1.0f;
 
-  output->wayland_output.interface = &wl_output_interface;
+  clayland_surface_get_size (surface, &width, &height);
+  if (width <= 0 || height <= 0)
+    return;
 
-  output->x = x;
-  output->y = y;
-  output->width_mm = width_mm;
-  output->height_mm = height_mm;
+  switch (shell_surface->fullscreen_method)
+    {
+      /* Whatever difference the driver method's mode leaves is made up
+       * by scaling */
+    case WL_SHELL_SURFACE_FULLSCREEN_METHOD_DRIVER:
+    case WL_SHELL_SURFACE_FULLSCREEN_METHOD_SCALE:
+      scale = MIN (output->width / width, output->height / height);
+      break;
 
-  wl_display_add_global (compositor->wayland_display,
-                         &wl_output_interface,
-                         output,
-                         bind_output);
+      /* Otherwise the surface is centered with black borders */
+    default:
+      break;
+    }
 
-  /* XXX: eventually we will support sliced stages and an output should
-   * correspond to a slice/CoglFramebuffer, but for now we only support
-   * one output so we make sure it always matches the size of the stage
-   */
-  clutter_actor_set_size (compositor->stage, width_mm, height_mm);
+  /* Only actors can be scaled */
+  if (surface->actor)
+    {
+      clutter_actor_set_scale (surface->actor, scale, scale);
+      surface_update_actor_geometry (surface);
+    }
+  else
+    scale = 1.0f;
 
-  compositor->outputs = g_list_prepend (compositor->outputs, output);
+  clayland_surface_set_position (surface,
+                                 output->x +
+                                 (output->width - width * scale) / 2,
+                                 output->y +
+                                 (output->height - height * scale) / 2);
 }
 
-const static struct wl_compositor_interface clayland_compositor_interface = {
-  clayland_compositor_create_surface,
-  clayland_compositor_create_region
-};
-
 static void
-paint_finished_cb (ClutterActor *self, void *user_data)
+shell_surface_place_fullscreen (ClaylandShellSurface *shell_surface)
 {
-  ClaylandCompositor *compositor = user_data;
+  ClaylandOutput *output = shell_surface->output;
+  ClaylandSurface *surface = shell_surface->surface;
+  float width, height;
 
-  while (!wl_list_empty (&compositor->frame_callbacks))
-    {
-      ClaylandFrameCallback *callback =
-        wl_container_of (compositor->frame_callbacks.next, callback, link);
+  clayland_surface_get_size (surface, &width, &height);
+  if (width <= 0 || height <= 0)
+    return;
 
-      wl_resource_post_event (callback->resource,
-                              WL_CALLBACK_DONE,
-                              get_time ());
-      wl_resource_destroy (callback->resource);
+  /* The driver method switches to the smallest mode the surface fits
+   * in. Only the topmost window does, which is the one that becomes
+   * the compositor's fullscreen surface once it covers the output, so
+   * that several such surfaces don't keep switching the mode between
+   * them. A window that isn't on the stage yet is about to be added on
+   * top. Switching the mode doesn't place the surface again. */
+  if (shell_surface->fullscreen_method ==
+      WL_SHELL_SURFACE_FULLSCREEN_METHOD_DRIVER &&
+      (!surface_is_on_stage (surface) ||
+       clayland_stack_get_top_window (shell_surface->compositor) == surface))
+    {
+      output->mode_owner = shell_surface;
+      clayland_output_set_mode (output,
+                                output_find_mode (output, width, height));
     }
+
+  shell_surface_fit_fullscreen (shell_surface);
 }
 
+/* Goes back to the preferred mode if the surface's driver method is
+   what chose the current one */
 static void
-compositor_bind (struct wl_client *client,
-		 void *data,
-                 guint32 version,
-                 guint32 id)
+shell_surface_release_mode (ClaylandShellSurface *shell_surface)
 {
-  ClaylandCompositor *compositor = data;
+  ClaylandOutput *output = shell_surface->output;
 
-  wl_client_add_object (client, &wl_compositor_interface,
-                        &clayland_compositor_interface, id, compositor);
-}
+  if (output == NULL || output->mode_owner != shell_surface)
+    return;
 
-static void
-shell_surface_pong (struct wl_client *client,
-                    struct wl_resource *resource,
-                    guint32 serial)
-{
+  output->mode_owner = NULL;
+  clayland_output_set_mode (output, output->modes->data);
 }
 
 static void
-shell_surface_move (struct wl_client *client,
-                    struct wl_resource *resource,
-                    struct wl_resource *seat,
-                    guint32 serial)
+shell_surface_unset_fullscreen (ClaylandShellSurface *shell_surface)
 {
-}
+  if (!shell_surface->fullscreen)
+    return;
 
-static void
-shell_surface_resize (struct wl_client *client,
-                      struct wl_resource *resource,
-                      struct wl_resource *seat,
-                      guint32 serial,
-                      guint32 edges)
-{
+  shell_surface->fullscreen = FALSE;
+
+  if (shell_surface->surface && shell_surface->surface->actor)
+    {
+      clutter_actor_set_scale (shell_surface->surface->actor, 1.0, 1.0);
+      surface_update_actor_geometry (shell_surface->surface);
+    }
+
+  clayland_compositor_update_fullscreen (shell_surface->compositor);
+
+  shell_surface_release_mode (shell_surface);
 }
 
 static void
 shell_surface_set_toplevel (struct wl_client *client,
                             struct wl_resource *resource)
 {
+  ClaylandShellSurface *shell_surface = wl_resource_get_user_data (resource);
+
+  shell_surface_unset_fullscreen (shell_surface);
+  shell_surface_unset_popup (shell_surface);
 }
 
 static void
@@ -779,20 +2337,174 @@ shell_surface_set_fullscreen (struct wl_client *client,
                               struct wl_resource *resource,
                               guint32 method,
                               guint32 framerate,
-                              struct wl_resource *output)
+                              struct wl_resource *output_resource)
+{
+  ClaylandShellSurface *shell_surface = wl_resource_get_user_data (resource);
+  ClaylandCompositor *compositor = shell_surface->compositor;
+  ClaylandOutput *output;
+
+  if (output_resource)
+    output = wl_resource_get_user_data (output_resource);
+  else
+    output = clayland_compositor_get_surface_output (compositor,
+                                                     shell_surface->surface);
+
+  /* A surface that is already fullscreen may stop using the driver
+   * method or move to another output */
+  if (method != WL_SHELL_SURFACE_FULLSCREEN_METHOD_DRIVER ||
+      output != shell_surface->output)
+    shell_surface_release_mode (shell_surface);
+
+  shell_surface->fullscreen = TRUE;
+  shell_surface->fullscreen_method = method;
+  shell_surface->framerate = framerate;
+  shell_surface->output = output;
+
+  shell_surface_request_configure (shell_surface, 0,
+                                   output->width, output->height);
+
+  if (surface_is_on_stage (shell_surface->surface))
+    {
+      shell_surface_place_fullscreen (shell_surface);
+      clayland_compositor_update_fullscreen (compositor);
+    }
+}
+
+/* Lays out the fullscreen wl_shell surfaces on an output that changed
+   mode. The surfaces using the driver method keep their size and are
+   only scaled to the new mode. None of them gets to switch the mode
+   again from here. */
+static void
+shell_output_changed (ClaylandCompositor *compositor,
+                      ClaylandOutput *output)
+{
+  ClaylandSurface *surface;
+
+  wl_list_for_each (surface, &compositor->stack, stack_link)
+    {
+      ClaylandShellSurface *shell_surface = surface->shell_surface;
+
+      if (!shell_surface ||
+          !shell_surface->fullscreen ||
+          shell_surface->output != output)
+        continue;
+
+      if (shell_surface->fullscreen_method !=
+          WL_SHELL_SURFACE_FULLSCREEN_METHOD_DRIVER)
+        shell_surface_request_configure (shell_surface, 0,
+                                         output->width, output->height);
+
+      shell_surface_fit_fullscreen (shell_surface);
+    }
+}
+
+static void
+shell_surface_place_popup (ClaylandShellSurface *shell_surface)
+{
+  ClaylandSurface *parent = shell_surface->popup_parent;
+  int x = 0, y = 0;
+
+  if (parent)
+    {
+      x = parent->x;
+      y = parent->y;
+    }
+
+  clayland_surface_set_position (shell_surface->surface,
+                                 x + shell_surface->popup_x,
+                                 y + shell_surface->popup_y);
+}
+
+static void
+shell_surface_unset_popup (ClaylandShellSurface *shell_surface)
+{
+  if (!shell_surface->popup)
+    return;
+
+  shell_surface->popup = FALSE;
+
+  clayland_popup_ungrab (&shell_surface->popup_grab);
+
+  if (shell_surface->popup_parent)
+    {
+      wl_list_remove (&shell_surface->popup_parent_destroy_listener.link);
+      shell_surface->popup_parent = NULL;
+    }
+}
+
+static void
+shell_surface_popup_dismiss (ClaylandPopup *popup)
+{
+  ClaylandShellSurface *shell_surface =
+    wl_container_of (popup, shell_surface, popup_grab);
+
+  shell_surface_unset_popup (shell_surface);
+
+  /* Hide the menu straight away rather than waiting for the client to
+   * destroy it */
+  if (shell_surface->surface)
+    clayland_stack_remove_window (shell_surface->compositor,
+                                  shell_surface->surface);
+
+  if (shell_surface->resource)
+    wl_shell_surface_send_popup_done (shell_surface->resource);
+}
+
+static void
+shell_popup_parent_destroy_cb (struct wl_listener *listener,
+                               void *data)
 {
+  ClaylandShellSurface *shell_surface =
+    wl_container_of (listener, shell_surface, popup_parent_destroy_listener);
+
+  wl_list_remove (&shell_surface->popup_parent_destroy_listener.link);
+  shell_surface->popup_parent = NULL;
+
+  shell_surface_popup_dismiss (&shell_surface->popup_grab);
 }
 
 static void
 shell_surface_set_popup (struct wl_client *client,
                          struct wl_resource *resource,
-                         struct wl_resource *seat,
+                         struct wl_resource *seat_resource,
                          guint32 serial,
-                         struct wl_resource *parent,
+                         struct wl_resource *parent_resource,
                          gint32 x,
                          gint32 y,
                          guint32 flags)
 {
+  ClaylandShellSurface *shell_surface = wl_resource_get_user_data (resource);
+  ClaylandSeat *seat = wl_resource_get_user_data (seat_resource);
+  ClaylandSurface *parent = wl_resource_get_user_data (parent_resource);
+  ClaylandSurface *surface = shell_surface->surface;
+
+  if (!surface)
+    return;
+
+  shell_surface_unset_fullscreen (shell_surface);
+  shell_surface_unset_popup (shell_surface);
+
+  shell_surface->popup = TRUE;
+  shell_surface->popup_x = x;
+  shell_surface->popup_y = y;
+  shell_surface->popup_parent = parent;
+  shell_surface->popup_parent_destroy_listener.notify =
+    shell_popup_parent_destroy_cb;
+  wl_resource_add_destroy_listener (parent_resource,
+                                    &shell_surface->popup_parent_destroy_listener);
+
+  /* A new menu gets its window with the first buffer like any other
+   * surface. Reusing a surface for another menu raises it again. */
+  if (surface_is_on_stage (surface))
+    {
+      shell_surface_place_popup (shell_surface);
+      clayland_stack_add_window (shell_surface->compositor, surface);
+    }
+
+  clayland_popup_init (&shell_surface->popup_grab, surface,
+                       shell_surface_popup_dismiss);
+  if (!clayland_popup_grab (&shell_surface->popup_grab, seat, serial))
+    shell_surface_popup_dismiss (&shell_surface->popup_grab);
 }
 
 static void
@@ -834,14 +2546,23 @@ clayland_shell_surface_interface =
 static void
 destroy_shell_surface (ClaylandShellSurface *shell_surface)
 {
+  if (shell_surface->grab)
+    clayland_window_grab_end (shell_surface->grab);
+
+  shell_surface_unset_fullscreen (shell_surface);
+  shell_surface_unset_popup (shell_surface);
+
+  wl_list_remove (&shell_surface->configure_link);
+
   /* In case cleaning up a dead client destroys shell_surface first */
   if (shell_surface->surface)
     {
       wl_list_remove (&shell_surface->surface_destroy_listener.link);
-      shell_surface->surface->has_shell_surface = FALSE;
+      shell_surface->surface->shell_surface = NULL;
+      shell_surface->surface->ping = NULL;
     }
 
-  g_free (shell_surface);
+  clayland_arena_free (shell_surface);
 }
 
 static void
@@ -857,7 +2578,14 @@ shell_handle_surface_destroy (struct wl_listener *listener,
   ClaylandShellSurface *shell_surface =
     wl_container_of (listener, shell_surface, surface_destroy_listener);
 
-  shell_surface->surface->has_shell_surface = FALSE;
+  if (shell_surface->grab)
+    clayland_window_grab_end (shell_surface->grab);
+
+  shell_surface_unset_fullscreen (shell_surface);
+  shell_surface_unset_popup (shell_surface);
+
+  shell_surface->surface->shell_surface = NULL;
+  shell_surface->surface->ping = NULL;
   shell_surface->surface = NULL;
 
   if (shell_surface->resource)
@@ -875,7 +2603,7 @@ get_shell_surface (struct wl_client *client,
   ClaylandSurface *surface = wl_resource_get_user_data (surface_resource);
   ClaylandShellSurface *shell_surface;
 
-  if (surface->has_shell_surface)
+  if (surface->shell_surface)
     {
       wl_resource_post_error (surface_resource,
                               WL_DISPLAY_ERROR_INVALID_OBJECT,
@@ -883,14 +2611,25 @@ get_shell_surface (struct wl_client *client,
       return;
     }
 
-  shell_surface = g_new0 (ClaylandShellSurface, 1);
+  if (surface->configure)
+    {
+      wl_resource_post_error (surface_resource,
+                              WL_DISPLAY_ERROR_INVALID_OBJECT,
+                              "surface already has a role");
+      return;
+    }
+
+  shell_surface = clayland_arena_new0 (client, ClaylandShellSurface);
 
+  shell_surface->compositor = surface->compositor;
   shell_surface->surface = surface;
   shell_surface->surface_destroy_listener.notify = shell_handle_surface_destroy;
   wl_resource_add_destroy_listener (surface->resource,
                                     &shell_surface->surface_destroy_listener);
+  wl_list_init (&shell_surface->configure_link);
 
-  surface->has_shell_surface = TRUE;
+  surface->shell_surface = shell_surface;
+  surface->ping = shell_surface_ping;
 
   shell_surface->resource =
     wl_client_add_object (client,
@@ -1059,64 +2798,23 @@ bind_to_unix_socket (int display)
       unlink (addr.sun_path);
       close (fd);
       return -1;
-  }
-
-  return fd;
-}
-
-static gboolean
-start_xwayland (ClaylandCompositor *compositor)
-{
-  int display = 0;
-  char *lockfile = NULL;
-  int sp[2];
-  pid_t pid;
-
-  do
-    {
-      lockfile = create_lockfile (display, &display);
-      if (!lockfile)
-        {
-         g_warning ("Failed to create an X lock file");
-         return FALSE;
-        }
-
-      compositor->xwayland_abstract_fd = bind_to_abstract_socket (display);
-      if (compositor->xwayland_abstract_fd < 0)
-        {
-          unlink (lockfile);
-
-          if (errno == EADDRINUSE)
-            {
-              display++;
-              continue;
-            }
-          else
-            return FALSE;
-        }
-
-      compositor->xwayland_unix_fd = bind_to_unix_socket (display);
-      if (compositor->xwayland_abstract_fd < 0)
-        {
-          unlink (lockfile);
-          close (compositor->xwayland_abstract_fd);
-          return FALSE;
-        }
-
-      break;
-    }
-  while (1);
+  }
 
-  compositor->xwayland_display_index = display;
-  compositor->xwayland_lockfile = lockfile;
+  return fd;
+}
+
+static gboolean
+launch_xwayland (ClaylandCompositor *compositor)
+{
+  int sp[2];
+  pid_t pid;
 
   /* We want xwayland to be a wayland client so we make a socketpair to setup a
    * wayland protocol connection. */
   if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0)
     {
       g_warning ("socketpair failed\n");
-      unlink (lockfile);
-      return 1;
+      return FALSE;
     }
 
   switch ((pid = fork()))
@@ -1125,12 +2823,17 @@ start_xwayland (ClaylandCompositor *compositor)
         {
           char *fd_string;
           char *display_name;
+          sigset_t mask;
           /* Make sure the client end of the socket pair doesn't get closed
            * when we exec xwayland. */
           int flags = fcntl (sp[1], F_GETFD);
           if (flags != -1)
             fcntl (sp[1], F_SETFD, flags & ~FD_CLOEXEC);
 
+          /* The signal mask is inherited across exec */
+          sigemptyset (&mask);
+          sigprocmask (SIG_SETMASK, &mask, NULL);
+
           fd_string = g_strdup_printf ("%d", sp[1]);
           setenv ("WAYLAND_SOCKET", fd_string, 1);
           g_free (fd_string);
@@ -1165,29 +2868,275 @@ start_xwayland (ClaylandCompositor *compositor)
         wl_client_create (compositor->wayland_display, sp[0]);
 
       compositor->xwayland_pid = pid;
+      compositor->xwayland_start_time = g_get_monotonic_time ();
       break;
 
     case -1:
-      g_error ("Failed to fork for xwayland server");
+      g_warning ("Failed to fork for xwayland server");
+      close (sp[0]);
+      close (sp[1]);
       return FALSE;
     }
 
   return TRUE;
 }
 
+static void
+unwatch_xwayland_sockets (ClaylandCompositor *compositor)
+{
+  if (compositor->xwayland_abstract_source)
+    {
+      wl_event_source_remove (compositor->xwayland_abstract_source);
+      compositor->xwayland_abstract_source = NULL;
+    }
+
+  if (compositor->xwayland_unix_source)
+    {
+      wl_event_source_remove (compositor->xwayland_unix_source);
+      compositor->xwayland_unix_source = NULL;
+    }
+}
+
+static int
+xwayland_socket_cb (int fd,
+                    uint32_t mask,
+                    void *data)
+{
+  ClaylandCompositor *compositor = data;
+
+  g_message ("X client connected to :%d, starting X Wayland",
+             compositor->xwayland_display_index);
+
+  /* The connection is left pending in the listen queue and gets
+   * accepted by the X server once it's been handed the sockets. Until
+   * the server goes away it's the one listening on them. */
+  unwatch_xwayland_sockets (compositor);
+
+  if (!launch_xwayland (compositor))
+    {
+      int client_fd;
+
+      g_warning ("Failed to start X Wayland server");
+
+      /* Turn the client away instead of spinning on the socket */
+      client_fd = accept (fd, NULL, NULL);
+      if (client_fd >= 0)
+        close (client_fd);
+
+      watch_xwayland_sockets (compositor);
+    }
+
+  return 0;
+}
+
+static void
+watch_xwayland_sockets (ClaylandCompositor *compositor)
+{
+  if (compositor->xwayland_abstract_source)
+    return;
+
+  compositor->xwayland_abstract_source =
+    wl_event_loop_add_fd (compositor->wayland_loop,
+                          compositor->xwayland_abstract_fd,
+                          WL_EVENT_READABLE,
+                          xwayland_socket_cb,
+                          compositor);
+  compositor->xwayland_unix_source =
+    wl_event_loop_add_fd (compositor->wayland_loop,
+                          compositor->xwayland_unix_fd,
+                          WL_EVENT_READABLE,
+                          xwayland_socket_cb,
+                          compositor);
+}
+
+static int
+xwayland_restart_timer_cb (void *data)
+{
+  ClaylandCompositor *compositor = data;
+
+  watch_xwayland_sockets (compositor);
+
+  return 0;
+}
+
+/* Called once the X server has been reaped. The lock file and the
+ * listening sockets stay as they are so that X clients connecting in
+ * the meantime just wait in the listen queue for the next server. */
+static void
+xwayland_exited (ClaylandCompositor *compositor,
+                 int status)
+{
+  gint64 lifetime = g_get_monotonic_time () - compositor->xwayland_start_time;
+  gboolean crashed = !WIFEXITED (status) || WEXITSTATUS (status) != 0;
+
+  compositor->xwayland_pid = 0;
+  compositor->xwayland_client = NULL;
+  compositor->xserver_resource = NULL;
+  if (compositor->xwm)
+    {
+      clayland_xwm_free (compositor->xwm);
+      compositor->xwm = NULL;
+    }
+
+  if (crashed && lifetime < XWAYLAND_STABLE_TIME)
+    compositor->xwayland_crashes++;
+  else
+    compositor->xwayland_crashes = 0;
+
+  if (compositor->xwayland_crashes)
+    {
+      int delay = XWAYLAND_RESTART_MIN_DELAY;
+      int i;
+
+      for (i = 1;
+           i < compositor->xwayland_crashes &&
+           delay < XWAYLAND_RESTART_MAX_DELAY;
+           i++)
+        delay *= 2;
+      delay = MIN (delay, XWAYLAND_RESTART_MAX_DELAY);
+
+      g_warning ("X Wayland crashed; restarting it on demand in %dms",
+                 delay);
+      wl_event_source_timer_update (compositor->xwayland_restart_timer,
+                                    delay);
+    }
+  else
+    /* The server is started again by the next X client */
+    watch_xwayland_sockets (compositor);
+}
+
+/* Reserves an X display and listens on its sockets. X Wayland is only
+ * started once an X client connects to one of them. */
+static gboolean
+init_xwayland (ClaylandCompositor *compositor)
+{
+  int display = 0;
+  char *lockfile = NULL;
+  char *display_name;
+
+  do
+    {
+      lockfile = create_lockfile (display, &display);
+      if (!lockfile)
+        {
+         g_warning ("Failed to create an X lock file");
+         return FALSE;
+        }
+
+      compositor->xwayland_abstract_fd = bind_to_abstract_socket (display);
+      if (compositor->xwayland_abstract_fd < 0)
+        {
+          unlink (lockfile);
+          g_free (lockfile);
+
+          if (errno == EADDRINUSE)
+            {
+              display++;
+              continue;
+            }
+          else
+            return FALSE;
+        }
+
+      compositor->xwayland_unix_fd = bind_to_unix_socket (display);
+      if (compositor->xwayland_unix_fd < 0)
+        {
+          unlink (lockfile);
+          g_free (lockfile);
+          close (compositor->xwayland_abstract_fd);
+          return FALSE;
+        }
+
+      break;
+    }
+  while (1);
+
+  compositor->xwayland_display_index = display;
+  compositor->xwayland_lockfile = lockfile;
+
+  /* Let our children find the X server */
+  display_name = g_strdup_printf (":%d", display);
+  setenv ("DISPLAY", display_name, 1);
+  g_message ("X display %s is ready", display_name);
+  g_free (display_name);
+
+  compositor->xwayland_restart_timer =
+    wl_event_loop_add_timer (compositor->wayland_loop,
+                             xwayland_restart_timer_cb,
+                             compositor);
+
+  watch_xwayland_sockets (compositor);
+
+  return TRUE;
+}
+
 static void
 stop_xwayland (ClaylandCompositor *compositor)
 {
   char path[256];
 
-  snprintf (path, sizeof path, "/tmp/.X%d-lock",
-            compositor->xwayland_display_index);
-  unlink (path);
+  if (compositor->xwm)
+    {
+      clayland_xwm_free (compositor->xwm);
+      compositor->xwm = NULL;
+    }
+
+  /* The SIGCHLD handler is gone by now so the server is reaped here */
+  if (compositor->xwayland_pid)
+    {
+      kill (compositor->xwayland_pid, SIGTERM);
+      waitpid (compositor->xwayland_pid, NULL, 0);
+      compositor->xwayland_pid = 0;
+    }
+
+  unwatch_xwayland_sockets (compositor);
+  if (compositor->xwayland_restart_timer)
+    {
+      wl_event_source_remove (compositor->xwayland_restart_timer);
+      compositor->xwayland_restart_timer = NULL;
+    }
+
+  close (compositor->xwayland_abstract_fd);
+  close (compositor->xwayland_unix_fd);
+
   snprintf (path, sizeof path, "/tmp/.X11-unix/X%d",
             compositor->xwayland_display_index);
   unlink (path);
 
   unlink (compositor->xwayland_lockfile);
+  g_free (compositor->xwayland_lockfile);
+  compositor->xwayland_lockfile = NULL;
+}
+
+/* Disconnects all of the clients, which releases their surfaces and
+ * buffers, and then frees everything the compositor owns */
+static void
+shutdown_compositor (ClaylandCompositor *compositor)
+{
+  remove_signal_handlers ();
+
+  if (compositor->xwayland_lockfile)
+    stop_xwayland (compositor);
+
+  wl_display_destroy_clients (compositor->wayland_display);
+
+  clayland_xdg_shell_free (compositor->xdg_shell);
+  clayland_viewporter_free (compositor->viewporter);
+  if (compositor->headless)
+    clayland_headless_free (compositor->headless);
+  clayland_seat_free (compositor->seat);
+
+  wl_event_source_remove (compositor->ping_timer);
+  wl_event_source_remove (compositor->fullscreen_frame_timer);
+  g_list_free_full (compositor->outputs,
+                    (GDestroyNotify) clayland_output_free);
+  compositor->outputs = NULL;
+  g_hash_table_destroy (compositor->clients);
+
+  g_source_destroy (compositor->wayland_event_source);
+  g_source_unref (compositor->wayland_event_source);
+
+  wl_display_destroy (compositor->wayland_display);
 }
 
 static void
@@ -1196,31 +3145,14 @@ xserver_set_window_id (struct wl_client *client,
                        struct wl_resource *surface_resource,
                        guint32 id)
 {
-#if 0
   ClaylandCompositor *compositor =
     wl_resource_get_user_data (compositor_resource);
-  struct wlsc_wm *wm = wxs->wm;
   ClaylandSurface *surface = wl_resource_get_user_data (surface_resource);
-  struct wlsc_wm_window *window;
 
-  if (client != wxs->client)
+  if (client != compositor->xwayland_client || !compositor->xwm)
     return;
 
-  window = wl_hash_table_lookup (wm->window_hash, id);
-  if (window == NULL)
-    {
-      g_warning ("set_window_id for unknown window %d", id);
-      return;
-    }
-
-  g_message ("set_window_id %d for surface %p", id, surface);
-
-  window->surface = (struct wlsc_surface *) surface;
-  window->surface_destroy_listener.func = surface_destroy;
-  wl_list_insert(surface->resource.destroy_listener_list.prev,
-                 &window->surface_destroy_listener.link);
-#endif
-  g_message ("TODO: xserver_set_window_id");
+  clayland_xwm_set_window_id (compositor->xwm, surface, id);
 }
 
 static const struct xserver_interface xserver_implementation = {
@@ -1234,6 +3166,7 @@ bind_xserver (struct wl_client *client,
               guint32 id)
 {
   ClaylandCompositor *compositor = data;
+  int sv[2];
 
   /* If it's a different client than the xserver we launched,
    * don't start the wm. */
@@ -1245,7 +3178,22 @@ bind_xserver (struct wl_client *client,
                           &xserver_implementation, id,
                           compositor);
 
-  /* TODO: Become the window manager for the xserver */
+  /* The server treats the other end of this pair as an X client
+   * which is how we connect to it as its window manager */
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    g_warning ("socketpair failed for the X window manager");
+  else
+    {
+      wl_resource_post_event (compositor->xserver_resource,
+                              XSERVER_CLIENT, sv[1]);
+      /* Send the fd now rather than when the loop next flushes the
+       * clients, so the server can answer the window manager's
+       * connection setup straight away */
+      wl_client_flush (client);
+      close (sv[1]);
+
+      compositor->xwm = clayland_xwm_new (compositor, sv[0]);
+    }
 
   wl_resource_post_event (compositor->xserver_resource,
                           XSERVER_LISTEN_SOCKET,
@@ -1254,61 +3202,80 @@ bind_xserver (struct wl_client *client,
   wl_resource_post_event (compositor->xserver_resource,
                           XSERVER_LISTEN_SOCKET,
                           compositor->xwayland_unix_fd);
-  g_warning ("bind_xserver");
 }
 
-static gboolean
-signal_handler (GIOChannel *source,
-                GIOCondition condition,
-                void *data)
+static int
+signal_cb (int signal_number,
+           void *data)
 {
   ClaylandCompositor *compositor = data;
-  char signal;
-  int count;
+  GList *l;
 
-  for (;;)
+  switch (signal_number)
     {
-      count = read (signal_pipe[0], &signal, 1);
-      if (count == EINTR)
-        continue;
-      if (count < 0)
+    case SIGINT:
+    case SIGTERM:
+      g_message ("Received signal %d, shutting down", signal_number);
+      if (main_loop)
+        g_main_loop_quit (main_loop);
+      else
+        clutter_main_quit ();
+      break;
+    case SIGCHLD:
         {
-          const char *msg = strerror (errno);
-          g_warning ("Error handling signal: %s", msg);
+          int status;
+          pid_t pid;
+
+          /* Signals get merged so one SIGCHLD can stand for several
+           * children */
+          while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+            if (pid == compositor->xwayland_pid)
+              xwayland_exited (compositor, status);
         }
-      if (count != 1)
+      break;
+    case SIGUSR1:
+      /* Cycles every output through its modes so that mode changes can
+       * be tried without a client using the driver fullscreen method */
+      for (l = compositor->outputs; l; l = l->next)
         {
-          g_warning ("Unexpectedly failed to read byte from signal pipe\n");
-          return TRUE;
+          ClaylandOutput *output = l->data;
+          GList *mode = g_list_find (output->modes, output->current_mode);
+
+          output->mode_owner = NULL;
+          clayland_output_set_mode (output,
+                                    mode && mode->next ?
+                                    mode->next->data :
+                                    output->modes->data);
         }
       break;
     }
-  switch (signal)
-    {
-    case 'I': /* SIGINT */
-      /* TODO: cleanup gracefully */
-      abort ();
-      break;
-    case 'C': /* SIGCHLD */
-        {
-          int status;
-          pid_t pid = waitpid (-1, &status, WNOHANG);
 
-          /* The simplest measure to avoid infinitely re-spawning a crashing
-           * X server */
-          if (!WIFEXITED (status))
-              g_critical ("X Wayland crashed; aborting");
+  return 0;
+}
 
-          if (pid == compositor->xwayland_pid)
-            if (!start_xwayland (compositor))
-              g_critical ("Failed to re-start X Wayland server");
-        }
-      break;
-    default:
-      g_warning ("Spurious character '%c' read from signal pipe", signal);
-    }
+static void
+add_signal_handlers (ClaylandCompositor *compositor)
+{
+  int i;
 
-  return TRUE;
+  for (i = 0; i < G_N_ELEMENTS (handled_signals); i++)
+    signal_sources[i] = wl_event_loop_add_signal (compositor->wayland_loop,
+                                                  handled_signals[i],
+                                                  signal_cb,
+                                                  compositor);
+}
+
+static void
+remove_signal_handlers (void)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (handled_signals); i++)
+    if (signal_sources[i])
+      {
+        wl_event_source_remove (signal_sources[i]);
+        signal_sources[i] = NULL;
+      }
 }
 
 static gboolean
@@ -1329,40 +3296,201 @@ event_cb (ClutterActor *stage,
 
       clayland_keyboard_set_focus (&compositor->seat->keyboard, surface);
       clayland_data_device_set_keyboard_focus (compositor->seat);
+
+      /* Clicks within a menu don't raise anything */
+      if (!compositor->seat->popup_grab &&
+          clayland_stack_raise_window (compositor, surface))
+        clayland_compositor_update_fullscreen (compositor);
     }
 
   return FALSE;
 }
 
+/* Parses a mode such as the argument of --headless, which looks like
+ * 1024x768@60 */
+static gboolean
+parse_mode (const char *mode,
+            int *width,
+            int *height,
+            int *refresh)
+{
+  double hz = 60.0;
+  int n, end = -1;
+
+  /* end is the length of what was parsed so that trailing garbage
+   * such as in "1024x768foo" is rejected */
+  n = sscanf (mode, "%dx%d%n@%lf%n", width, height, &end, &hz, &end);
+
+  if (n < 2 || end < 0 || mode[end] != '\0' ||
+      *width <= 0 || *height <= 0 || !(hz * 1000 < G_MAXINT))
+    return FALSE;
+
+  /* The refresh rate is in mHz so a tiny one rounds down to 0 */
+  *refresh = hz * 1000;
+  if (*refresh <= 0)
+    return FALSE;
+
+  return TRUE;
+}
+
+typedef struct
+{
+  int x, y;
+  /* List of ClaylandMode */
+  GList *modes;
+} ClaylandOutputConfig;
+
+static ClaylandMode *
+mode_new (int width,
+          int height,
+          int refresh)
+{
+  ClaylandMode *mode = g_new0 (ClaylandMode, 1);
+
+  mode->width = width;
+  mode->height = height;
+  mode->refresh = refresh;
+
+  return mode;
+}
+
+/* Parses the argument of --output, which is a list of the modes the
+ * output supports, the preferred one first, optionally followed by the
+ * position of the output in the stage, like 1024x768@60,800x600+800+0 */
+static gboolean
+parse_output (const char *spec,
+              ClaylandOutputConfig *config)
+{
+  const char *position = strchr (spec, '+');
+  char *modes, **mode_specs;
+  int n = 0, i;
+
+  config->x = 0;
+  config->y = 0;
+  config->modes = NULL;
+
+  if (position)
+    {
+      if (sscanf (position, "+%d+%d%n", &config->x, &config->y, &n) != 2 ||
+          position[n] != '\0' ||
+          config->x < 0 || config->y < 0)
+        return FALSE;
+
+      modes = g_strndup (spec, position - spec);
+    }
+  else
+    modes = g_strdup (spec);
+
+  mode_specs = g_strsplit (modes, ",", -1);
+  g_free (modes);
+
+  for (i = 0; mode_specs[i]; i++)
+    {
+      int width, height, refresh;
+
+      if (!parse_mode (mode_specs[i], &width, &height, &refresh))
+        {
+          g_list_free_full (config->modes, g_free);
+          config->modes = NULL;
+          break;
+        }
+
+      config->modes = g_list_append (config->modes,
+                                     mode_new (width, height, refresh));
+    }
+
+  g_strfreev (mode_specs);
+
+  return config->modes != NULL;
+}
+
 int
 main (int argc, char **argv)
 {
-  GIOChannel *signal_reciever;
-  struct sigaction signal_action;
+  sigset_t signal_mask;
   ClaylandCompositor compositor;
+  GOptionContext *context;
+  GError *error = NULL;
+  int width = 800, height = 600, refresh = 60000;
+  GArray *output_configs;
+  int i;
 
   memset (&compositor, 0, sizeof (compositor));
 
-  pipe (signal_pipe);
+  /* Clutter is only initialized once we know we're not headless */
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, options, NULL);
+  g_option_context_add_group (context,
+                              clutter_get_option_group_without_init ());
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_clear_error (&error);
+      g_option_context_free (context);
+      return 1;
+    }
+  g_option_context_free (context);
+
+  if (option_headless &&
+      !parse_mode (option_headless, &width, &height, &refresh))
+    {
+      g_printerr ("Invalid headless mode \"%s\"\n", option_headless);
+      return 1;
+    }
+
+  /* Without any --output there is a single output of the size of the
+   * stage */
+  output_configs = g_array_new (FALSE, FALSE, sizeof (ClaylandOutputConfig));
+  for (i = 0; option_outputs && option_outputs[i]; i++)
+    {
+      ClaylandOutputConfig config;
+
+      if (!parse_output (option_outputs[i], &config))
+        {
+          g_printerr ("Invalid output \"%s\"\n", option_outputs[i]);
+          return 1;
+        }
+
+      g_array_append_val (output_configs, config);
+    }
+  if (output_configs->len == 0)
+    {
+      ClaylandOutputConfig config = { 0, 0, NULL };
+
+      config.modes = g_list_append (NULL, mode_new (width, height, refresh));
+      g_array_append_val (output_configs, config);
+    }
 
-  signal_reciever = g_io_channel_unix_new (signal_pipe[0]);
-  g_io_add_watch (signal_reciever, G_IO_IN, signal_handler, &compositor);
+  /* This has to happen before any threads are created so that they
+   * all inherit the mask and the signals only reach the signalfd */
+  sigemptyset (&signal_mask);
+  for (i = 0; i < G_N_ELEMENTS (handled_signals); i++)
+    sigaddset (&signal_mask, handled_signals[i]);
+  sigprocmask (SIG_BLOCK, &signal_mask, NULL);
 
-  signal_action.sa_handler = report_signal;
-  signal_action.sa_flags = 0;
-  sigaction (SIGINT, &signal_action, NULL);
-  sigaction (SIGCHLD, &signal_action, NULL);
+  /* The clipboard manager writes directly into pipes handed to us by
+   * clients which may have gone away by the time we write */
+  signal (SIGPIPE, SIG_IGN);
 
   compositor.wayland_display = wl_display_create ();
   if (compositor.wayland_display == NULL)
     g_error ("failed to create wayland display");
 
-  wl_list_init (&compositor.frame_callbacks);
+  clayland_arena_init (compositor.wayland_display);
 
-  if (!wl_display_add_global (compositor.wayland_display,
-                              &wl_compositor_interface,
-			      &compositor,
-                              compositor_bind))
+  wl_list_init (&compositor.stack);
+  wl_signal_init (&compositor.frame_signal);
+  wl_signal_init (&compositor.output_changed_signal);
+  wl_list_init (&compositor.shell_configure_list);
+  wl_list_init (&compositor.fullscreen_frame_callbacks);
+  compositor.clients = g_hash_table_new (NULL, NULL);
+  wl_signal_init (&compositor.client_unresponsive_signal);
+
+  if (!wl_global_create (compositor.wayland_display,
+                         &wl_compositor_interface,
+                         COMPOSITOR_VERSION,
+                         &compositor,
+                         compositor_bind))
     g_error ("Failed to register wayland compositor object");
 
   wl_display_init_shm (compositor.wayland_display);
@@ -1373,47 +3501,122 @@ main (int argc, char **argv)
     wayland_event_source_new (compositor.wayland_display);
   g_source_attach (compositor.wayland_event_source, NULL);
 
-  clutter_wayland_set_compositor_display (compositor.wayland_display);
+  add_signal_handlers (&compositor);
 
-  if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
-    return 1;
+  compositor.ping_timer = wl_event_loop_add_timer (compositor.wayland_loop,
+                                                   ping_timer_cb,
+                                                   &compositor);
+  wl_event_source_timer_update (compositor.ping_timer, PING_INTERVAL);
+
+  compositor.fullscreen_frame_timer =
+    wl_event_loop_add_timer (compositor.wayland_loop,
+                             fullscreen_frame_timer_cb,
+                             &compositor);
+
+  /* There's no way to know the physical size so it's made up from
+   * the preferred mode */
+  for (i = 0; i < output_configs->len; i++)
+    {
+      ClaylandOutputConfig *config =
+        &g_array_index (output_configs, ClaylandOutputConfig, i);
+      ClaylandMode *preferred = config->modes->data;
+
+      clayland_compositor_create_output (&compositor,
+                                         config->x, config->y,
+                                         preferred->width,
+                                         preferred->height,
+                                         config->modes);
+    }
+  g_array_free (output_configs, TRUE);
+
+  if (option_headless)
+    {
+      /* Cogl can only upload ARGB8888 and XRGB8888 so the other
+       * formats are only accepted by the software renderer */
+      clayland_shm_convert_add_formats (compositor.wayland_display);
+
+      compositor.headless =
+        clayland_headless_new (&compositor,
+                               option_render_threads > 0 ?
+                               option_render_threads :
+                               g_get_num_processors (),
+                               option_dump_frames);
+    }
+  else
+    {
+      clutter_wayland_set_compositor_display (compositor.wayland_display);
+
+      if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
+        {
+          g_warning ("Failed to initialize Clutter");
+          return 1;
+        }
 
-  compositor.stage = clutter_stage_new ();
-  clutter_stage_set_user_resizable (CLUTTER_STAGE (compositor.stage), FALSE);
-  g_signal_connect_after (compositor.stage, "paint",
-                          G_CALLBACK (paint_finished_cb), &compositor);
+      compositor.stage = clutter_stage_new ();
+      clutter_stage_set_user_resizable (CLUTTER_STAGE (compositor.stage),
+                                        FALSE);
+      /* Clutter can only paint the stage into one framebuffer so the
+       * outputs share its frame clock */
+      update_stage_size (&compositor);
+      g_signal_connect_after (compositor.stage, "paint",
+                              G_CALLBACK (paint_finished_cb), &compositor);
+    }
 
   clayland_data_device_manager_init (compositor.wayland_display);
 
-  compositor.seat = clayland_seat_new (compositor.wayland_display);
+  compositor.seat = clayland_seat_new (&compositor);
 
-  g_signal_connect (compositor.stage,
-                    "event",
-                    G_CALLBACK (event_cb),
-                    &compositor);
+  if (option_clipboard_manager)
+    compositor.seat->clipboard = clayland_clipboard_new (compositor.seat);
+
+  if (compositor.stage)
+    {
+      clayland_seat_init_overlay (compositor.seat, compositor.stage);
 
-  g_signal_connect (compositor.stage,
-                    "destroy",
-                    G_CALLBACK (clutter_main_quit),
-                    NULL /* user_data */);
+      g_signal_connect (compositor.stage,
+                        "event",
+                        G_CALLBACK (event_cb),
+                        &compositor);
 
-  clayland_compositor_create_output (&compositor, 0, 0, 800, 600);
+      g_signal_connect (compositor.stage,
+                        "destroy",
+                        G_CALLBACK (clutter_main_quit),
+                        NULL /* user_data */);
+    }
 
   if (wl_display_add_global (compositor.wayland_display, &wl_shell_interface,
                              &compositor, bind_shell) == NULL)
     g_error ("Failed to register a global shell object");
 
-  clutter_actor_show (compositor.stage);
+  compositor.xdg_shell = clayland_xdg_shell_init (&compositor);
+  compositor.viewporter = clayland_viewporter_init (&compositor);
+
+  if (compositor.stage)
+    clutter_actor_show (compositor.stage);
 
   if (wl_display_add_socket (compositor.wayland_display, "wayland-0"))
     g_error ("Failed to create socket");
 
+  /* X Wayland needs the wl_drm interface from EGL so it can't be run
+   * headless */
+  if (compositor.headless)
+    {
+      main_loop = g_main_loop_new (NULL, FALSE);
+      g_main_loop_run (main_loop);
+      g_main_loop_unref (main_loop);
+      main_loop = NULL;
+
+      shutdown_compositor (&compositor);
+
+      return 0;
+    }
+
   wl_display_add_global (compositor.wayland_display,
                          &xserver_interface,
                          &compositor,
                          bind_xserver);
 
-  /* XXX: It's important that we only try and start xwayland after we have
+  /* XXX: It's important that we only let xwayland get started after we have
    * initialized EGL because EGL implements the "wl_drm" interface which
    * xwayland requires to determine what drm device name it should use.
    *
@@ -1422,14 +3625,12 @@ main (int argc, char **argv)
    * initialized by this point.
    */
 
-  if (!start_xwayland (&compositor))
+  if (!init_xwayland (&compositor))
     return 1;
 
   clutter_main ();
 
-  stop_xwayland (&compositor);
-
-  /* FIXME: free the input device */
+  shutdown_compositor (&compositor);
 
   return 0;
 }